@@ -0,0 +1,406 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "chip8.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*********************************
+    chip8-aot
+
+    Static recompiler, translates a ROM into a C file for the runtime in
+    aot_runtime.c (see aot.h). Code is found by recursive descent from
+    START_ADDRESS: jump and call targets, both sides of every skip and the
+    return address of every call start a new basic block. Bnnn and 00EE
+    only know their target at runtime, they go through a switch over all
+    block addresses and leave to the interpreter if the target is unknown.
+
+    usage: chip8-aot rom.ch8 out.c
+    then:  clang out.c aot_runtime.c aot_main.c chip8.c -O2 -o rom-aot
+ *********************************/
+
+typedef struct Recompiler {
+  u8 memory[MEMORY_SIZE];
+  u32 rom_end; // one past the last byte of the ROM
+  u8 is_code[MEMORY_SIZE];
+  u8 is_leader[MEMORY_SIZE];
+  u16 worklist[MEMORY_SIZE];
+  u32 worklist_count;
+
+  // filled by find_blocks
+  int block_of[MEMORY_SIZE]; // -1 for addresses that are not code
+  u16 block_start[MEMORY_SIZE];
+  u16 block_end[MEMORY_SIZE];
+  u32 block_count;
+  u32 instruction_count;
+} Recompiler;
+
+static u16 opcode_at(const Recompiler *rc, u16 address) {
+  return (rc->memory[address] << 8) | rc->memory[address + 1];
+}
+
+static int in_rom(const Recompiler *rc, u32 address) {
+  return address >= START_ADDRESS && address + 1 < rc->rom_end;
+}
+
+static void visit(Recompiler *rc, u32 address) {
+  if (in_rom(rc, address) && !rc->is_code[address]) {
+    rc->is_code[address] = 1;
+    rc->worklist[rc->worklist_count++] = address;
+  }
+}
+
+// address is reached by a jump, so it has to start a block
+static void add_target(Recompiler *rc, u32 address) {
+  if (in_rom(rc, address)) {
+    rc->is_leader[address] = 1;
+    visit(rc, address);
+  }
+}
+
+// instructions after which the block ends
+static int ends_block(Chip8Op op) {
+  switch (op) {
+  case OP_00EE:
+  case OP_1nnn:
+  case OP_2nnn:
+  case OP_3xkk:
+  case OP_4xkk:
+  case OP_5xy0:
+  case OP_9xy0:
+  case OP_Bnnn:
+  case OP_Ex9E:
+  case OP_ExA1:
+  case OP_Fx0A:
+  case OP_Fx33: // may write to code, the next block checks if it went stale
+  case OP_Fx55:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static void find_code(Recompiler *rc) {
+  add_target(rc, START_ADDRESS);
+  while (rc->worklist_count > 0) {
+    u16 address = rc->worklist[--rc->worklist_count];
+    u16 opcode = opcode_at(rc, address);
+    u16 nnn = opcode & 0x0FFF;
+    Chip8Op op = decode_opcode(opcode);
+
+    switch (op) {
+    case OP_00EE:
+    case OP_Bnnn:
+      break;
+    case OP_1nnn:
+      add_target(rc, nnn);
+      break;
+    case OP_2nnn:
+      add_target(rc, nnn);
+      add_target(rc, address + 2);
+      break;
+    case OP_3xkk:
+    case OP_4xkk:
+    case OP_5xy0:
+    case OP_9xy0:
+    case OP_Ex9E:
+    case OP_ExA1:
+      add_target(rc, address + 2);
+      add_target(rc, address + 4);
+      break;
+    case OP_Fx0A:
+      // repeats itself until a key is pressed
+      add_target(rc, address);
+      add_target(rc, address + 2);
+      break;
+    default:
+      if (ends_block(op)) {
+        add_target(rc, address + 2);
+      } else {
+        visit(rc, address + 2);
+      }
+      break;
+    }
+  }
+}
+
+static void find_blocks(Recompiler *rc) {
+  for (u32 address = 0; address < MEMORY_SIZE; address++) {
+    rc->block_of[address] = -1;
+  }
+  for (u32 start = START_ADDRESS; start < MEMORY_SIZE; start++) {
+    if (!rc->is_leader[start]) {
+      continue;
+    }
+    u32 index = rc->block_count++;
+    u32 address = start;
+    for (;;) {
+      rc->block_of[address] = index;
+      rc->instruction_count++;
+      u32 next = address + 2;
+      if (ends_block(decode_opcode(opcode_at(rc, address))) || !in_rom(rc, next) ||
+          !rc->is_code[next] || rc->is_leader[next]) {
+        break;
+      }
+      address = next;
+    }
+    rc->block_start[index] = start;
+    rc->block_end[index] = address + 2;
+  }
+}
+
+// instructions from address to the end of its block
+static u32 remaining_count(const Recompiler *rc, u16 address) {
+  return (rc->block_end[rc->block_of[address]] - address) / 2;
+}
+
+static void emit_jump(FILE *out, const Recompiler *rc, u32 target) {
+  if (target < MEMORY_SIZE && rc->is_leader[target]) {
+    fprintf(out, "goto b_%03X;", target);
+  } else {
+    fprintf(out, "AOT_EXIT(0x%03X);", target);
+  }
+}
+
+static void emit_skip(FILE *out, const Recompiler *rc, u16 address, const char *condition) {
+  fprintf(out, "  if (%s) {\n    ", condition);
+  emit_jump(out, rc, address + 4);
+  fprintf(out, "\n  }\n  ");
+  emit_jump(out, rc, address + 2);
+  fprintf(out, "\n");
+}
+
+static void emit_instruction(FILE *out, const Recompiler *rc, u16 address) {
+  u16 opcode = opcode_at(rc, address);
+  u8 x = (opcode & 0x0F00) >> 8;
+  u8 y = (opcode & 0x00F0) >> 4;
+  u8 n = opcode & 0x000F;
+  u8 kk = opcode & 0x00FF;
+  u16 nnn = opcode & 0x0FFF;
+  Chip8Op op = decode_opcode(opcode);
+  char condition[64];
+
+  fprintf(out, "  // 0x%03X: %04X\n", address, opcode);
+  switch (op) {
+  case OP_ILLEGAL:
+    // op_illegal reads the opcode back from pc
+    fprintf(out, "  chip8->pc = 0x%03X;\n  op_illegal(chip8, NULL);\n", address + 2);
+    break;
+  case OP_0nnn:
+    // SYS calls are ignored
+    break;
+  case OP_00EE:
+    fprintf(out, "  chip8->sp--;\n  chip8->pc = chip8->stack[chip8->sp & STACK_MASK];\n  goto dispatch;\n");
+    break;
+  case OP_1nnn:
+    fprintf(out, "  ");
+    emit_jump(out, rc, nnn);
+    fprintf(out, "\n");
+    break;
+  case OP_2nnn:
+    fprintf(out, "  chip8->stack[chip8->sp & STACK_MASK] = 0x%03X;\n  chip8->sp++;\n  ", address + 2);
+    emit_jump(out, rc, nnn);
+    fprintf(out, "\n");
+    break;
+  case OP_3xkk:
+    sprintf(condition, "V[0x%X] == 0x%02X", x, kk);
+    emit_skip(out, rc, address, condition);
+    break;
+  case OP_4xkk:
+    sprintf(condition, "V[0x%X] != 0x%02X", x, kk);
+    emit_skip(out, rc, address, condition);
+    break;
+  case OP_5xy0:
+    sprintf(condition, "V[0x%X] == V[0x%X]", x, y);
+    emit_skip(out, rc, address, condition);
+    break;
+  case OP_9xy0:
+    sprintf(condition, "V[0x%X] != V[0x%X]", x, y);
+    emit_skip(out, rc, address, condition);
+    break;
+  case OP_Ex9E:
+    sprintf(condition, "key_down(chip8, V[0x%X])", x);
+    emit_skip(out, rc, address, condition);
+    break;
+  case OP_ExA1:
+    sprintf(condition, "!key_down(chip8, V[0x%X])", x);
+    emit_skip(out, rc, address, condition);
+    break;
+  case OP_6xkk:
+    fprintf(out, "  V[0x%X] = 0x%02X;\n", x, kk);
+    break;
+  case OP_7xkk:
+    fprintf(out, "  V[0x%X] += 0x%02X;\n", x, kk);
+    break;
+  case OP_8xy0:
+    fprintf(out, "  V[0x%X] = V[0x%X];\n", x, y);
+    break;
+  // the flag updates below follow the op_* handlers exactly, including
+  // which value of Vy they see when x == y or x == F
+  case OP_8xy4:
+    fprintf(out, "  {\n    u16 sum = V[0x%X] + V[0x%X];\n    V[0x%X] = sum & 0xFF;\n"
+                 "    V[0xF] = sum > 255;\n  }\n",
+            x, y, x);
+    break;
+  case OP_8xy5:
+    fprintf(out, "  {\n    u8 temp = V[0x%X];\n    V[0x%X] -= V[0x%X];\n"
+                 "    V[0xF] = temp >= V[0x%X];\n  }\n",
+            x, x, y, y);
+    break;
+  case OP_8xy7:
+    fprintf(out, "  {\n    u8 temp = V[0x%X];\n    V[0x%X] = V[0x%X] - V[0x%X];\n"
+                 "    V[0xF] = temp <= V[0x%X];\n  }\n",
+            x, x, y, x, y);
+    break;
+  case OP_Annn:
+    fprintf(out, "  chip8->I = 0x%03X;\n", nnn);
+    break;
+  case OP_Bnnn:
+    // which register is added depends on the quirk profile
+    fprintf(out, "  AOT_CALL(Bnnn, %u, %u, %u, 0x%02X, 0x%03X);\n  goto dispatch;\n", x, y, n, kk, nnn);
+    break;
+  case OP_Fx07:
+    fprintf(out, "  V[0x%X] = chip8->delay_timer;\n", x);
+    break;
+  case OP_Fx0A:
+    // op_Fx0A moves pc back onto itself while no key is pressed
+    fprintf(out, "  chip8->pc = 0x%03X;\n  AOT_CALL(Fx0A, %u, %u, %u, 0x%02X, 0x%03X);\n  goto dispatch;\n",
+            address + 2, x, y, n, kk, nnn);
+    break;
+  case OP_Fx15:
+    fprintf(out, "  chip8->delay_timer = V[0x%X];\n", x);
+    break;
+  case OP_Fx18:
+    fprintf(out, "  chip8->sound_timer = V[0x%X];\n", x);
+    break;
+  case OP_Fx1E:
+    fprintf(out, "  chip8->I = (chip8->I + V[0x%X]) & ADDRESS_MASK;\n", x);
+    break;
+  case OP_Fx29:
+    fprintf(out, "  chip8->I = FONTSET_START_ADDRESS + V[0x%X] * 5;\n", x);
+    break;
+  default:
+    // everything else (drawing, random numbers, memory access, the logic
+    // ops with their quirks) runs through the interpreter's handler
+    fprintf(out, "  AOT_CALL(%s, %u, %u, %u, 0x%02X, 0x%03X);\n", op_names[op], x, y, n, kk, nnn);
+    break;
+  }
+
+  if (!ends_block(op) && rc->block_end[rc->block_of[address]] == address + 2) {
+    // the block was cut because the next instruction starts another one
+    fprintf(out, "  ");
+    emit_jump(out, rc, address + 2);
+    fprintf(out, "\n");
+  }
+}
+
+// writes name the way it can go inside a C string literal and a // comment:
+// quotes, backslashes, ? (trigraphs) and anything but printable ASCII as
+// three digit octal escapes, which no following character can extend
+static void emit_escaped(FILE *out, const char *name) {
+  for (const u8 *c = (const u8 *)name; *c != '\0'; c++) {
+    if (*c < 0x20 || *c > 0x7E || *c == '"' || *c == '\\' || *c == '?') {
+      fprintf(out, "\\%03o", *c);
+    } else {
+      fputc(*c, out);
+    }
+  }
+}
+
+static void emit_program(FILE *out, const Recompiler *rc, const char *rom_name) {
+  fprintf(out, "// generated by chip8-aot from ");
+  emit_escaped(out, rom_name);
+  fprintf(out, ", do not edit\n");
+  fprintf(out, "#include \"aot.h\"\n\n");
+
+  fprintf(out, "static const u8 image[] = {");
+  for (u32 address = START_ADDRESS; address < rc->rom_end; address++) {
+    fprintf(out, "%s0x%02X,", (address - START_ADDRESS) % 16 == 0 ? "\n    " : " ", rc->memory[address]);
+  }
+  fprintf(out, "\n};\n\n");
+
+  fprintf(out, "static const AotBlock blocks[] = {\n");
+  for (u32 i = 0; i < rc->block_count; i++) {
+    fprintf(out, "    {0x%03X, 0x%03X},\n", rc->block_start[i], rc->block_end[i]);
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "static u32 run(Chip8 *chip8, const u8 *stale, u32 n) {\n");
+  fprintf(out, "  u8 *V = chip8->V;\n\n");
+  // only 00EE, Bnnn and Fx0A come back to the switch
+  int dynamic_jumps = 0;
+  for (u32 address = START_ADDRESS; address < MEMORY_SIZE; address++) {
+    if (rc->block_of[address] >= 0) {
+      Chip8Op op = decode_opcode(opcode_at(rc, address));
+      dynamic_jumps |= op == OP_00EE || op == OP_Bnnn || op == OP_Fx0A;
+    }
+  }
+  fprintf(out, "%s  switch (chip8->pc) {\n", dynamic_jumps ? "dispatch:\n" : "");
+  for (u32 address = START_ADDRESS; address < MEMORY_SIZE; address++) {
+    int block = rc->block_of[address];
+    if (block < 0) {
+      continue;
+    }
+    if (rc->is_leader[address]) {
+      fprintf(out, "  case 0x%03X:\n    goto b_%03X;\n", address, address);
+    } else {
+      // entering in the middle of a block, e.g. after the budget ran out
+      fprintf(out, "  case 0x%03X:\n    AOT_ENTER(%d, %u, 0x%03X);\n    goto i_%03X;\n", address, block,
+              remaining_count(rc, address), address, address);
+    }
+  }
+  fprintf(out, "  default:\n    return n;\n  }\n");
+
+  for (u32 i = 0; i < rc->block_count; i++) {
+    u16 start = rc->block_start[i];
+    fprintf(out, "\nb_%03X:\n", start);
+    if (idle_loop_length(rc->memory, start) != 0) {
+      fprintf(out, "  AOT_IDLE(0x%03X);\n", start);
+    }
+    fprintf(out, "  AOT_ENTER(%u, %u, 0x%03X);\n", i, remaining_count(rc, start), start);
+    for (u32 address = start; address < rc->block_end[i]; address += 2) {
+      if (address != start) {
+        fprintf(out, "i_%03X:\n", address);
+      }
+      emit_instruction(out, rc, address);
+    }
+  }
+  fprintf(out, "}\n\n");
+
+  fprintf(out, "const AotProgram aot_program = {\"");
+  emit_escaped(out, rom_name);
+  fprintf(out, "\", image, sizeof(image), blocks, %u, %u, run};\n", rc->block_count, rc->instruction_count);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    printf("usage: %s rom.ch8 out.c\n", argv[0]);
+    return 1;
+  }
+
+  static Recompiler rc;
+  FILE *rom_file = fopen(argv[1], "rb");
+  if (rom_file == NULL) {
+    printf("Error opening the ROM, errno: %d\n", errno);
+    return 1;
+  }
+  size_t rom_size = fread(rc.memory + START_ADDRESS, 1, MEMORY_SIZE - START_ADDRESS, rom_file);
+  fclose(rom_file);
+  rc.rom_end = START_ADDRESS + rom_size;
+
+  find_code(&rc);
+  find_blocks(&rc);
+
+  FILE *out = fopen(argv[2], "w");
+  if (out == NULL) {
+    printf("Error opening `%s`, errno: %d\n", argv[2], errno);
+    return 1;
+  }
+  const char *rom_name = strrchr(argv[1], '/');
+  rom_name = rom_name != NULL ? rom_name + 1 : argv[1];
+  emit_program(out, &rc, rom_name);
+  fclose(out);
+
+  printf("%s: %u blocks, %u instructions\n", rom_name, rc.block_count, rc.instruction_count);
+  return 0;
+}
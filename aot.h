@@ -0,0 +1,89 @@
+#ifndef CHIP8_AOT_H
+#define CHIP8_AOT_H
+
+#include "chip8.h"
+#include <stddef.h>
+
+/*********************************
+    Ahead-of-time compiled ROMs
+
+    chip8-aot turns a .ch8 file into a C file defining `aot_program`, every
+    basic block it could reach from START_ADDRESS becomes a labeled region
+    of one big run function. That file is compiled together with this
+    runtime (aot_runtime.c) and chip8.c.
+
+    The translated code only knows the ROM as it was at compile time. Blocks
+    whose bytes are written at runtime (Fx33, Fx55, load_rom) are marked
+    stale and executed by the interpreter from then on, as is everything the
+    recompiler could not reach statically (e.g. Bnnn targets).
+ *********************************/
+
+typedef struct AotBlock {
+  u16 start; // address of the first instruction
+  u16 end;   // one past the last byte of the last instruction
+} AotBlock;
+
+// runs up to n instructions of translated code starting at chip8->pc
+// returns the number of instructions left once it hits an address it has no
+// (valid) code for or a block that does not fit into the remaining budget
+typedef u32 (*AotRunFunc)(Chip8 *chip8, const u8 *stale, u32 n);
+
+typedef struct AotProgram {
+  const char *rom_name;
+  const u8 *image; // the ROM the program was compiled from
+  u16 image_size;
+  const AotBlock *blocks;
+  u16 block_count;
+  u32 instruction_count;
+  AotRunFunc run;
+} AotProgram;
+
+typedef struct Chip8Aot Chip8Aot;
+
+typedef struct Chip8AotStats {
+  u32 stale_blocks;     // blocks dropped because code was written to
+  uint64_t native;      // instructions run by translated code
+  uint64_t interpreted; // instructions run by the interpreter instead
+} Chip8AotStats;
+
+// attaches program to chip8, the ROM has to be loaded already
+// blocks that do not match the loaded memory start out stale
+Chip8Aot *aot_create(Chip8 *chip8, const AotProgram *program);
+void aot_destroy(Chip8Aot *aot);
+// runs exactly n instructions
+void aot_run(Chip8Aot *aot, u32 n);
+const Chip8AotStats *aot_stats(const Chip8Aot *aot);
+void aot_print_stats(const Chip8Aot *aot);
+
+/*********************************
+    used by the generated code
+ *********************************/
+
+// entering `count` instructions of block `index` at `addr`, gives up if they
+// do not fit into the budget or the block was overwritten
+#define AOT_ENTER(index, count, addr)   \
+  if (n < (count) || stale[(index)]) { \
+    chip8->pc = (addr);                 \
+    return n;                           \
+  }                                     \
+  n -= (count)
+
+// fast-forwards the timer/key polling loop starting at addr, if it is idle
+#define AOT_IDLE(addr) \
+  chip8->pc = (addr);  \
+  n -= skip_idle_loop(chip8, n)
+
+// leaves translated code, the runtime continues at addr
+#define AOT_EXIT(addr) \
+  chip8->pc = (addr);  \
+  return n
+
+// calls the handler of an instruction that is not translated inline, through
+// the handler table so it follows the quirk profile picked at load time
+#define AOT_CALL(name, x, y, nibble, kk, nnn)                                             \
+  do {                                                                                    \
+    static const Chip8Insn insn_ = {NULL, OP_##name, FUSION_NONE, x, y, nibble, kk, nnn}; \
+    chip8->handlers[OP_##name](chip8, &insn_);                                            \
+  } while (0)
+
+#endif
@@ -0,0 +1,92 @@
+#define _POSIX_C_SOURCE 199309L
+#include "aot.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*********************************
+    Headless runner for a ROM compiled with chip8-aot
+
+    Runs the compiled program and the table interpreter for the same number
+    of instructions from the same seed, checks that both end up in the same
+    state and prints the emulated instructions per second of each.
+
+    usage: rom-aot [instructions]
+ *********************************/
+
+#define INSTRUCTIONS_PER_FRAME 12 // same pacing as chip8-bench
+
+extern const AotProgram aot_program; // defined by the generated file
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void load_image(Chip8 *chip8) {
+  memset(chip8, 0, sizeof(*chip8));
+  init_chip8(chip8);
+  memcpy(chip8->memory + START_ADDRESS, aot_program.image, aot_program.image_size);
+  seed_random(chip8, 1);
+}
+
+static void tick_timers(Chip8 *chip8) {
+  if (chip8->delay_timer > 0) chip8->delay_timer--;
+  if (chip8->sound_timer > 0) chip8->sound_timer--;
+}
+
+int main(int argc, char **argv) {
+  u32 instructions = 50000000;
+  if (argc > 1) {
+    instructions = strtoul(argv[1], NULL, 10);
+  }
+  instructions -= instructions % INSTRUCTIONS_PER_FRAME;
+
+  static Chip8 reference;
+  static Chip8 chip8;
+
+  load_image(&reference);
+  double start = now_seconds();
+  for (u32 done = 0; done < instructions; done += INSTRUCTIONS_PER_FRAME) {
+    for (u32 i = 0; i < INSTRUCTIONS_PER_FRAME; i++) {
+      process_instruction(&reference);
+    }
+    tick_timers(&reference);
+  }
+  double interpreter_seconds = now_seconds() - start;
+
+  load_image(&chip8);
+  if (enable_decode_cache(&chip8) != 0) {
+    return 1;
+  }
+  Chip8Aot *aot = aot_create(&chip8, &aot_program);
+  if (aot == NULL) {
+    return 1;
+  }
+  start = now_seconds();
+  for (u32 done = 0; done < instructions; done += INSTRUCTIONS_PER_FRAME) {
+    aot_run(aot, INSTRUCTIONS_PER_FRAME);
+    tick_timers(&chip8);
+  }
+  double aot_seconds = now_seconds() - start;
+
+  int differs = memcmp(&reference, &chip8, offsetof(Chip8, opcode)) != 0;
+  if (differs) {
+    printf("%s: state of the compiled program differs from the interpreter\n", aot_program.rom_name);
+  }
+  printf("%-12s %-10s %12s %8s\n", "rom", "engine", "MIPS", "speedup");
+  printf("%-12s %-10s %12.2f %7.2fx\n", aot_program.rom_name, "table",
+         instructions / interpreter_seconds / 1e6, 1.0);
+  printf("%-12s %-10s %12.2f %7.2fx\n", aot_program.rom_name, "aot",
+         instructions / aot_seconds / 1e6, interpreter_seconds / aot_seconds);
+  aot_print_stats(aot);
+  printf("aot: %u idle loops, %llu instructions elided\n", chip8.idle_skips,
+         (unsigned long long)chip8.idle_elided);
+
+  aot_destroy(aot);
+  free_decode_cache(&chip8);
+  return differs;
+}
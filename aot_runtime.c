@@ -0,0 +1,102 @@
+#include "aot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*********************************
+    Runtime for ahead-of-time compiled ROMs
+
+    aot_run hands the budget to the translated run function, which only
+    returns when it reaches an address it has no code for, a stale block, or
+    a block that no longer fits into the budget. Those instructions are
+    executed one at a time by the interpreter before trying again.
+ *********************************/
+
+struct Chip8Aot {
+  Chip8 *chip8;
+  const AotProgram *program;
+  u8 *stale; // one flag per block of the program
+  Chip8AotStats stats;
+};
+
+static void mark_stale(Chip8Aot *aot, u32 address, u32 end) {
+  const AotProgram *program = aot->program;
+  for (u32 i = 0; i < program->block_count; i++) {
+    const AotBlock *block = &program->blocks[i];
+    if (!aot->stale[i] && block->start < end && block->end > address) {
+      aot->stale[i] = 1;
+      aot->stats.stale_blocks++;
+    }
+  }
+}
+
+static void aot_code_write(Chip8 *chip8, u16 address, u16 length) {
+  mark_stale(chip8->code_write_data, address, (u32)address + length);
+}
+
+Chip8Aot *aot_create(Chip8 *chip8, const AotProgram *program) {
+  Chip8Aot *aot = calloc(1, sizeof(Chip8Aot));
+  u8 *stale = calloc(program->block_count + 1, 1);
+  if (aot == NULL || stale == NULL) {
+    printf("Error allocating the AOT runtime\n");
+    free(aot);
+    free(stale);
+    return NULL;
+  }
+  aot->chip8 = chip8;
+  aot->program = program;
+  aot->stale = stale;
+
+  // the loaded ROM may differ from the one the program was compiled from
+  for (u32 i = 0; i < program->block_count; i++) {
+    const AotBlock *block = &program->blocks[i];
+    u32 offset = block->start - START_ADDRESS;
+    if (block->end - START_ADDRESS > program->image_size ||
+        memcmp(&chip8->memory[block->start], &program->image[offset], block->end - block->start) != 0) {
+      mark_stale(aot, block->start, block->end);
+    }
+  }
+
+  chip8->on_code_write = aot_code_write;
+  chip8->code_write_data = aot;
+  return aot;
+}
+
+void aot_destroy(Chip8Aot *aot) {
+  if (aot == NULL) {
+    return;
+  }
+  if (aot->chip8->code_write_data == aot) {
+    aot->chip8->on_code_write = NULL;
+    aot->chip8->code_write_data = NULL;
+  }
+  free(aot->stale);
+  free(aot);
+}
+
+void aot_run(Chip8Aot *aot, u32 n) {
+  Chip8 *chip8 = aot->chip8;
+  while (n > 0) {
+    u32 left = aot->program->run(chip8, aot->stale, n);
+    aot->stats.native += n - left;
+    n = left;
+    if (n > 0) {
+      process_instruction_cached(chip8);
+      aot->stats.interpreted++;
+      n--;
+    }
+  }
+}
+
+const Chip8AotStats *aot_stats(const Chip8Aot *aot) {
+  return &aot->stats;
+}
+
+void aot_print_stats(const Chip8Aot *aot) {
+  const AotProgram *program = aot->program;
+  const Chip8AotStats *stats = aot_stats(aot);
+  printf("aot: %s, %u blocks (%u instructions), %u stale\n", program->rom_name,
+         program->block_count, program->instruction_count, stats->stale_blocks);
+  printf("aot: %llu instructions native, %llu interpreted\n",
+         (unsigned long long)stats->native, (unsigned long long)stats->interpreted);
+}
@@ -0,0 +1,463 @@
+#define _POSIX_C_SOURCE 199309L
+#include "chip8.h"
+#include "sched.h"
+#include "script.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*********************************
+    chip8-batch
+
+    Runs every job of a manifest headless on a pool of worker threads and
+    prints one result line per job, in manifest order, followed by the
+    totals. A job is a ROM, a quirk profile, an input script and a budget
+    of instructions:
+
+      # rom          quirks  input      cycles
+      br8kout.ch8    -       keys.txt   1000000
+      Space.ch8      chip48  -          500000
+
+    `-` picks the profile from the file extension or runs without input.
+    Relative paths are taken as they are, not relative to the manifest.
+
+    Every worker owns a range of the job list, takes jobs from its front and
+    steals the back half of another worker's range once its own is empty, so
+    a few long jobs do not leave the other threads idle. ROMs and scripts are
+    read once up front and shared read only, each job gets its own Chip8.
+
+    usage: chip8-batch manifest.txt [options]
+      --threads n   worker threads, one per core by default
+      --ips n       instructions per second, 700 by default
+      --seed n      seed for Cxkk, 1 by default
+      --out file    write the results there instead of stdout
+ *********************************/
+
+#define BATCH_NONE 0xFFFFFFFF
+
+typedef struct BatchFile {
+  char *name;
+  u8 *data;
+  u32 size;
+  Chip8Script script;
+} BatchFile;
+
+typedef struct BatchJob {
+  u32 line; // in the manifest, for the results
+  u32 rom;  // index into the loaded files
+  u32 input;
+  int quirks; // -1: by file extension
+  uint64_t cycles;
+} BatchJob;
+
+typedef struct BatchResult {
+  uint64_t hash;
+  uint64_t instructions;
+  uint64_t frames;
+  double seconds;
+  u16 pc;
+  u16 I;
+  u8 V[16];
+  u8 quirks;
+  u8 worker;
+} BatchResult;
+
+typedef struct Batch Batch;
+
+typedef struct BatchWorker {
+  // [begin, end) of the jobs left to this worker, begin in the low 32 bits.
+  // The owner takes from the front and thieves from the back, both with a
+  // compare-and-swap of the whole range
+  uint64_t range;
+  u8 pad[64 - sizeof(uint64_t)]; // the ranges are hammered by every thread
+  Batch *batch;
+  pthread_t thread;
+  u32 id;
+  u32 jobs;
+  u32 steals;
+  double busy;
+} BatchWorker;
+
+struct Batch {
+  BatchFile *files;
+  u32 file_count;
+  BatchJob *jobs;
+  u32 job_count;
+  BatchResult *results;
+  BatchWorker *workers;
+  u32 worker_count;
+  u32 ips;
+  uint64_t seed;
+};
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*********************************
+    work stealing
+ *********************************/
+
+static uint64_t make_range(u32 begin, u32 end) {
+  return (uint64_t)end << 32 | begin;
+}
+
+// next job of the worker's own range, BATCH_NONE once it is empty
+static u32 take_job(BatchWorker *worker) {
+  uint64_t range = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    u32 begin = (u32)range;
+    u32 end = range >> 32;
+    if (begin >= end) {
+      return BATCH_NONE;
+    }
+    if (__atomic_compare_exchange_n(&worker->range, &range, make_range(begin + 1, end), 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+      return begin;
+    }
+  }
+}
+
+// moves the back half of victim's jobs to the (empty) range of thief
+static int steal_jobs(BatchWorker *thief, BatchWorker *victim) {
+  uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    u32 begin = (u32)range;
+    u32 end = range >> 32;
+    if (begin >= end) {
+      return 0;
+    }
+    u32 split = end - (end - begin + 1) / 2;
+    if (__atomic_compare_exchange_n(&victim->range, &range, make_range(begin, split), 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&thief->range, make_range(split, end), __ATOMIC_RELEASE);
+      thief->steals++;
+      return 1;
+    }
+  }
+}
+
+/*********************************
+    jobs
+ *********************************/
+
+static void run_job(Batch *batch, Chip8 *chip8, const BatchJob *job, BatchResult *result) {
+  const BatchFile *rom = &batch->files[job->rom];
+  double start = now_seconds();
+
+  memset(chip8, 0, sizeof(*chip8));
+  init_chip8(chip8);
+  seed_random(chip8, batch->seed);
+  enable_decode_cache(chip8);
+  load_rom_image(chip8, rom->data, rom->size);
+  set_quirks(chip8, job->quirks >= 0 ? (Chip8Quirks)job->quirks : quirks_for_rom(rom->name));
+
+  static const Chip8Script no_input = {0};
+  const Chip8Script *script = job->input != BATCH_NONE ? &batch->files[job->input].script : &no_input;
+  u32 cursor = 0;
+  Chip8Sched sched;
+  sched_init(&sched, run_fused, batch->ips, start);
+  for (uint64_t frame = 0; sched.instructions < job->cycles; frame++) {
+    set_keypad(chip8, script_keys(script, &cursor, frame));
+    sched_run_frame(&sched, chip8, job->cycles);
+  }
+
+  result->hash = video_hash(chip8);
+  result->instructions = sched.instructions;
+  result->frames = sched.ticks;
+  result->pc = chip8->pc;
+  result->I = chip8->I;
+  memcpy(result->V, chip8->V, sizeof(result->V));
+  result->quirks = chip8->quirks;
+  free_decode_cache(chip8);
+  result->seconds = now_seconds() - start;
+}
+
+static void *worker_main(void *arg) {
+  BatchWorker *worker = arg;
+  Batch *batch = worker->batch;
+  Chip8 *chip8 = malloc(sizeof(Chip8));
+  if (chip8 == NULL) {
+    printf("Error allocating a Chip8 for worker %u\n", worker->id);
+    return NULL;
+  }
+
+  for (;;) {
+    u32 job = take_job(worker);
+    if (job == BATCH_NONE) {
+      // nothing left here, look for work in the other ranges, round robin
+      // starting at the next worker so the thieves spread out
+      int stolen = 0;
+      for (u32 i = 1; i < batch->worker_count && !stolen; i++) {
+        stolen = steal_jobs(worker, &batch->workers[(worker->id + i) % batch->worker_count]);
+      }
+      if (!stolen) {
+        break;
+      }
+      continue;
+    }
+    run_job(batch, chip8, &batch->jobs[job], &batch->results[job]);
+    batch->results[job].worker = worker->id;
+    worker->busy += batch->results[job].seconds;
+    worker->jobs++;
+  }
+
+  free(chip8);
+  return NULL;
+}
+
+/*********************************
+    manifest
+ *********************************/
+
+// index of the file in the batch, read the first time it is asked for
+static u32 find_file(Batch *batch, const char *name, int is_script) {
+  for (u32 i = 0; i < batch->file_count; i++) {
+    if (strcmp(batch->files[i].name, name) == 0) {
+      return i;
+    }
+  }
+  BatchFile *files = realloc(batch->files, (batch->file_count + 1) * sizeof(BatchFile));
+  if (files == NULL) {
+    return BATCH_NONE;
+  }
+  batch->files = files;
+  BatchFile *file = &files[batch->file_count];
+  memset(file, 0, sizeof(*file));
+
+  if (is_script) {
+    if (script_load(&file->script, name) != 0) {
+      return BATCH_NONE;
+    }
+  } else {
+    FILE *rom_file = fopen(name, "rb");
+    if (rom_file == NULL) {
+      printf("Error opening `%s`\n", name);
+      return BATCH_NONE;
+    }
+    file->data = malloc(ROM_SIZE_MAX);
+    file->size = file->data != NULL ? fread(file->data, 1, ROM_SIZE_MAX, rom_file) : 0;
+    int too_big = fgetc(rom_file) != EOF;
+    fclose(rom_file);
+    if (file->data == NULL || too_big) {
+      printf("`%s` does not fit into memory, at most %d bytes\n", name, ROM_SIZE_MAX);
+      free(file->data);
+      return BATCH_NONE;
+    }
+  }
+  file->name = malloc(strlen(name) + 1);
+  strcpy(file->name, name);
+  return batch->file_count++;
+}
+
+static int load_manifest(Batch *batch, const char *file_name) {
+  FILE *file = fopen(file_name, "r");
+  if (file == NULL) {
+    printf("Error opening manifest `%s`\n", file_name);
+    return -1;
+  }
+
+  char line[1024];
+  u32 line_number = 0;
+  u32 capacity = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line_number++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char rom[512], quirks[32], input[512];
+    unsigned long long cycles;
+    int fields = sscanf(line, "%511s %31s %511s %llu", rom, quirks, input, &cycles);
+    if (fields <= 0) {
+      continue; // blank
+    }
+    BatchJob job = {line_number, BATCH_NONE, BATCH_NONE, -1, cycles};
+    if (fields != 4 || (strcmp(quirks, "-") != 0 && (job.quirks = quirks_by_name(quirks)) < 0)) {
+      printf("%s:%u: expected `rom quirks input cycles`\n", file_name, line_number);
+      fclose(file);
+      return -1;
+    }
+    if ((job.rom = find_file(batch, rom, 0)) == BATCH_NONE ||
+        (strcmp(input, "-") != 0 && (job.input = find_file(batch, input, 1)) == BATCH_NONE)) {
+      printf("%s:%u: skipping the rest of the manifest\n", file_name, line_number);
+      fclose(file);
+      return -1;
+    }
+
+    if (batch->job_count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      BatchJob *jobs = realloc(batch->jobs, capacity * sizeof(BatchJob));
+      if (jobs == NULL) {
+        printf("Error allocating %u jobs\n", capacity);
+        fclose(file);
+        return -1;
+      }
+      batch->jobs = jobs;
+    }
+    batch->jobs[batch->job_count++] = job;
+  }
+  fclose(file);
+  return 0;
+}
+
+static void free_batch(Batch *batch) {
+  for (u32 i = 0; i < batch->file_count; i++) {
+    free(batch->files[i].name);
+    free(batch->files[i].data);
+    script_free(&batch->files[i].script);
+  }
+  free(batch->files);
+  free(batch->jobs);
+  free(batch->results);
+  free(batch->workers);
+}
+
+/*********************************
+    results
+ *********************************/
+
+static void print_results(FILE *out, const Batch *batch) {
+  fprintf(out, "%-5s %-20s %-7s %12s %8s %-18s %-5s %-5s %-32s %9s %3s\n", "line", "rom", "quirks", "instructions",
+          "frames", "video_hash", "pc", "I", "V", "ms", "thr");
+  for (u32 i = 0; i < batch->job_count; i++) {
+    const BatchJob *job = &batch->jobs[i];
+    const BatchResult *result = &batch->results[i];
+    char registers[33];
+    for (u32 r = 0; r < 16; r++) {
+      sprintf(&registers[r * 2], "%02X", result->V[r]);
+    }
+    fprintf(out, "%-5u %-20s %-7s %12llu %8llu 0x%016llX 0x%03X 0x%03X %-32s %9.3f %3u\n", job->line,
+            batch->files[job->rom].name, quirk_flags[result->quirks].name, (unsigned long long)result->instructions,
+            (unsigned long long)result->frames, (unsigned long long)result->hash, result->pc, result->I, registers,
+            result->seconds * 1e3, result->worker);
+  }
+}
+
+static void print_totals(FILE *out, const Batch *batch, double seconds) {
+  uint64_t instructions = 0;
+  for (u32 i = 0; i < batch->job_count; i++) {
+    instructions += batch->results[i].instructions;
+  }
+  u32 steals = 0;
+  double busy = 0;
+  for (u32 i = 0; i < batch->worker_count; i++) {
+    steals += batch->workers[i].steals;
+    busy += batch->workers[i].busy;
+  }
+  fprintf(out, "batch: %u jobs on %u threads in %.3f s, %.1f jobs/s\n", batch->job_count, batch->worker_count,
+          seconds, batch->job_count / seconds);
+  fprintf(out, "batch: %llu instructions, %.2f MIPS, %u steals, %.0f%% busy\n", (unsigned long long)instructions,
+          instructions / seconds / 1e6, steals, busy / (seconds * batch->worker_count) * 100);
+  for (u32 i = 0; i < batch->worker_count; i++) {
+    const BatchWorker *worker = &batch->workers[i];
+    fprintf(out, "worker %u: %u jobs, %u steals, %.3f s busy\n", worker->id, worker->jobs, worker->steals,
+            worker->busy);
+  }
+}
+
+static int usage(const char *name) {
+  printf("usage: %s manifest.txt [--threads n] [--ips n] [--seed n] [--out file]\n", name);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  const char *manifest = NULL;
+  const char *out_name = NULL;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  Batch batch = {0};
+  batch.ips = SCHED_DEFAULT_IPS;
+  batch.seed = 1;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (arg[0] != '-') {
+      manifest = arg;
+      continue;
+    }
+    if (value == NULL) {
+      return usage(argv[0]);
+    }
+    i++;
+    if (strcmp(arg, "--threads") == 0) {
+      threads = strtol(value, NULL, 10);
+    } else if (strcmp(arg, "--ips") == 0) {
+      batch.ips = strtoul(value, NULL, 10);
+    } else if (strcmp(arg, "--seed") == 0) {
+      batch.seed = strtoull(value, NULL, 10);
+    } else if (strcmp(arg, "--out") == 0) {
+      out_name = value;
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (manifest == NULL || batch.ips == 0) {
+    return usage(argv[0]);
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  if (load_manifest(&batch, manifest) != 0) {
+    free_batch(&batch);
+    return 1;
+  }
+  if (threads > batch.job_count) {
+    threads = batch.job_count ? batch.job_count : 1;
+  }
+  batch.worker_count = threads;
+  batch.results = calloc(batch.job_count + 1, sizeof(BatchResult));
+  batch.workers = calloc(batch.worker_count, sizeof(BatchWorker));
+  if (batch.results == NULL || batch.workers == NULL) {
+    printf("Error allocating the results of %u jobs\n", batch.job_count);
+    free_batch(&batch);
+    return 1;
+  }
+  FILE *out = stdout;
+  if (out_name != NULL && (out = fopen(out_name, "w")) == NULL) {
+    printf("Error opening `%s`\n", out_name);
+    free_batch(&batch);
+    return 1;
+  }
+
+  // build the shared tables before the workers race for them
+  init_dispatch_table();
+
+  // contiguous ranges of about the same size to start with, stealing evens
+  // out the rest
+  double start = now_seconds();
+  for (u32 i = 0; i < batch.worker_count; i++) {
+    BatchWorker *worker = &batch.workers[i];
+    worker->batch = &batch;
+    worker->id = i;
+    worker->range = make_range((uint64_t)batch.job_count * i / batch.worker_count,
+                               (uint64_t)batch.job_count * (i + 1) / batch.worker_count);
+  }
+  for (u32 i = 1; i < batch.worker_count; i++) {
+    if (pthread_create(&batch.workers[i].thread, NULL, worker_main, &batch.workers[i]) != 0) {
+      printf("Error starting worker %u, its jobs are stolen by the others\n", i);
+      batch.workers[i].thread = pthread_self();
+    }
+  }
+  worker_main(&batch.workers[0]);
+  for (u32 i = 1; i < batch.worker_count; i++) {
+    if (!pthread_equal(batch.workers[i].thread, pthread_self())) {
+      pthread_join(batch.workers[i].thread, NULL);
+    }
+  }
+  double seconds = now_seconds() - start;
+
+  print_results(out, &batch);
+  print_totals(out, &batch, seconds);
+  if (out != stdout) {
+    fclose(out);
+  }
+  free_batch(&batch);
+  return 0;
+}
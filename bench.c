@@ -0,0 +1,836 @@
+#define _POSIX_C_SOURCE 199309L
+#include "chip8.h"
+#include "chip8_env.h"
+#include "chip8_fork.h"
+#include "expand.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "rewind.h"
+#include "savestate.h"
+#include "sched.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*********************************
+    chip8-bench
+
+    Runs the bundled ROMs headless through every interpreter core and prints
+    the emulated instructions per second. Each core runs the same number of
+    instructions from the same seed, so the final machine states (everything
+    up to Chip8.opcode) have to match.
+    Then measures the framebuffer expansion kernels (expand.h) at a range of
+    scales, their output has to match the scalar kernel's.
+    Then the lockstep kernels (lockstep.h) run LOCKSTEP_LANES_MAX instances
+    of each ROM with different seeds and keys, against as many Chip8s
+    stepped one after the other with process_instruction. Every lane has to
+    end up in the state of its scalar twin.
+    Then save states (savestate.h) are taken every frame and restored
+    SAVESTATE_BEHIND frames later, the way run-ahead uses them. Running the
+    same frames again from the restored state has to reach the same states.
+    Next every frame is captured into a rewind buffer (rewind.h) next to
+    emulating it, then rewound all the way back. Each frame rewound to has
+    to match a save state taken when it was captured, and a recorder
+    subscribed to the dirty rows next to the buffer has to be told about
+    every row that changed. The cost of a capture is shown next to the
+    16.7 ms a 60Hz host frame has.
+    Then a search tree is grown breadth first, each node a copy-on-write
+    fork (chip8_fork.h) and once more a save state, and the nodes of both
+    have to agree. Next to the ROMs, which never write their memory, a
+    small built-in game keeps a score with Fx33 and Fx55, so its forks
+    have to share all pages but the one it writes.
+    Finally each ROM and the built-in game run as a vector environment
+    (chip8_env.h). Every instance step has to match a Chip8 stepped
+    directly, the game's BCD score giving the rewards, and the same
+    actions after a reset have to give the same observations again.
+
+    usage: chip8-bench [instructions per ROM]
+ *********************************/
+
+#define INSTRUCTIONS_PER_FRAME 12 // ~700Hz CPU with 60Hz timers
+
+typedef struct Engine {
+  const char *name;
+  void (*run)(Chip8 *chip8, u32 instructions);
+  // optional, return -1 from setup if the engine is not available
+  int (*setup)(Chip8 *chip8);
+  void (*teardown)(Chip8 *chip8);
+} Engine;
+
+static void run_switch(Chip8 *chip8, u32 instructions) {
+  for (u32 i = 0; i < instructions; i++) {
+    process_instruction_switch(chip8);
+  }
+}
+
+static void run_table(Chip8 *chip8, u32 instructions) {
+  for (u32 i = 0; i < instructions; i++) {
+    process_instruction(chip8);
+  }
+}
+
+static void run_cached(Chip8 *chip8, u32 instructions) {
+  for (u32 i = 0; i < instructions; i++) {
+    process_instruction_cached(chip8);
+  }
+}
+
+// which superinstructions the ROM hit and how often
+static void teardown_fused(Chip8 *chip8) {
+  uint64_t total = 0;
+  for (u32 f = FUSION_NONE + 1; f < FUSION_COUNT; f++) {
+    total += chip8->fusion_hits[f];
+  }
+  if (total == 0) {
+    return;
+  }
+  for (u32 f = FUSION_NONE + 1; f < FUSION_COUNT; f++) {
+    if (chip8->fusion_hits[f] > 0) {
+      printf("fused: %-16s %12llu (%.1f%%)\n", fusion_names[f],
+             (unsigned long long)chip8->fusion_hits[f], 100.0 * chip8->fusion_hits[f] / total);
+    }
+  }
+}
+
+static Chip8Jit *jit;
+
+static int setup_jit(Chip8 *chip8) {
+  jit = jit_create(chip8);
+  return jit == NULL ? -1 : 0;
+}
+
+static void run_jit(Chip8 *chip8, u32 instructions) {
+  (void)chip8;
+  jit_run(jit, instructions);
+}
+
+static void teardown_jit(Chip8 *chip8) {
+  (void)chip8;
+  jit_print_stats(jit);
+  jit_destroy(jit);
+  jit = NULL;
+}
+
+static const Engine engines[] = {
+    {"switch", run_switch, NULL, NULL},
+    {"table", run_table, NULL, NULL},
+    {"predecode", run_cached, NULL, NULL},
+    {"run_cycles", run_cycles, NULL, NULL},
+    {"fused", run_fused, NULL, teardown_fused},
+    {"jit", run_jit, setup_jit, teardown_jit},
+};
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+static const char *roms[] = {"IBM.ch8", "br8kout.ch8", "Space.ch8"};
+#define ROM_COUNT (sizeof(roms) / sizeof(roms[0]))
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// runs `instructions` instructions with timers ticking every frame
+// returns the elapsed wall time in seconds
+static double run_engine(const Engine *engine, Chip8 *chip8, const char *rom, u32 instructions) {
+  free_decode_cache(chip8);
+  memset(chip8, 0, sizeof(*chip8));
+  init_chip8(chip8);
+  if (enable_decode_cache(chip8) != 0) {
+    return -1;
+  }
+  if (engine->setup != NULL && engine->setup(chip8) != 0) {
+    return -1;
+  }
+  seed_random(chip8, 1);
+  if (load_rom(chip8, rom) != 0) {
+    return -1;
+  }
+
+  double start = now_seconds();
+  for (u32 done = 0; done < instructions; done += INSTRUCTIONS_PER_FRAME) {
+    engine->run(chip8, INSTRUCTIONS_PER_FRAME);
+    if (chip8->delay_timer > 0) chip8->delay_timer--;
+    if (chip8->sound_timer > 0) chip8->sound_timer--;
+  }
+  double seconds = now_seconds() - start;
+  if (engine->teardown != NULL) {
+    engine->teardown(chip8);
+  }
+  return seconds;
+}
+
+static const u32 expand_scales[] = {1, 2, 3, 4, 8, 10, 20};
+#define EXPAND_SCALE_COUNT (sizeof(expand_scales) / sizeof(expand_scales[0]))
+#define EXPAND_MAX_SCALE 20
+#define EXPAND_PIXELS (64u << 20) // per kernel and scale
+
+static void bench_expand(void) {
+  static u32 reference[SCREEN_WIDTH * EXPAND_MAX_SCALE * SCREEN_HEIGHT * EXPAND_MAX_SCALE];
+  static u32 out[SCREEN_WIDTH * EXPAND_MAX_SCALE * SCREEN_HEIGHT * EXPAND_MAX_SCALE];
+  static Chip8 chip8;
+  uint64_t seed = 1;
+  for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    chip8.video[y] = seed ^ (seed >> 29);
+  }
+  const u32 on = 0xFFFFFFFF;
+  const u32 off = 0xFF000000;
+
+  printf("\nexpansion kernel: %s\n", expand_kernel_best()->name);
+  printf("%-12s %-10s %12s %8s\n", "scale", "kernel", "Mpixels/s", "speedup");
+  for (size_t s = 0; s < EXPAND_SCALE_COUNT; s++) {
+    u32 scale = expand_scales[s];
+    u32 stride = SCREEN_WIDTH * scale;
+    u32 frame_pixels = SCREEN_WIDTH * SCREEN_HEIGHT * scale * scale;
+    u32 frames = EXPAND_PIXELS / frame_pixels;
+    expand_kernels[0].expand(chip8.video, 0xFFFFFFFF, reference, stride, scale, on, off);
+
+    double baseline = 0;
+    for (u32 k = 0; k < expand_kernel_count; k++) {
+      const ExpandKernel *kernel = &expand_kernels[k];
+      if (!expand_kernel_supported(kernel)) {
+        printf("%-12u %-10s %12s\n", scale, kernel->name, "n/a");
+        continue;
+      }
+      memset(out, 0, frame_pixels * sizeof(u32));
+      double start = now_seconds();
+      for (u32 f = 0; f < frames; f++) {
+        kernel->expand(chip8.video, 0xFFFFFFFF, out, stride, scale, on, off);
+      }
+      double seconds = now_seconds() - start;
+      if (k == 0) {
+        baseline = seconds;
+      }
+      if (memcmp(reference, out, frame_pixels * sizeof(u32)) != 0) {
+        printf("%ux: output of `%s` differs from `%s`\n", scale, kernel->name, expand_kernels[0].name);
+      }
+      printf("%-12u %-10s %12.1f %7.2fx\n", scale, kernel->name, (double)frames * frame_pixels / seconds / 1e6,
+             baseline / seconds);
+    }
+  }
+}
+
+// the keys lane holds during frame: left (4) or right (6), pressed and
+// released at a different pace per lane, so the lanes drift apart
+static u16 lockstep_keys(u32 lane, u32 frame) {
+  return ((frame / (8 + lane)) & 1) ? 1u << (4 + 2 * (lane & 1)) : 0;
+}
+
+static void bench_lockstep(u32 instructions) {
+  static Chip8 scalar[LOCKSTEP_LANES_MAX];
+  static u8 image[ROM_SIZE_MAX];
+  const u32 lanes = LOCKSTEP_LANES_MAX;
+  u32 frames = instructions / lanes / INSTRUCTIONS_PER_FRAME;
+  uint64_t total = (uint64_t)frames * INSTRUCTIONS_PER_FRAME * lanes;
+
+  printf("\nlockstep kernel: %s, %u lanes\n", lockstep_kernel_best()->name, lanes);
+  printf("%-12s %-10s %12s %8s %8s %7s\n", "rom", "kernel", "MIPS", "speedup", "vector", "group");
+  for (size_t r = 0; r < ROM_COUNT; r++) {
+    FILE *file = fopen(roms[r], "rb");
+    if (file == NULL) {
+      printf("%-12s %-10s %12s\n", roms[r], "scalar", "n/a");
+      continue;
+    }
+    u32 size = fread(image, 1, sizeof(image), file);
+    fclose(file);
+    Chip8Quirks quirks = quirks_for_rom(roms[r]);
+
+    // one process_instruction after the other, lane by lane
+    for (u32 lane = 0; lane < lanes; lane++) {
+      memset(&scalar[lane], 0, sizeof(Chip8));
+      init_chip8(&scalar[lane]);
+      seed_random(&scalar[lane], 1 + lane);
+      load_rom_image(&scalar[lane], image, size);
+      set_quirks(&scalar[lane], quirks);
+    }
+    double start = now_seconds();
+    for (u32 frame = 0; frame < frames; frame++) {
+      for (u32 lane = 0; lane < lanes; lane++) {
+        Chip8 *chip8 = &scalar[lane];
+        set_keypad(chip8, lockstep_keys(lane, frame));
+        for (u32 i = 0; i < INSTRUCTIONS_PER_FRAME; i++) {
+          process_instruction(chip8);
+        }
+        if (chip8->delay_timer > 0) chip8->delay_timer--;
+        if (chip8->sound_timer > 0) chip8->sound_timer--;
+      }
+    }
+    double baseline = now_seconds() - start;
+    printf("%-12s %-10s %12.2f %7.2fx\n", roms[r], "loop", total / baseline / 1e6, 1.0);
+
+    for (u32 k = 0; k < lockstep_kernel_count; k++) {
+      const LockstepKernel *kernel = &lockstep_kernels[k];
+      if (!lockstep_kernel_supported(kernel)) {
+        printf("%-12s %-10s %12s\n", roms[r], kernel->name, "n/a");
+        continue;
+      }
+      Chip8Lockstep *lockstep = lockstep_create(lanes, image, size, quirks, 1, kernel);
+      if (lockstep == NULL) {
+        continue;
+      }
+      start = now_seconds();
+      for (u32 frame = 0; frame < frames; frame++) {
+        for (u32 lane = 0; lane < lanes; lane++) {
+          lockstep_set_keys(lockstep, lane, lockstep_keys(lane, frame));
+        }
+        lockstep_run_frame(lockstep, INSTRUCTIONS_PER_FRAME);
+      }
+      double seconds = now_seconds() - start;
+
+      for (u32 lane = 0; lane < lanes; lane++) {
+        if (memcmp(&scalar[lane], lockstep_lane(lockstep, lane), offsetof(Chip8, opcode)) != 0) {
+          printf("%s: lane %u of `%s` differs from the loop\n", roms[r], lane, kernel->name);
+          break;
+        }
+      }
+      const LockstepStats *stats = lockstep_stats(lockstep);
+      printf("%-12s %-10s %12.2f %7.2fx %7.1f%% %7.1f\n", roms[r], kernel->name, total / seconds / 1e6,
+             baseline / seconds, 100.0 * stats->vector / total, (double)total / stats->groups);
+      lockstep_destroy(lockstep);
+    }
+  }
+}
+
+#define SAVESTATE_FRAMES 20000
+#define SAVESTATE_BEHIND 4 // frames between a snapshot and its restore
+
+static void bench_savestate(void) {
+  static Chip8 chip8;
+  static Chip8State states[SAVESTATE_BEHIND + 1];
+  static Chip8State check;
+  static Chip8State again;
+
+  printf("\nsave states: %u bytes\n", (u32)sizeof(Chip8State));
+  printf("%-12s %12s %12s\n", "rom", "snapshot ns", "restore ns");
+  for (size_t r = 0; r < ROM_COUNT; r++) {
+    free_decode_cache(&chip8);
+    memset(&chip8, 0, sizeof(chip8));
+    init_chip8(&chip8);
+    if (enable_decode_cache(&chip8) != 0 || load_rom(&chip8, roms[r]) != 0) {
+      printf("%-12s %12s\n", roms[r], "n/a");
+      continue;
+    }
+    double snapshot = 0;
+    double restore = 0;
+    u32 mismatches = 0;
+    for (u32 f = 0; f < SAVESTATE_FRAMES; f++) {
+      Chip8State *state = &states[f % (SAVESTATE_BEHIND + 1)];
+      double start = now_seconds();
+      savestate_snapshot(&chip8, state);
+      snapshot += now_seconds() - start;
+      run_fused(&chip8, INSTRUCTIONS_PER_FRAME);
+      if (chip8.delay_timer > 0) chip8.delay_timer--;
+      if (chip8.sound_timer > 0) chip8.sound_timer--;
+      if (f < SAVESTATE_BEHIND) {
+        continue;
+      }
+
+      // back to the oldest state and forward again to where this frame ended
+      savestate_snapshot(&chip8, &check);
+      const Chip8State *old = &states[(f + 1) % (SAVESTATE_BEHIND + 1)];
+      start = now_seconds();
+      savestate_restore(&chip8, old);
+      restore += now_seconds() - start;
+      for (u32 i = 0; i < SAVESTATE_BEHIND + 1; i++) {
+        run_fused(&chip8, INSTRUCTIONS_PER_FRAME);
+        if (chip8.delay_timer > 0) chip8.delay_timer--;
+        if (chip8.sound_timer > 0) chip8.sound_timer--;
+      }
+      savestate_snapshot(&chip8, &again);
+      mismatches += memcmp(&again, &check, sizeof(check)) != 0;
+    }
+    printf("%-12s %12.1f %12.1f\n", roms[r], snapshot / SAVESTATE_FRAMES * 1e9,
+           restore / (SAVESTATE_FRAMES - SAVESTATE_BEHIND) * 1e9);
+    if (mismatches > 0) {
+      printf("%s: %u frames ended up elsewhere after a restore\n", roms[r], mismatches);
+    }
+  }
+}
+
+#define REWIND_FRAMES 18000 // 5 minutes
+#define REWIND_BYTES (4u << 20)
+#define REWIND_KEYFRAME 60 // as in the frontend
+#define REWIND_HOST_FRAME (1.0 / 60) // seconds the frontend has for a frame
+
+// the bundled ROM at frame 0 of the rewind bench, NULL if it is missing
+static Chip8 *rewind_machine(size_t rom) {
+  static Chip8 chip8;
+  free_decode_cache(&chip8);
+  memset(&chip8, 0, sizeof(chip8));
+  init_chip8(&chip8);
+  if (enable_decode_cache(&chip8) != 0 || load_rom(&chip8, roms[rom]) != 0) {
+    return NULL;
+  }
+  return &chip8;
+}
+
+static void rewind_frame(Chip8 *chip8, u32 frame) {
+  set_keypad(chip8, lockstep_keys(0, frame));
+  run_fused(chip8, INSTRUCTIONS_PER_FRAME);
+  if (chip8->delay_timer > 0) chip8->delay_timer--;
+  if (chip8->sound_timer > 0) chip8->sound_timer--;
+}
+
+#define REWIND_REPEATS 15 // the best of these is kept, a pass takes a few milliseconds
+
+// seconds to emulate REWIND_FRAMES frames. With a rewind buffer every
+// frame is captured and the seconds spent in rewind_capture, less the cost
+// of reading the clock, are returned instead
+static double rewind_pass(size_t rom, Chip8Rewind *rewind) {
+  Chip8 *chip8 = rewind_machine(rom);
+  if (rewind == NULL) {
+    double start = now_seconds();
+    for (u32 f = 0; f < REWIND_FRAMES; f++) {
+      rewind_frame(chip8, f);
+    }
+    return now_seconds() - start;
+  }
+  // what reading the clock twice adds to every capture timed, at best, so
+  // a read the scheduler got in the way of is never taken off
+  double clock = 1;
+  for (u32 i = 0; i < 1000; i++) {
+    double start = now_seconds();
+    double seconds = now_seconds() - start;
+    clock = seconds < clock ? seconds : clock;
+  }
+  rewind_clear(rewind);
+  double capture = 0;
+  for (u32 f = 0; f < REWIND_FRAMES; f++) {
+    rewind_frame(chip8, f);
+    double start = now_seconds();
+    rewind_capture(rewind, chip8);
+    capture += now_seconds() - start - clock;
+  }
+  return capture;
+}
+
+// frames in which a second subscriber to the dirty rows, a recorder next
+// to the rewind buffer, was not told about a row that changed
+static u32 rewind_missed_rows(size_t rom, Chip8Rewind *rewind) {
+  static uint64_t before[SCREEN_HEIGHT];
+  Chip8 *chip8 = rewind_machine(rom);
+  rewind_clear(rewind);
+  int recorder = video_subscribe(chip8);
+  u32 missed = 0;
+  for (u32 f = 0; f < REWIND_FRAMES; f++) {
+    memcpy(before, chip8->video, sizeof(before));
+    rewind_frame(chip8, f);
+    rewind_capture(rewind, chip8);
+    u32 changed = 0;
+    for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
+      changed |= (u32)(chip8->video[y] != before[y]) << y;
+    }
+    missed += (changed & ~video_take_dirty(chip8, recorder)) != 0;
+  }
+  video_unsubscribe(chip8, recorder);
+  return missed;
+}
+
+static void bench_rewind(void) {
+  static Chip8State states[REWIND_FRAMES];
+  static Chip8State check;
+
+  printf("\nrewind: %u frames into %u KB, a keyframe every %u\n", REWIND_FRAMES, REWIND_BYTES >> 10,
+         REWIND_KEYFRAME);
+  printf("%-12s %12s %12s %8s %10s %12s %10s\n", "rom", "emulate ns", "capture ns", "of emu", "of 60Hz",
+         "bytes/frame", "held");
+  for (size_t r = 0; r < ROM_COUNT; r++) {
+    Chip8 *chip8 = rewind_machine(r);
+    Chip8Rewind *rewind = rewind_create(REWIND_BYTES, REWIND_FRAMES, REWIND_KEYFRAME);
+    if (chip8 == NULL || rewind == NULL) {
+      printf("%-12s %12s\n", roms[r], "n/a");
+      rewind_destroy(rewind);
+      continue;
+    }
+    // a save state of each frame to check the rewound ones against, then
+    // the frames alone and with their captures timed
+    for (u32 f = 0; f < REWIND_FRAMES; f++) {
+      rewind_frame(chip8, f);
+      savestate_snapshot(chip8, &states[f]);
+    }
+    double emulate = 1e9;
+    double capture = 1e9;
+    for (u32 i = 0; i < REWIND_REPEATS; i++) {
+      double seconds = rewind_pass(r, NULL);
+      emulate = seconds < emulate ? seconds : emulate;
+      seconds = rewind_pass(r, rewind);
+      capture = seconds < capture ? seconds : capture;
+    }
+    const RewindStats *stats = rewind_stats(rewind);
+    double capture_seconds = capture / REWIND_FRAMES;
+    printf("%-12s %12.1f %12.1f %7.1f%% %9.4f%% %12.1f %7.1f s\n", roms[r], emulate / REWIND_FRAMES * 1e9,
+           capture_seconds * 1e9, 100 * capture / emulate, 100 * capture_seconds / REWIND_HOST_FRAME,
+           (double)stats->captured_bytes / stats->captured, stats->frames / 60.0);
+
+    u32 missed = rewind_missed_rows(r, rewind);
+    if (missed > 0) {
+      printf("%s: %u frames changed rows a second subscriber was not told about\n", roms[r], missed);
+    }
+    // that pass left chip8 at its newest frame
+    u32 frame = REWIND_FRAMES - 1;
+    u32 mismatches = 0;
+    while (rewind_step(rewind, chip8) == 0) {
+      savestate_snapshot(chip8, &check);
+      mismatches += memcmp(&check, &states[--frame], sizeof(check)) != 0;
+    }
+    if (mismatches > 0) {
+      printf("%s: %u frames rewound to differ from the ones captured\n", roms[r], mismatches);
+    }
+    rewind_destroy(rewind);
+  }
+}
+
+#define FORK_WIDTH 64    // nodes kept per generation
+#define FORK_ACTIONS 4   // children per node
+#define FORK_DEPTH 400   // generations
+#define FORK_FRAMES 2    // frames between a node and its children
+
+static const u16 fork_actions[FORK_ACTIONS] = {0, 1u << 4, 1u << 6, 1u << 4 | 1u << 6};
+
+// the child of node i kept in generation g, one per node with the action
+// going round so the branches drift apart
+static u32 fork_kept(u32 g, u32 i) {
+  return i * FORK_ACTIONS + (g + i) % FORK_ACTIONS;
+}
+
+// adds 1 to V0 while key 4 is held and 3 while key 6 is, and writes it
+// out at 0x400 every round, the page of a child always differs from its
+// parent's then
+static const u8 fork_score_rom[] = {
+    0x61, 0x04, // 200: V1 = 4
+    0x62, 0x06, // 202: V2 = 6
+    0xE1, 0x9E, // 204: skip if key V1
+    0x12, 0x0A, // 206: jump 20A
+    0x70, 0x01, // 208: V0 += 1
+    0xE2, 0x9E, // 20A: skip if key V2
+    0x12, 0x10, // 20C: jump 210
+    0x70, 0x03, // 20E: V0 += 3
+    0xA4, 0x00, // 210: I = 400
+    0xF0, 0x33, // 212: BCD of V0 at I
+    0xA4, 0x10, // 214: I = 410
+    0xF3, 0x55, // 216: V0..V3 at I
+    0x12, 0x04, // 218: jump 204
+};
+#define FORK_ROM_COUNT (ROM_COUNT + 1) // the ROMs and fork_score_rom
+
+static const char *fork_rom_name(size_t rom) {
+  return rom < ROM_COUNT ? roms[rom] : "score";
+}
+
+static int fork_load_rom(Chip8 *chip8, size_t rom) {
+  if (rom < ROM_COUNT) {
+    return load_rom(chip8, roms[rom]);
+  }
+  return load_rom_image(chip8, fork_score_rom, sizeof(fork_score_rom));
+}
+
+static Chip8 *fork_machine(size_t rom) {
+  static Chip8 chip8;
+  free_decode_cache(&chip8);
+  memset(&chip8, 0, sizeof(chip8));
+  init_chip8(&chip8);
+  if (enable_decode_cache(&chip8) != 0 || fork_load_rom(&chip8, rom) != 0) {
+    return NULL;
+  }
+  return &chip8;
+}
+
+static void fork_edge(Chip8 *chip8, u32 action) {
+  set_keypad(chip8, fork_actions[action]);
+  for (u32 f = 0; f < FORK_FRAMES; f++) {
+    run_fused(chip8, INSTRUCTIONS_PER_FRAME);
+    if (chip8->delay_timer > 0) chip8->delay_timer--;
+    if (chip8->sound_timer > 0) chip8->sound_timer--;
+  }
+}
+
+static void bench_fork(void) {
+  static Chip8State states[FORK_WIDTH];
+  static Chip8State state_children[FORK_WIDTH * FORK_ACTIONS];
+  static Chip8State check;
+  Chip8Fork *forks[FORK_WIDTH];
+  Chip8Fork *children[FORK_WIDTH * FORK_ACTIONS];
+  const double nodes = (double)FORK_DEPTH * FORK_WIDTH * FORK_ACTIONS;
+
+  printf("\nforks: %u generations of %u nodes, %u children each\n", FORK_DEPTH, FORK_WIDTH, FORK_ACTIONS);
+  printf("%-12s %10s %10s %10s %10s %10s %12s %12s\n", "rom", "emulate ns", "fork ns", "state ns", "pages/save",
+         "pages/load", "bytes/fork", "bytes/state");
+  for (size_t r = 0; r < FORK_ROM_COUNT; r++) {
+    const char *name = fork_rom_name(r);
+    Chip8Tree *tree = chip8_tree_create();
+    Chip8 *machine = tree ? chip8_tree_machine(tree) : NULL;
+    Chip8 *chip8 = fork_machine(r);
+    if (machine == NULL || chip8 == NULL || enable_decode_cache(machine) != 0 ||
+        fork_load_rom(machine, r) != 0) {
+      printf("%-12s %10s\n", name, "n/a");
+      chip8_tree_destroy(tree);
+      continue;
+    }
+
+    // the edges alone, on one machine that never goes back
+    double start = now_seconds();
+    for (u32 n = 0; n < nodes; n++) {
+      fork_edge(chip8, n % FORK_ACTIONS);
+    }
+    double emulate_ns = (now_seconds() - start) / nodes * 1e9;
+
+    // every node a fork
+    for (u32 i = 0; i < FORK_WIDTH; i++) {
+      forks[i] = chip8_fork_save(tree);
+    }
+    start = now_seconds();
+    for (u32 g = 0; g < FORK_DEPTH; g++) {
+      for (u32 i = 0; i < FORK_WIDTH; i++) {
+        for (u32 a = 0; a < FORK_ACTIONS; a++) {
+          chip8_fork_load(tree, forks[i]);
+          fork_edge(machine, a);
+          children[i * FORK_ACTIONS + a] = chip8_fork_save(tree);
+        }
+        chip8_fork_release(tree, forks[i]);
+      }
+      for (u32 c = 0; c < FORK_WIDTH * FORK_ACTIONS; c++) {
+        if (c == fork_kept(g, c / FORK_ACTIONS)) {
+          forks[c / FORK_ACTIONS] = children[c];
+        } else {
+          chip8_fork_release(tree, children[c]);
+        }
+      }
+    }
+    double fork_ns = (now_seconds() - start) / nodes * 1e9;
+
+    // every node a save state
+    chip8 = fork_machine(r);
+    for (u32 i = 0; i < FORK_WIDTH; i++) {
+      savestate_snapshot(chip8, &states[i]);
+    }
+    start = now_seconds();
+    for (u32 g = 0; g < FORK_DEPTH; g++) {
+      for (u32 i = 0; i < FORK_WIDTH; i++) {
+        for (u32 a = 0; a < FORK_ACTIONS; a++) {
+          savestate_restore(chip8, &states[i]);
+          fork_edge(chip8, a);
+          savestate_snapshot(chip8, &state_children[i * FORK_ACTIONS + a]);
+        }
+      }
+      for (u32 i = 0; i < FORK_WIDTH; i++) {
+        states[i] = state_children[fork_kept(g, i)];
+      }
+    }
+    double state_ns = (now_seconds() - start) / nodes * 1e9;
+
+    const ForkStats *stats = chip8_tree_stats(tree);
+    printf("%-12s %10.1f %10.1f %10.1f %10.2f %10.2f %12.1f %12u\n", name, emulate_ns, fork_ns, state_ns,
+           (double)stats->pages_copied / stats->saves, (double)stats->pages_loaded / stats->loads,
+           (double)stats->live_bytes / stats->live_forks, (u32)sizeof(Chip8State));
+    // the score page is written on every edge and has to be copied by
+    // every save of a child, the other pages have to stay shared by all
+    // the forks
+    if (r == ROM_COUNT && (stats->pages_copied < nodes ||
+                           stats->live_pages > stats->live_forks + FORK_PAGES)) {
+      printf("%s: %llu pages copied by %llu saves, %u pages held by %u forks\n", name,
+             (unsigned long long)stats->pages_copied, (unsigned long long)stats->saves, stats->live_pages,
+             stats->live_forks);
+    }
+
+    u32 mismatches = 0;
+    for (u32 i = 0; i < FORK_WIDTH; i++) {
+      chip8_fork_load(tree, forks[i]);
+      savestate_snapshot(machine, &check);
+      mismatches += memcmp(&check, &states[i], sizeof(check)) != 0;
+      chip8_fork_release(tree, forks[i]);
+    }
+    if (mismatches > 0) {
+      printf("%s: %u forks differ from their save states\n", name, mismatches);
+    }
+    chip8_tree_destroy(tree);
+  }
+}
+
+#define ENV_COUNT 64      // instances of an environment
+#define ENV_FRAMESKIP 4   // 60Hz frames per step
+#define ENV_STEPS 2000    // timed steps of all the instances
+#define ENV_CHECKED 300   // steps checked against the twins and after a reset
+#define ENV_EPISODE 240   // frames, so the checked steps cross episodes
+
+// the action of instance i at step s, each of fork_actions held for 8 steps
+static u16 env_action(u32 i, u32 s) {
+  return fork_actions[(i + s / 8) % FORK_ACTIONS];
+}
+
+// the score ROM keeps its score at 0x400, the others get no reward
+static Chip8Reader env_reward(size_t rom) {
+  Chip8Reader reader = {.kind = rom < ROM_COUNT ? CHIP8_READ_NONE : CHIP8_READ_BCD, .address = 0x400};
+  return reader;
+}
+
+static Chip8Env *env_create(size_t rom) {
+  Chip8Env *env = rom < ROM_COUNT ? chip8_env_create(roms[rom], ENV_COUNT, ENV_FRAMESKIP)
+                                  : chip8_env_create_image(fork_score_rom, sizeof(fork_score_rom), ENV_COUNT,
+                                                           ENV_FRAMESKIP);
+  if (env == NULL) {
+    return NULL;
+  }
+  chip8_env_set_reward(env, env_reward(rom), 1);
+  chip8_env_set_max_frames(env, ENV_EPISODE);
+  return env;
+}
+
+// what chip8_env.h promises an instance does, on a plain Chip8 without
+// decode cache or threads
+typedef struct EnvTwin {
+  Chip8 chip8;
+  Chip8Sched sched;
+  u32 episode;
+  u32 frames;
+} EnvTwin;
+
+static void env_twin_reset(EnvTwin *twin, size_t rom, u32 i) {
+  memset(&twin->chip8, 0, sizeof(twin->chip8));
+  init_chip8(&twin->chip8);
+  seed_random(&twin->chip8, 1 + i + (uint64_t)twin->episode * ENV_COUNT);
+  fork_load_rom(&twin->chip8, rom);
+  set_quirks(&twin->chip8, rom < ROM_COUNT ? quirks_for_rom(roms[rom]) : QUIRKS_VIP);
+  sched_init(&twin->sched, run_fused, SCHED_DEFAULT_IPS, 0);
+  twin->episode++;
+  twin->frames = 0;
+}
+
+// steps every instance ENV_CHECKED times from a reset, returns the
+// instance steps whose observation, reward or done flag differ from the
+// twins'. The observations of the last step go to last_obs
+static u32 env_check(Chip8Env *env, size_t rom, uint64_t (*last_obs)[SCREEN_HEIGHT], double *reward_sum) {
+  static EnvTwin twins[ENV_COUNT];
+  static uint64_t obs[ENV_COUNT][SCREEN_HEIGHT];
+  u16 actions[ENV_COUNT];
+  float rewards[ENV_COUNT];
+  u8 done[ENV_COUNT];
+  Chip8Reader reward = env_reward(rom);
+  u32 mismatches = 0;
+
+  chip8_env_reset(env, obs);
+  for (u32 i = 0; i < ENV_COUNT; i++) {
+    twins[i].episode = 0;
+    env_twin_reset(&twins[i], rom, i);
+    mismatches += memcmp(obs[i], twins[i].chip8.video, sizeof(obs[i])) != 0;
+  }
+  *reward_sum = 0;
+  for (u32 s = 0; s < ENV_CHECKED; s++) {
+    for (u32 i = 0; i < ENV_COUNT; i++) {
+      actions[i] = env_action(i, s);
+    }
+    chip8_env_step(env, actions, obs, rewards, done);
+    for (u32 i = 0; i < ENV_COUNT; i++) {
+      EnvTwin *twin = &twins[i];
+      double before = chip8_read(&reward, &twin->chip8);
+      set_keypad(&twin->chip8, actions[i]);
+      sched_run_ticks(&twin->sched, &twin->chip8, ENV_FRAMESKIP);
+      twin->frames += ENV_FRAMESKIP;
+      float expected = (float)(chip8_read(&reward, &twin->chip8) - before);
+      u8 twin_done = twin->frames >= ENV_EPISODE;
+      if (twin_done) {
+        env_twin_reset(twin, rom, i);
+      }
+      mismatches += rewards[i] != expected || done[i] != twin_done ||
+                    memcmp(obs[i], twin->chip8.video, sizeof(obs[i])) != 0;
+      *reward_sum += rewards[i];
+    }
+  }
+  memcpy(last_obs, obs, sizeof(obs));
+  return mismatches;
+}
+
+static void bench_env(void) {
+  static uint64_t first[ENV_COUNT][SCREEN_HEIGHT];
+  static uint64_t second[ENV_COUNT][SCREEN_HEIGHT];
+  u16 actions[ENV_COUNT];
+  float rewards[ENV_COUNT];
+  u8 done[ENV_COUNT];
+
+  printf("\nenvironments: %u instances, %u frames per step\n", ENV_COUNT, ENV_FRAMESKIP);
+  printf("%-12s %12s %12s %12s\n", "rom", "steps/s", "frames/s", "reward");
+  for (size_t r = 0; r < FORK_ROM_COUNT; r++) {
+    const char *name = fork_rom_name(r);
+    Chip8Env *env = env_create(r);
+    if (env == NULL) {
+      printf("%-12s %12s\n", name, "n/a");
+      continue;
+    }
+
+    // reset seeds every episode the same way, so running the same actions
+    // twice has to give the same observations
+    double reward_sum, again;
+    u32 mismatches = env_check(env, r, first, &reward_sum);
+    mismatches += env_check(env, r, second, &again);
+    u32 differ = memcmp(first, second, sizeof(first)) != 0 || reward_sum != again;
+
+    chip8_env_reset(env, NULL);
+    double start = now_seconds();
+    for (u32 s = 0; s < ENV_STEPS; s++) {
+      for (u32 i = 0; i < ENV_COUNT; i++) {
+        actions[i] = env_action(i, s);
+      }
+      chip8_env_step(env, actions, first, rewards, done);
+    }
+    double steps = (double)ENV_STEPS * ENV_COUNT / (now_seconds() - start);
+    printf("%-12s %12.0f %12.0f %12.0f\n", name, steps, steps * ENV_FRAMESKIP, reward_sum);
+
+    if (mismatches > 0) {
+      printf("%s: %u instance steps differ from stepping the machine directly\n", name, mismatches);
+    }
+    if (differ) {
+      printf("%s: the same actions after a reset differ from the first run\n", name);
+    }
+    // the score only goes down when V0 wraps, so holding keys 4 and 6 has
+    // to pay off
+    if (r == ROM_COUNT && reward_sum <= 0) {
+      printf("%s: the score reader got a reward of %.0f\n", name, reward_sum);
+    }
+    chip8_env_destroy(env);
+  }
+}
+
+int main(int argc, char **argv) {
+  u32 instructions = 50000000;
+  if (argc > 1) {
+    instructions = strtoul(argv[1], NULL, 10);
+  }
+  instructions -= instructions % INSTRUCTIONS_PER_FRAME;
+
+  static Chip8 reference;
+  static Chip8 chip8;
+
+  printf("run_cycles dispatch: %s\n", run_cycles_threaded ? "computed goto" : "switch");
+  printf("%-12s %-10s %12s %8s\n", "rom", "engine", "MIPS", "speedup");
+  for (size_t r = 0; r < ROM_COUNT; r++) {
+    double baseline = 0;
+    for (size_t e = 0; e < ENGINE_COUNT; e++) {
+      Chip8 *target = (e == 0) ? &reference : &chip8;
+      double seconds = run_engine(&engines[e], target, roms[r], instructions);
+      if (seconds < 0) {
+        printf("%-12s %-10s %12s\n", roms[r], engines[e].name, "n/a");
+        continue;
+      }
+      if (e == 0) {
+        baseline = seconds;
+      } else if (memcmp(&reference, &chip8, offsetof(Chip8, opcode)) != 0) {
+        printf("%s: state of `%s` differs from `%s`\n", roms[r], engines[e].name, engines[0].name);
+      }
+      printf("%-12s %-10s %12.2f %7.2fx\n", roms[r], engines[e].name,
+             instructions / seconds / 1e6, baseline / seconds);
+      if (target->idle_skips > 0) {
+        printf("%-12s %-10s %u idle loops, %llu instructions elided\n", "", "", target->idle_skips,
+               (unsigned long long)target->idle_elided);
+      }
+    }
+  }
+  bench_expand();
+  bench_lockstep(instructions);
+  bench_savestate();
+  bench_rewind();
+  bench_fork();
+  bench_env();
+  return 0;
+}
@@ -1,8 +1,9 @@
 @echo off
 set exe_name=chip8.exe
-set c_file=main.c
+set c_file=main.c chip8.c expand.c emu_thread.c sched.c savestate.c rewind.c
 :: WINDOWS advanced build command for debugging
-clang %c_file% -g -gcodeview -Wl,--pdb= windows/lib/libraylib.a -lopengl32 -lgdi32 -lwinmm -I ./include  -o %exe_name%
+clang %c_file% -g -gcodeview -Wl,--pdb= windows/lib/libraylib.a -lopengl32 -lgdi32 -lwinmm -lpthread -I ./include  -o %exe_name%
+if errorlevel 1 exit /b 1
 
 echo %exe_name% was built successfully 
 echo:
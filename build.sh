@@ -1,5 +1,44 @@
+# stops at the first target that fails to build, CC picks the compiler
+set -e
+cc=${CC:-clang}
+
 exe_name=chip8
-c_file=main.c
+c_file="main.c chip8.c expand.c emu_thread.c sched.c savestate.c rewind.c"
+# extra flags are passed through, e.g. ./build.sh -DCHIP8_THREADED for the threaded core
+# or -DCHIP8_CUSTOM_FRAME_CONTROL with a raylib built with SUPPORT_CUSTOM_FRAME_CONTROL
+extra_flags="$@"
 
-clang $c_file -o $exe_name -O1 -Wall -std=c99 -Wno-missing-braces -I include/ -L /lib/ -lraylib -lGL -lm -lpthread -ldl -lrt -lX11 -fsanitize=address
+$cc $c_file -o $exe_name -O1 -Wall -std=c99 -Wno-missing-braces -I include/ -L /lib/ -lraylib -lGL -lm -lpthread -ldl -lrt -lX11 -fsanitize=address $extra_flags
 echo $exe_name was successfully built
+
+# headless benchmark of the interpreter cores, no raylib and no sanitizer
+bench_name=chip8-bench
+$cc bench.c chip8.c jit.c expand.c lockstep.c savestate.c rewind.c chip8_fork.c chip8_env.c sched.c -o $bench_name -O2 -Wall -std=c99 -Wno-missing-braces -lpthread
+echo $bench_name was successfully built
+
+# the emulator without a window, for CI and batch servers: only needs the core
+headless_name=chip8-headless
+$cc headless.c chip8.c sched.c script.c -o $headless_name -O2 -Wall -std=c99 -Wno-missing-braces
+echo $headless_name was successfully built
+
+# runs a manifest of headless jobs on a thread pool, see batch.c
+batch_name=chip8-batch
+$cc batch.c chip8.c sched.c script.c -o $batch_name -O2 -Wall -std=c99 -Wno-missing-braces -lpthread
+echo $batch_name was successfully built
+
+# static recompiler, ROMs translated with it are built against aot_runtime.c:
+#   ./chip8-aot br8kout.ch8 br8kout_aot.c
+#   clang br8kout_aot.c aot_runtime.c aot_main.c chip8.c -O2 -o br8kout-aot
+aot_name=chip8-aot
+$cc aot.c chip8.c -o $aot_name -O2 -Wall -std=c99 -Wno-missing-braces
+echo $aot_name was successfully built
+
+# vector environment for reinforcement learning bindings (chip8_env.h), a
+# static library to link into the host program together with -lpthread
+env_name=libchip8env.a
+for f in chip8_env chip8 sched; do
+  $cc -c $f.c -o $f.o -O2 -Wall -std=c99 -Wno-missing-braces -fPIC
+done
+ar rcs $env_name chip8_env.o chip8.o sched.o
+rm chip8_env.o chip8.o sched.o
+echo $env_name was successfully built
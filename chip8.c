@@ -0,0 +1,1506 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "chip8.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// Following the Tutorial https://austinmorlan.com/posts/chip8_emulator/
+
+// Font each character consists of 5 bytes, example of letter "F":
+/************
+  11110000
+  10000000
+  11110000
+  10000000
+  10000000
+*************/
+// With 16 characters each 5 bytes big we need 16*5 = 80 bytes of storage for all characters
+static const u8 fontset[FONTSET_SIZE] =
+    {
+        0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+        0x20, 0x60, 0x20, 0x20, 0x70, // 1
+        0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+        0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+        0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+        0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+        0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+        0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+        0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+        0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+        0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+        0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+        0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+        0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+        0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+        0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+};
+
+// loads rom
+// returns 0 if the loading of the file has failed
+// returns 1 if the file was loaded successfully
+int load_rom(Chip8 *chip8, const char *file_name) {
+  FILE *rom_file = fopen(file_name, "rb");
+  if (rom_file == NULL) {
+    printf("Error opening the ROM, errno: %d\n", errno);
+    return -1;
+  }
+  // read file size
+  fseek(rom_file, 0, SEEK_END);
+  u32 file_size = ftell(rom_file);
+  rewind(rom_file);
+  if (file_size > ROM_SIZE_MAX) {
+    printf("`%s` does not fit into memory, at most %d bytes\n", file_name, ROM_SIZE_MAX);
+    fclose(rom_file);
+    return -1;
+  }
+
+  // write the data from the file into the chip8 memory, starting at 0x200
+  u8 image[ROM_SIZE_MAX];
+  file_size = fread(image, sizeof(u8), file_size, rom_file);
+  fclose(rom_file);
+  load_rom_image(chip8, image, file_size);
+  set_quirks(chip8, quirks_for_rom(file_name));
+  return 0;
+}
+
+int load_rom_image(Chip8 *chip8, const u8 *image, u32 size) {
+  if (size > ROM_SIZE_MAX) {
+    return -1;
+  }
+  memcpy(chip8->memory + START_ADDRESS, image, size);
+  invalidate_code(chip8, START_ADDRESS, size);
+  return 0;
+}
+
+void load_font(Chip8 *chip8, const u8 fontset[]) {
+  for (size_t i = 0; i < FONTSET_SIZE; i++) {
+    chip8->memory[FONTSET_START_ADDRESS + i] = fontset[i];
+  }
+}
+
+void seed_random(Chip8 *chip8, uint64_t seed) {
+  // splitmix64, so neighbouring seeds give unrelated sequences and the
+  // xorshift state is never 0
+  uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  z ^= z >> 31;
+  chip8->random_state = z != 0 ? z : 1;
+}
+
+// xorshift64*, the state lives in the Chip8 so instances never share it
+static inline u8 random_byte(Chip8 *chip8) {
+  uint64_t x = chip8->random_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  chip8->random_state = x;
+  return (x * 0x2545F4914F6CDD1Dull) >> 56;
+}
+
+void init_chip8(Chip8 *chip8) {
+  seed_random(chip8, 1);
+  chip8->pc = START_ADDRESS;
+  load_font(chip8, fontset);
+  init_dispatch_table();
+  set_quirks(chip8, QUIRKS_VIP);
+}
+
+void set_keypad(Chip8 *chip8, u16 keys) {
+  for (u32 k = 0; k < KEYPAD_MAX; k++) {
+    chip8->keypad[k] = (keys >> k) & 1;
+  }
+}
+
+void clear_video(Chip8 *chip8) {
+  for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
+    chip8->video_dirty |= (u32)(chip8->video[y] != 0) << y;
+    chip8->video[y] = 0;
+  }
+}
+
+void video_expand_row(const Chip8 *chip8, u32 y, u32 *out, u32 on, u32 off) {
+  uint64_t row = chip8->video[y];
+  for (u32 x = 0; x < SCREEN_WIDTH; x++) {
+    out[x] = (row >> (SCREEN_WIDTH - 1 - x)) & 1 ? on : off;
+  }
+}
+
+int video_subscribe(Chip8 *chip8) {
+  for (int id = 0; id < VIDEO_SUBSCRIBERS_MAX; id++) {
+    if (!(chip8->video_subscribers & (1u << id))) {
+      chip8->video_subscribers |= 1u << id;
+      chip8->video_pending[id] = 0xFFFFFFFF;
+      return id;
+    }
+  }
+  printf("Error subscribing to video, all %d subscribers are taken\n", VIDEO_SUBSCRIBERS_MAX);
+  return -1;
+}
+
+void video_unsubscribe(Chip8 *chip8, int id) {
+  chip8->video_subscribers &= ~(1u << id);
+}
+
+u32 video_take_dirty(Chip8 *chip8, int id) {
+  // hand what the core collected since the last call to everyone
+  u32 dirty = chip8->video_dirty;
+  if (dirty != 0) {
+    for (int other = 0; other < VIDEO_SUBSCRIBERS_MAX; other++) {
+      chip8->video_pending[other] |= dirty;
+    }
+    chip8->video_dirty = 0;
+  }
+  u32 rows = chip8->video_pending[id];
+  chip8->video_pending[id] = 0;
+  return rows;
+}
+
+uint64_t video_hash(const Chip8 *chip8) {
+  // FNV-1a over whole rows instead of bytes, 32 multiplies per frame
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
+    hash = (hash ^ chip8->video[y]) * 0x100000001B3ull;
+    hash ^= hash >> 32;
+  }
+  return hash;
+}
+
+/*********************************
+all 34 instructions of the Chip8
+*********************************/
+
+// Every opcode the decoder does not recognise ends up here
+// pc already points past it, so the raw opcode is re-read from memory.
+// Reported on stderr, a game can hit this every frame and tools read stdout
+void op_illegal(Chip8 *chip8, const Chip8Insn *insn) {
+  u16 address = (chip8->pc - 2) & ADDRESS_MASK;
+  u16 opcode = (chip8->memory[address] << 8) | chip8->memory[(address + 1) & ADDRESS_MASK];
+  fprintf(stderr, "unknown opcode [0x%03X]: 0x%04X\n", address, opcode);
+  (void)insn;
+}
+
+// 0nnn: Jump to a machine code routine at nnn
+// only the original COSMAC VIP could run those, they are ignored like the
+// SCHIP opcodes of the same group
+void op_0nnn(Chip8 *chip8, const Chip8Insn *insn) {
+  (void)chip8;
+  (void)insn;
+}
+
+// 00E0: Clear the display
+void op_00E0(Chip8 *chip8, const Chip8Insn *insn) {
+  clear_video(chip8);
+  (void)insn;
+}
+
+// 00EE: Return from a subroutine
+void op_00EE(Chip8 *chip8, const Chip8Insn *insn) {
+  chip8->sp--;
+  chip8->pc = chip8->stack[chip8->sp & STACK_MASK];
+  (void)insn;
+}
+
+// 1nnn: Jump to location nnn
+void op_1nnn(Chip8 *chip8, const Chip8Insn *insn) {
+  u16 nnn = insn->nnn;
+  chip8->pc = nnn;
+}
+
+// 2nnn: Call subroutine at nnn
+void op_2nnn(Chip8 *chip8, const Chip8Insn *insn) {
+  u16 nnn = insn->nnn;
+  chip8->stack[chip8->sp & STACK_MASK] = chip8->pc;
+  chip8->sp++;
+  chip8->pc = nnn;
+}
+
+// 3xkk: Skip next instruction if Vx = kk
+void op_3xkk(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 kk = insn->kk;
+  if (chip8->V[x] == kk) {
+    chip8->pc += 2;
+  }
+}
+
+// 4xkk: Skip next instruction if Vx != kk
+void op_4xkk(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 kk = insn->kk;
+  if (chip8->V[x] != kk) {
+    chip8->pc += 2;
+  }
+}
+
+// 5xy0: Skip next instruction if Vx = Vy
+void op_5xy0(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 y = insn->y;
+  if (chip8->V[x] == chip8->V[y]) {
+    chip8->pc += 2;
+  }
+}
+
+// 6xkk: Set Register Vx = kk
+void op_6xkk(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 kk = insn->kk;
+  chip8->V[x] = kk;
+}
+
+// 7xkk: Set Vx = Vx + kk
+void op_7xkk(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 kk = insn->kk;
+  chip8->V[x] = chip8->V[x] + kk;
+}
+
+// 8xy0: Set Vx = Vy
+void op_8xy0(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 y = insn->y;
+  chip8->V[x] = chip8->V[y];
+}
+
+// The values of Vx and Vy are added together. If the result is greater
+// than 8 bits (i.e., > 255,) VF is set to 1, otherwise 0. Only the lowest
+// 8 bits of the result are kept, and stored in Vx.
+// This is an ADD with an overflow flag. If the sum is greater than what can
+// fit into a byte (255), register VF will be set to 1 as a flag.
+// 8xy4: Set Vx = Vx + Vy, set VF = carry
+void op_8xy4(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 y = insn->y;
+
+  u16 sum = (chip8->V[x] + chip8->V[y]);
+
+  chip8->V[x] = sum & 0xFF;
+
+  if (sum > 255) {
+    chip8->V[0xF] = 1;
+  } else {
+    chip8->V[0xF] = 0;
+  }
+}
+
+// If Vx > Vy, then VF is set to 1, otherwise 0. Then Vy is subtracted from Vx,
+// and the results stored in Vx.
+// 8xy5: Set Vx = Vx - Vy, set VF = NOT borrow
+void op_8xy5(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 y = insn->y;
+
+  u8 temp = chip8->V[x];
+  chip8->V[x] -= chip8->V[y];
+  if (temp >= chip8->V[y]) {
+    chip8->V[0xF] = 1;
+  } else {
+    chip8->V[0xF] = 0;
+  }
+}
+
+// If Vy > Vx, then VF is set to 1, otherwise 0.
+// Then Vx is subtracted from Vy, and the results stored in Vx.
+// 8xy7 Set Vx = Vy - Vx, set VF = NOT borrow
+void op_8xy7(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 y = insn->y;
+
+  u8 temp = chip8->V[x];
+  chip8->V[x] = (chip8->V[y] - chip8->V[x]);
+  if (temp <= chip8->V[y]) {
+    chip8->V[0xF] = 1;
+  } else {
+    chip8->V[0xF] = 0;
+  }
+}
+
+// 9xy0: Skip next instruction if Vx != Vy
+void op_9xy0(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 y = insn->y;
+  if (chip8->V[x] != chip8->V[y]) {
+    chip8->pc += 2;
+  }
+}
+
+// Annn: Set I = nnn
+void op_Annn(Chip8 *chip8, const Chip8Insn *insn) {
+  u16 nnn = insn->nnn;
+  chip8->I = nnn;
+}
+
+// Cxkk: Set Vx = random byte AND kk
+void op_Cxkk(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 kk = insn->kk;
+  chip8->V[x] = (random_byte(chip8) & kk);
+}
+
+// Ex9E: Skip next instruction if key with value of Vx is pressed
+void op_Ex9E(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 value = chip8->V[x];
+
+  if (key_down(chip8, value)) {
+    chip8->pc += 2;
+  }
+}
+
+// ExA1: Skip next instruction if key with the value of Vx is not pressed
+void op_ExA1(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 value = chip8->V[x];
+
+  if (!key_down(chip8, value)) {
+    chip8->pc += 2;
+  }
+}
+
+// Fx07: Set Vx = delay timer value
+void op_Fx07(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  chip8->V[x] = chip8->delay_timer;
+}
+
+// Fx0A: Wait for a key press, store the value of the key in Vx
+void op_Fx0A(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  // TODO: add all remaining keypad
+  if (chip8->keypad[0]) {
+    chip8->V[x] = 0;
+  } else if (chip8->keypad[1]) {
+    chip8->V[x] = 1;
+  } else if (chip8->keypad[2]) {
+    chip8->V[x] = 2;
+  } else if (chip8->keypad[3]) {
+    chip8->V[x] = 3;
+  } else if (chip8->keypad[4]) {
+    chip8->V[x] = 4;
+  } else if (chip8->keypad[5]) {
+    chip8->V[x] = 5;
+  } else if (chip8->keypad[6]) {
+    chip8->V[x] = 6;
+  } else if (chip8->keypad[7]) {
+    chip8->V[x] = 7;
+  } else if (chip8->keypad[8]) {
+    chip8->V[x] = 8;
+  } else if (chip8->keypad[9]) {
+    chip8->V[x] = 9;
+  } else if (chip8->keypad[10]) {
+    chip8->V[x] = 10;
+  } else if (chip8->keypad[11]) {
+    chip8->V[x] = 11;
+  } else if (chip8->keypad[12]) {
+    chip8->V[x] = 12;
+  } else if (chip8->keypad[13]) {
+    chip8->V[x] = 13;
+  } else if (chip8->keypad[14]) {
+    chip8->V[x] = 14;
+  } else if (chip8->keypad[15]) {
+    chip8->V[x] = 15;
+  } else {
+    chip8->pc -= 2;
+  }
+}
+
+// Fx15: Set delay timer = Vx
+void op_Fx15(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  chip8->delay_timer = chip8->V[x];
+}
+
+// Fx18: Set sound timer = Vx
+void op_Fx18(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  chip8->sound_timer = chip8->V[x];
+}
+
+// Fx1E: Set I = I + Vx
+void op_Fx1E(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  chip8->I = (chip8->I + chip8->V[x]) & ADDRESS_MASK;
+}
+
+// Fx29: Set I = location of sprite for digit Vx
+// Font characters are located at 0x50, each being five bytes long
+void op_Fx29(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  chip8->I = FONTSET_START_ADDRESS + (chip8->V[x] * 5);
+}
+
+// The interpreter takes the decimal value of Vx,
+// and places the hundreds digit in memory at location in I,
+// the tens digit at location I+1
+// and the ones digit at location I+2
+// Fx33: Store BCD representation of Vx in memory locations I, I+1, I+2
+void op_Fx33(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 digit = chip8->V[x];
+
+  u8 digit_one = digit % 10;
+  digit /= 10;
+  u8 digit_ten = digit % 10;
+  digit /= 10;
+  u8 digit_hundred = digit % 10;
+
+  chip8->memory[chip8->I & ADDRESS_MASK] = digit_hundred;
+  chip8->memory[(chip8->I + 1) & ADDRESS_MASK] = digit_ten;
+  chip8->memory[(chip8->I + 2) & ADDRESS_MASK] = digit_one;
+  invalidate_code(chip8, chip8->I, 3);
+}
+
+// splits a raw opcode into the operands the handlers work with
+static inline void decode_operands(Chip8Insn *insn, u16 opcode) {
+  insn->x = (opcode & 0x0F00) >> 8;
+  insn->y = (opcode & 0x00F0) >> 4;
+  insn->n = (opcode & 0x000F);
+  insn->kk = (opcode & 0x00FF);
+  insn->nnn = (opcode & 0x0FFF);
+}
+
+// Fetch, Decode and Exectue instruction
+// inspired by: https://github.com/jborza/emuchip8/blob/master/cpu.c
+// (NOTE): this is the original decoder, process_instruction goes through the
+// handler table instead. It is kept as reference for chip8-bench.
+void process_instruction_switch(Chip8 *chip8) {
+
+  /* Fetch */
+
+  // Catch first byte and second byte separatly because memory is u8
+  // but an instruction consists of 2 bytes
+  chip8->opcode = (chip8->memory[chip8->pc & ADDRESS_MASK]);
+  chip8->opcode <<= 8;
+  chip8->opcode |= (chip8->memory[(chip8->pc + 1) & ADDRESS_MASK]);
+  chip8->pc += 2;
+
+  /* Decode & Execute */
+
+  // an opcode consists of 4 bytes with the following encoding
+  // examples: [0xVxy0], [0xVnnn], [0xV00n], etc.
+
+  Chip8Insn insn;
+  decode_operands(&insn, chip8->opcode);
+
+  // switch to distinguish between the first bit ranging
+  // from 0 - F (16)
+  switch (chip8->opcode & 0xF000) {
+  case (0x0000): {
+    // lookup the last two bytes
+    switch (chip8->opcode & 0x00FF) {
+    case 0x00E0:
+      op_00E0(chip8, &insn);
+      break;
+    case 0x00EE:
+      op_00EE(chip8, &insn);
+      break;
+    }
+    break;
+  }
+  case (0x1000): {
+    op_1nnn(chip8, &insn);
+    break;
+  }
+  case (0x2000): {
+    op_2nnn(chip8, &insn);
+    break;
+  }
+  case (0x3000): {
+    op_3xkk(chip8, &insn);
+    break;
+  }
+  case (0x4000): {
+    op_4xkk(chip8, &insn);
+    break;
+  }
+  case (0x5000): {
+    op_5xy0(chip8, &insn);
+    break;
+  }
+  case (0x6000): {
+    op_6xkk(chip8, &insn);
+    break;
+  }
+  case (0x7000): {
+    op_7xkk(chip8, &insn);
+    break;
+  }
+  case (0x8000): {
+    switch (chip8->opcode & 0x000F) {
+    case (0x0000): {
+      op_8xy0(chip8, &insn);
+      break;
+    }
+    case (0x0001): {
+      chip8->handlers[OP_8xy1](chip8, &insn);
+      break;
+    }
+    case (0x0002): {
+      chip8->handlers[OP_8xy2](chip8, &insn);
+      break;
+    }
+    case (0x0003): {
+      chip8->handlers[OP_8xy3](chip8, &insn);
+      break;
+    }
+    case (0x0004): {
+      op_8xy4(chip8, &insn);
+      break;
+    }
+    case (0x0005): {
+      op_8xy5(chip8, &insn);
+      break;
+    }
+    case (0x0006): {
+      chip8->handlers[OP_8xy6](chip8, &insn);
+      break;
+    }
+    case (0x0007): {
+      op_8xy7(chip8, &insn);
+      break;
+    }
+    case (0x000E): {
+      chip8->handlers[OP_8xyE](chip8, &insn);
+      break;
+    }
+    }
+    break;
+  }
+  case (0x9000): {
+    op_9xy0(chip8, &insn);
+    break;
+  }
+  case (0xA000): {
+    op_Annn(chip8, &insn);
+    break;
+  }
+  case (0xB000): {
+    chip8->handlers[OP_Bnnn](chip8, &insn);
+    break;
+  }
+  case (0xC000): {
+    op_Cxkk(chip8, &insn);
+    break;
+  }
+  case (0xD000): {
+    chip8->handlers[OP_Dxyn](chip8, &insn);
+    break;
+  }
+  case (0xE000): {
+    switch (chip8->opcode & 0x00FF) {
+    case (0x009E): {
+      op_Ex9E(chip8, &insn);
+      break;
+    }
+    case (0x00A1): {
+      op_ExA1(chip8, &insn);
+      break;
+    }
+    }
+    break;
+  }
+  case (0xF000): {
+    switch (chip8->opcode & 0x00FF) {
+    case (0x0007): {
+      op_Fx07(chip8, &insn);
+      break;
+    }
+    case (0x000A): {
+      op_Fx0A(chip8, &insn);
+      break;
+    }
+    case (0x0015): {
+      op_Fx15(chip8, &insn);
+      break;
+    }
+    case (0x0018): {
+      op_Fx18(chip8, &insn);
+      break;
+    }
+    case (0x001E): {
+      op_Fx1E(chip8, &insn);
+      break;
+    }
+    case (0x0029): {
+      op_Fx29(chip8, &insn);
+      break;
+    }
+    case (0x0033): {
+      op_Fx33(chip8, &insn);
+      break;
+    }
+    case (0x0055): {
+      chip8->handlers[OP_Fx55](chip8, &insn);
+      break;
+    }
+    case (0x0065): {
+      chip8->handlers[OP_Fx65](chip8, &insn);
+      break;
+    }
+    }
+    break;
+  }
+  default: {
+    fprintf(stderr, "unknown opcode [0x0000]: 0x%X\n", chip8->opcode);
+  }
+  }
+}
+
+/*********************************
+    Table driven dispatch
+
+    The nested switch above costs two hard to predict branches per
+    instruction. Instead every possible 16 bit opcode is decoded once into
+    a Chip8Op and stored in a 64K table, so executing an instruction is a
+    single load plus one dense jump. The table holds u8 indices instead
+    of function pointers to keep it at 64KB rather than 512KB. The handler
+    table itself belongs to the quirk profile (see chip8_quirks.h), the
+    active one is reached through chip8->handlers.
+ *********************************/
+
+const char *const op_names[OP_COUNT] = {
+    [OP_ILLEGAL] = "illegal",
+    [OP_0nnn] = "0nnn",
+    [OP_00E0] = "00E0",
+    [OP_00EE] = "00EE",
+    [OP_1nnn] = "1nnn",
+    [OP_2nnn] = "2nnn",
+    [OP_3xkk] = "3xkk",
+    [OP_4xkk] = "4xkk",
+    [OP_5xy0] = "5xy0",
+    [OP_6xkk] = "6xkk",
+    [OP_7xkk] = "7xkk",
+    [OP_8xy0] = "8xy0",
+    [OP_8xy1] = "8xy1",
+    [OP_8xy2] = "8xy2",
+    [OP_8xy3] = "8xy3",
+    [OP_8xy4] = "8xy4",
+    [OP_8xy5] = "8xy5",
+    [OP_8xy6] = "8xy6",
+    [OP_8xy7] = "8xy7",
+    [OP_8xyE] = "8xyE",
+    [OP_9xy0] = "9xy0",
+    [OP_Annn] = "Annn",
+    [OP_Bnnn] = "Bnnn",
+    [OP_Cxkk] = "Cxkk",
+    [OP_Dxyn] = "Dxyn",
+    [OP_Ex9E] = "Ex9E",
+    [OP_ExA1] = "ExA1",
+    [OP_Fx07] = "Fx07",
+    [OP_Fx0A] = "Fx0A",
+    [OP_Fx15] = "Fx15",
+    [OP_Fx18] = "Fx18",
+    [OP_Fx1E] = "Fx1E",
+    [OP_Fx29] = "Fx29",
+    [OP_Fx33] = "Fx33",
+    [OP_Fx55] = "Fx55",
+    [OP_Fx65] = "Fx65",
+};
+
+// opcode -> Chip8Op, filled once by init_dispatch_table
+static u8 dispatch_table[0x10000];
+static int dispatch_table_state = 0; // 0: empty, 1: being built, 2: ready
+
+// Decodes the same way as process_instruction_switch, so both decoders
+// agree on every opcode (e.g. 5xy1 is still treated as 5xy0)
+Chip8Op decode_opcode(u16 opcode) {
+  switch (opcode & 0xF000) {
+  case (0x0000): {
+    switch (opcode & 0x00FF) {
+    case (0x00E0):
+      return OP_00E0;
+    case (0x00EE):
+      return OP_00EE;
+    }
+    return OP_0nnn;
+  }
+  case (0x1000):
+    return OP_1nnn;
+  case (0x2000):
+    return OP_2nnn;
+  case (0x3000):
+    return OP_3xkk;
+  case (0x4000):
+    return OP_4xkk;
+  case (0x5000):
+    return OP_5xy0;
+  case (0x6000):
+    return OP_6xkk;
+  case (0x7000):
+    return OP_7xkk;
+  case (0x8000): {
+    switch (opcode & 0x000F) {
+    case (0x0000):
+      return OP_8xy0;
+    case (0x0001):
+      return OP_8xy1;
+    case (0x0002):
+      return OP_8xy2;
+    case (0x0003):
+      return OP_8xy3;
+    case (0x0004):
+      return OP_8xy4;
+    case (0x0005):
+      return OP_8xy5;
+    case (0x0006):
+      return OP_8xy6;
+    case (0x0007):
+      return OP_8xy7;
+    case (0x000E):
+      return OP_8xyE;
+    }
+    return OP_ILLEGAL;
+  }
+  case (0x9000):
+    return OP_9xy0;
+  case (0xA000):
+    return OP_Annn;
+  case (0xB000):
+    return OP_Bnnn;
+  case (0xC000):
+    return OP_Cxkk;
+  case (0xD000):
+    return OP_Dxyn;
+  case (0xE000): {
+    switch (opcode & 0x00FF) {
+    case (0x009E):
+      return OP_Ex9E;
+    case (0x00A1):
+      return OP_ExA1;
+    }
+    return OP_ILLEGAL;
+  }
+  case (0xF000): {
+    switch (opcode & 0x00FF) {
+    case (0x0007):
+      return OP_Fx07;
+    case (0x000A):
+      return OP_Fx0A;
+    case (0x0015):
+      return OP_Fx15;
+    case (0x0018):
+      return OP_Fx18;
+    case (0x001E):
+      return OP_Fx1E;
+    case (0x0029):
+      return OP_Fx29;
+    case (0x0033):
+      return OP_Fx33;
+    case (0x0055):
+      return OP_Fx55;
+    case (0x0065):
+      return OP_Fx65;
+    }
+    return OP_ILLEGAL;
+  }
+  }
+  return OP_ILLEGAL;
+}
+
+void init_dispatch_table(void) {
+  if (__atomic_load_n(&dispatch_table_state, __ATOMIC_ACQUIRE) == 2) {
+    return;
+  }
+  // instances may be set up on several threads at once, the first one
+  // builds the table and the others wait for it
+  int state = 0;
+  if (!__atomic_compare_exchange_n(&dispatch_table_state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&dispatch_table_state, __ATOMIC_ACQUIRE) != 2) {
+    }
+    return;
+  }
+  // decode_opcode only looks at the top nibble and the low byte, so every
+  // prefix is decoded once and copied over all 16 values of the x nibble
+  for (u32 prefix = 0; prefix < 16; prefix++) {
+    u8 *row = &dispatch_table[prefix << 12];
+    for (u32 low = 0; low < 0x100; low++) {
+      row[low] = decode_opcode((prefix << 12) | low);
+    }
+    for (u32 x = 1; x < 16; x++) {
+      memcpy(row + (x << 8), row, 0x100);
+    }
+  }
+  __atomic_store_n(&dispatch_table_state, 2, __ATOMIC_RELEASE);
+}
+
+void decode_insn(const Chip8 *chip8, Chip8Insn *insn, u16 opcode) {
+  decode_operands(insn, opcode);
+  insn->op = dispatch_table[opcode];
+  insn->fusion = FUSION_NONE;
+  insn->handler = chip8->handlers[insn->op];
+}
+
+// Calling every instruction through chip8->handlers measured slower than
+// the nested switch on tight loops (IBM.ch8's final jump), the call costs
+// more than the decode it saves. The handlers that do not depend on the
+// quirk profile are switched to directly instead, so they are inlined and
+// the compiler turns the switch over the dense Chip8Op into one jump table.
+void process_instruction(Chip8 *chip8) {
+  /* Fetch */
+  chip8->opcode = (chip8->memory[chip8->pc & ADDRESS_MASK] << 8) | chip8->memory[(chip8->pc + 1) & ADDRESS_MASK];
+  chip8->pc += 2;
+
+  /* Decode & Execute */
+  Chip8Insn insn;
+  decode_operands(&insn, chip8->opcode);
+  u8 op = dispatch_table[chip8->opcode];
+  switch (op) {
+  case OP_00E0:
+    op_00E0(chip8, &insn);
+    break;
+  case OP_00EE:
+    op_00EE(chip8, &insn);
+    break;
+  case OP_1nnn:
+    op_1nnn(chip8, &insn);
+    break;
+  case OP_2nnn:
+    op_2nnn(chip8, &insn);
+    break;
+  case OP_3xkk:
+    op_3xkk(chip8, &insn);
+    break;
+  case OP_4xkk:
+    op_4xkk(chip8, &insn);
+    break;
+  case OP_5xy0:
+    op_5xy0(chip8, &insn);
+    break;
+  case OP_6xkk:
+    op_6xkk(chip8, &insn);
+    break;
+  case OP_7xkk:
+    op_7xkk(chip8, &insn);
+    break;
+  case OP_8xy0:
+    op_8xy0(chip8, &insn);
+    break;
+  case OP_8xy4:
+    op_8xy4(chip8, &insn);
+    break;
+  case OP_8xy5:
+    op_8xy5(chip8, &insn);
+    break;
+  case OP_8xy7:
+    op_8xy7(chip8, &insn);
+    break;
+  case OP_9xy0:
+    op_9xy0(chip8, &insn);
+    break;
+  case OP_Annn:
+    op_Annn(chip8, &insn);
+    break;
+  case OP_Cxkk:
+    op_Cxkk(chip8, &insn);
+    break;
+  case OP_Ex9E:
+    op_Ex9E(chip8, &insn);
+    break;
+  case OP_ExA1:
+    op_ExA1(chip8, &insn);
+    break;
+  case OP_Fx07:
+    op_Fx07(chip8, &insn);
+    break;
+  case OP_Fx0A:
+    op_Fx0A(chip8, &insn);
+    break;
+  case OP_Fx15:
+    op_Fx15(chip8, &insn);
+    break;
+  case OP_Fx18:
+    op_Fx18(chip8, &insn);
+    break;
+  case OP_Fx1E:
+    op_Fx1E(chip8, &insn);
+    break;
+  case OP_Fx29:
+    op_Fx29(chip8, &insn);
+    break;
+  case OP_Fx33:
+    op_Fx33(chip8, &insn);
+    break;
+  case OP_0nnn:
+    break;
+  default:
+    chip8->handlers[op](chip8, &insn);
+    break;
+  }
+}
+
+/*********************************
+    Predecode cache
+
+    One Chip8Insn per address of the program region 0x200-0xFFE, odd ones
+    included since some ROMs (Space, br8kout) run entirely off odd
+    addresses. An entry is decoded the first time its address is executed
+    and stays valid until something writes into the two bytes it was
+    decoded from (or, for a superinstruction, into the instructions it
+    covers). Fx33, Fx55 and load_rom report their writes through
+    invalidate_code, so self modifying ROMs simply get their changed
+    instructions decoded again. Everything below 0x200 is not cached and
+    goes through process_instruction.
+ *********************************/
+
+int enable_decode_cache(Chip8 *chip8) {
+  if (chip8->decode_cache != NULL) {
+    return 0;
+  }
+  chip8->decode_cache = calloc(DECODE_CACHE_SIZE, sizeof(Chip8Insn));
+  if (chip8->decode_cache == NULL) {
+    printf("Error allocating the decode cache\n");
+    return -1;
+  }
+  return 0;
+}
+
+void free_decode_cache(Chip8 *chip8) {
+  free(chip8->decode_cache);
+  chip8->decode_cache = NULL;
+}
+
+void invalidate_code(Chip8 *chip8, u16 address, u16 length) {
+  address &= ADDRESS_MASK;
+  if (address + length > MEMORY_SIZE) {
+    // the write wrapped around to 0x000
+    u16 head = MEMORY_SIZE - address;
+    invalidate_code(chip8, 0, length - head);
+    length = head;
+  }
+  u32 first_block = address >> MEMORY_BLOCK_SHIFT;
+  u32 last_block = (address + length - 1) >> MEMORY_BLOCK_SHIFT;
+  if (length > 0 && first_block < 64) {
+    last_block = last_block < 63 ? last_block : 63;
+    chip8->memory_dirty |= (~0ull >> (63 - last_block)) & (~0ull << first_block);
+  }
+  if (chip8->on_code_write != NULL) {
+    chip8->on_code_write(chip8, address, length);
+  }
+  if (chip8->decode_cache == NULL) {
+    return;
+  }
+  // an entry covers the byte at its own address and the one after it, a
+  // fused entry also the up to two instructions following it
+  u32 first = address;
+  u32 end = address + length;
+  first = (first < START_ADDRESS + 5) ? START_ADDRESS : first - 5;
+  if (end > START_ADDRESS + DECODE_CACHE_SIZE) {
+    end = START_ADDRESS + DECODE_CACHE_SIZE;
+  }
+  for (u32 addr = first; addr < end; addr++) {
+    chip8->decode_cache[addr - START_ADDRESS].handler = NULL;
+  }
+}
+
+void process_instruction_cached(Chip8 *chip8) {
+  u16 pc = chip8->pc;
+  u16 offset = pc - START_ADDRESS;
+  if (chip8->decode_cache == NULL || offset >= DECODE_CACHE_SIZE) {
+    process_instruction(chip8);
+    return;
+  }
+
+  Chip8Insn *insn = &chip8->decode_cache[offset];
+  if (insn->handler == NULL) {
+    decode_insn(chip8, insn, (chip8->memory[pc] << 8) | chip8->memory[pc + 1]);
+  }
+  chip8->pc = pc + 2;
+  if (insn->fusion != FUSION_NONE) {
+    // only the first instruction of the sequence
+    chip8->handlers[insn->op](chip8, insn);
+    return;
+  }
+  insn->handler(chip8, insn);
+}
+
+/*********************************
+    Superinstructions
+
+    run_fused decodes a few very common sequences (see Chip8Fusion) into
+    one entry whose handler runs all of them, so the sequence costs a
+    single dispatch. The handler finds the operands of the following
+    instructions in their own cache entries (insn[2], insn[4]), which are
+    decoded together with the head. Those entries keep working on their
+    own, so a jump or skip into the middle of a sequence just starts at
+    that entry. Control flow can only be the last instruction of a
+    sequence, everything before it advances pc by 2. A sequence only runs fused if all of it fits into the
+    remaining budget, otherwise its first instruction runs alone.
+ *********************************/
+
+const char *const fusion_names[FUSION_COUNT] = {
+    [FUSION_NONE] = "none",
+    [FUSION_Annn_Dxyn] = "Annn Dxyn",
+    [FUSION_Annn_Fx1E] = "Annn Fx1E",
+    [FUSION_Annn_Fx65] = "Annn Fx65",
+    [FUSION_6xkk_6xkk] = "6xkk 6xkk",
+    [FUSION_6xkk_6xkk_6xkk] = "6xkk 6xkk 6xkk",
+    [FUSION_7xkk_3xkk] = "7xkk 3xkk",
+    [FUSION_7xkk_4xkk] = "7xkk 4xkk",
+    [FUSION_Fx07_3xkk] = "Fx07 3xkk",
+};
+
+// instructions covered by each fusion
+static const u8 fusion_lengths[FUSION_COUNT] = {
+    [FUSION_NONE] = 1,
+    [FUSION_Annn_Dxyn] = 2,
+    [FUSION_Annn_Fx1E] = 2,
+    [FUSION_Annn_Fx65] = 2,
+    [FUSION_6xkk_6xkk] = 2,
+    [FUSION_6xkk_6xkk_6xkk] = 3,
+    [FUSION_7xkk_3xkk] = 2,
+    [FUSION_7xkk_4xkk] = 2,
+    [FUSION_Fx07_3xkk] = 2,
+};
+
+static void fused_Annn_Dxyn(Chip8 *chip8, const Chip8Insn *insn) {
+  chip8->I = insn[0].nnn;
+  chip8->pc += 2;
+  chip8->handlers[OP_Dxyn](chip8, &insn[2]);
+}
+
+static void fused_Annn_Fx1E(Chip8 *chip8, const Chip8Insn *insn) {
+  chip8->I = (insn[0].nnn + chip8->V[insn[2].x]) & ADDRESS_MASK;
+  chip8->pc += 2;
+}
+
+static void fused_Annn_Fx65(Chip8 *chip8, const Chip8Insn *insn) {
+  chip8->I = insn[0].nnn;
+  chip8->pc += 2;
+  chip8->handlers[OP_Fx65](chip8, &insn[2]);
+}
+
+static void fused_6xkk_6xkk(Chip8 *chip8, const Chip8Insn *insn) {
+  chip8->V[insn[0].x] = insn[0].kk;
+  chip8->V[insn[2].x] = insn[2].kk;
+  chip8->pc += 2;
+}
+
+static void fused_6xkk_6xkk_6xkk(Chip8 *chip8, const Chip8Insn *insn) {
+  chip8->V[insn[0].x] = insn[0].kk;
+  chip8->V[insn[2].x] = insn[2].kk;
+  chip8->V[insn[4].x] = insn[4].kk;
+  chip8->pc += 4;
+}
+
+static void fused_7xkk_3xkk(Chip8 *chip8, const Chip8Insn *insn) {
+  chip8->V[insn[0].x] += insn[0].kk;
+  chip8->pc += 2;
+  if (chip8->V[insn[2].x] == insn[2].kk) {
+    chip8->pc += 2;
+  }
+}
+
+static void fused_7xkk_4xkk(Chip8 *chip8, const Chip8Insn *insn) {
+  chip8->V[insn[0].x] += insn[0].kk;
+  chip8->pc += 2;
+  if (chip8->V[insn[2].x] != insn[2].kk) {
+    chip8->pc += 2;
+  }
+}
+
+static void fused_Fx07_3xkk(Chip8 *chip8, const Chip8Insn *insn) {
+  chip8->V[insn[0].x] = chip8->delay_timer;
+  chip8->pc += 2;
+  if (chip8->V[insn[2].x] == insn[2].kk) {
+    chip8->pc += 2;
+  }
+}
+
+static const Chip8Handler fusion_handlers[FUSION_COUNT] = {
+    [FUSION_Annn_Dxyn] = fused_Annn_Dxyn,
+    [FUSION_Annn_Fx1E] = fused_Annn_Fx1E,
+    [FUSION_Annn_Fx65] = fused_Annn_Fx65,
+    [FUSION_6xkk_6xkk] = fused_6xkk_6xkk,
+    [FUSION_6xkk_6xkk_6xkk] = fused_6xkk_6xkk_6xkk,
+    [FUSION_7xkk_3xkk] = fused_7xkk_3xkk,
+    [FUSION_7xkk_4xkk] = fused_7xkk_4xkk,
+    [FUSION_Fx07_3xkk] = fused_Fx07_3xkk,
+};
+
+// decodes the entry at pc, and the next two if they start a fusion with it
+static void decode_fused(Chip8 *chip8, Chip8Insn *insn, u16 pc) {
+  decode_insn(chip8, insn, (chip8->memory[pc] << 8) | chip8->memory[pc + 1]);
+
+  Chip8Op next[2] = {OP_ILLEGAL, OP_ILLEGAL};
+  for (u32 i = 0; i < 2 && pc + 2 * (i + 1) <= 0xFFE; i++) {
+    Chip8Insn *entry = &insn[2 * (i + 1)];
+    u16 addr = pc + 2 * (i + 1);
+    if (entry->handler == NULL) {
+      decode_insn(chip8, entry, (chip8->memory[addr] << 8) | chip8->memory[addr + 1]);
+    }
+    next[i] = entry->op;
+  }
+
+  Chip8Fusion fusion = FUSION_NONE;
+  switch (insn->op) {
+  case OP_Annn:
+    fusion = next[0] == OP_Dxyn   ? FUSION_Annn_Dxyn
+             : next[0] == OP_Fx1E ? FUSION_Annn_Fx1E
+             : next[0] == OP_Fx65 ? FUSION_Annn_Fx65
+                                  : FUSION_NONE;
+    break;
+  case OP_6xkk:
+    fusion = next[0] != OP_6xkk   ? FUSION_NONE
+             : next[1] == OP_6xkk ? FUSION_6xkk_6xkk_6xkk
+                                  : FUSION_6xkk_6xkk;
+    break;
+  case OP_7xkk:
+    fusion = next[0] == OP_3xkk   ? FUSION_7xkk_3xkk
+             : next[0] == OP_4xkk ? FUSION_7xkk_4xkk
+                                  : FUSION_NONE;
+    break;
+  case OP_Fx07:
+    fusion = next[0] == OP_3xkk ? FUSION_Fx07_3xkk : FUSION_NONE;
+    break;
+  default:
+    break;
+  }
+  if (fusion != FUSION_NONE) {
+    insn->fusion = fusion;
+    insn->handler = fusion_handlers[fusion];
+  }
+}
+
+void run_fused(Chip8 *chip8, u32 n) {
+  while (n > 0) {
+    u16 pc = chip8->pc;
+    u16 offset = pc - START_ADDRESS;
+    if (chip8->decode_cache == NULL || offset >= DECODE_CACHE_SIZE) {
+      u32 elided = skip_idle_loop(chip8, n);
+      if (elided > 0) {
+        n -= elided;
+        continue;
+      }
+      process_instruction(chip8);
+      n--;
+      continue;
+    }
+
+    Chip8Insn *insn = &chip8->decode_cache[offset];
+    if (insn->handler == NULL) {
+      decode_fused(chip8, insn, pc);
+    }
+    chip8->pc = pc + 2;
+    u32 length = fusion_lengths[insn->fusion];
+    if (length > n) {
+      chip8->handlers[insn->op](chip8, insn);
+      n--;
+      continue;
+    }
+    insn->handler(chip8, insn);
+    chip8->fusion_hits[insn->fusion]++;
+    n -= length;
+
+    if (insn->op == OP_1nnn || insn->op == OP_Fx0A) {
+      n -= skip_idle_loop(chip8, n);
+    }
+  }
+}
+
+/*********************************
+    Idle loops
+
+    ROMs wait for the delay timer or a key in tight loops like
+
+      0x300: F307   V3 = delay timer
+      0x302: 3300   skip if V3 == 0
+      0x304: 1300   jump 0x300
+
+    Neither the timers nor the keypad change while a batch of instructions
+    runs, so once such a loop has been entered with its exit condition
+    false, all whole iterations left in the batch would leave the machine
+    exactly as it is. skip_idle_loop recognizes the loop head by its
+    instructions and accounts for those iterations without running them.
+    Recognized loops:
+
+      1nnn to itself
+      Fx0A with no key pressed
+      Ex9E/ExA1 followed by a jump back to it
+      Fx07, 3xkk/4xkk on the same register, jump back to the Fx07
+ *********************************/
+
+u32 idle_loop_length(const u8 *memory, u16 address) {
+  if (address > 0xFFE) {
+    return 0;
+  }
+  u16 jump_back = 0x1000 | address;
+  u16 first = (memory[address] << 8) | memory[address + 1];
+  if (first == jump_back || (first & 0xF0FF) == 0xF00A) {
+    return 1;
+  }
+  if (address > 0xFFA) {
+    return 0;
+  }
+  u16 second = (memory[address + 2] << 8) | memory[address + 3];
+  if (((first & 0xF0FF) == 0xE09E || (first & 0xF0FF) == 0xE0A1) && second == jump_back) {
+    return 2;
+  }
+  if (address > 0xFF8) {
+    return 0;
+  }
+  u16 third = (memory[address + 4] << 8) | memory[address + 5];
+  u16 compare = second & 0xF000;
+  if ((first & 0xF0FF) == 0xF007 && (compare == 0x3000 || compare == 0x4000) &&
+      (second & 0x0F00) == (first & 0x0F00) && third == jump_back) {
+    return 3;
+  }
+  return 0;
+}
+
+u32 skip_idle_loop(Chip8 *chip8, u32 n) {
+  u16 pc = chip8->pc;
+  u32 length = idle_loop_length(chip8->memory, pc);
+  if (length == 0 || n < length) {
+    return 0;
+  }
+
+  u8 x = chip8->memory[pc] & 0x0F;
+  switch (length) {
+  case 1:
+    // 1nnn never leaves, Fx0A only with a key down
+    if ((chip8->memory[pc] & 0xF0) == 0xF0) {
+      for (u8 key = 0; key < KEYPAD_MAX; key++) {
+        if (chip8->keypad[key]) {
+          return 0;
+        }
+      }
+    }
+    break;
+  case 2: {
+    // Ex9E loops while the key is up, ExA1 while it is down
+    int pressed = key_down(chip8, chip8->V[x]);
+    if (pressed == (chip8->memory[pc + 1] == 0x9E)) {
+      return 0;
+    }
+    break;
+  }
+  case 3: {
+    // 3xkk loops until the timer reaches kk, 4xkk while it is kk
+    u8 kk = chip8->memory[pc + 3];
+    if ((chip8->delay_timer == kk) == ((chip8->memory[pc + 2] & 0xF0) == 0x30)) {
+      return 0;
+    }
+    chip8->V[x] = chip8->delay_timer;
+    break;
+  }
+  }
+
+  // the rest of the batch is spent in the loop, leftover instructions of a
+  // partial iteration are run normally
+  u32 elided = n - n % length;
+  chip8->idle_skips++;
+  chip8->idle_elided += elided;
+  return elided;
+}
+
+/*********************************
+    Flag liveness
+
+    Most VF updates of the arithmetic instructions are overwritten before
+    anything looks at them. vf_usage tells which instructions read or
+    overwrite VF, the JIT uses it to drop flag updates that are dead within
+    a block. The interpreters store VF every time, looking ahead for the
+    next use of it costs them more than the store.
+ *********************************/
+
+u8 vf_usage(const Chip8 *chip8, u16 opcode) {
+  const Chip8QuirkFlags *quirks = &quirk_flags[chip8->quirks];
+  u8 x = (opcode & 0x0F00) >> 8;
+  u8 y = (opcode & 0x00F0) >> 4;
+  int reads_x = x == 0xF ? VF_READ : 0;
+  int reads_xy = (x == 0xF || y == 0xF) ? VF_READ : 0;
+  int writes_x = x == 0xF ? VF_WRITE : 0;
+
+  switch (dispatch_table[opcode]) {
+  case OP_3xkk:
+  case OP_4xkk:
+  case OP_7xkk:
+  case OP_Ex9E:
+  case OP_ExA1:
+  case OP_Fx15:
+  case OP_Fx18:
+  case OP_Fx1E:
+  case OP_Fx29:
+  case OP_Fx33:
+  case OP_Fx55:
+    return reads_x;
+  case OP_5xy0:
+  case OP_9xy0:
+    return reads_xy;
+  case OP_6xkk:
+  case OP_Cxkk:
+  case OP_Fx07:
+  case OP_Fx65:
+    return writes_x;
+  case OP_8xy0:
+    return y == 0xF ? VF_READ : writes_x;
+  case OP_8xy1:
+  case OP_8xy2:
+  case OP_8xy3:
+    return reads_xy ? reads_xy : quirks->vf_reset ? VF_WRITE : 0;
+  case OP_8xy4:
+  case OP_8xy5:
+  case OP_8xy7:
+  case OP_Dxyn:
+    return reads_xy ? reads_xy : VF_WRITE;
+  case OP_8xy6:
+  case OP_8xyE:
+    return (quirks->shift_vy ? y : x) == 0xF ? VF_READ : VF_WRITE;
+  case OP_Bnnn:
+    return (quirks->jump_vx ? x : 0) == 0xF ? VF_READ : 0;
+  case OP_Fx0A:
+    // only writes Vx once a key is down
+    return reads_x;
+  default:
+    return 0;
+  }
+}
+
+int vf_is_dead(const Chip8 *chip8, u16 address, u16 end) {
+  for (u32 addr = address; addr < end && addr <= 0xFFE; addr += 2) {
+    u16 opcode = (chip8->memory[addr] << 8) | chip8->memory[addr + 1];
+    u8 usage = vf_usage(chip8, opcode);
+    if (usage & VF_READ) {
+      return 0;
+    }
+    if (usage & VF_WRITE) {
+      return 1;
+    }
+    switch (dispatch_table[opcode]) {
+    case OP_ILLEGAL:
+    case OP_00EE:
+    case OP_1nnn:
+    case OP_2nnn:
+    case OP_3xkk:
+    case OP_4xkk:
+    case OP_5xy0:
+    case OP_9xy0:
+    case OP_Bnnn:
+    case OP_Ex9E:
+    case OP_ExA1:
+    case OP_Fx0A:
+    case OP_Fx33:
+    case OP_Fx55:
+      // leaves the straight-line code or may rewrite it
+      return 0;
+    default:
+      break;
+    }
+  }
+  return 0;
+}
+
+// VF as set by the instruction op from its inputs a and b, for the shifts
+// and the VF reset quirk a already is the new value
+static inline u8 flag_value(u8 op, u8 a, u8 b) {
+  switch (op) {
+  case OP_8xy4:
+    return a + b > 255;
+  case OP_8xy5:
+    return a >= b;
+  case OP_8xy7:
+    return a <= b;
+  default:
+    return a;
+  }
+}
+
+/*********************************
+    Threaded interpreter
+
+    run_cycles keeps pc, I and the opcode in locals and jumps from one
+    instruction body straight to the next with GCC/Clang labels as values
+    (goto *label), so every instruction gets its own indirect branch and
+    control never returns to the caller between instructions. The locals
+    are written back to the Chip8 once at the end, or before calling into
+    a handler that needs the real state (Dxyn, Fx0A).
+
+    Compilers without the extension (or -DCHIP8_NO_COMPUTED_GOTO) get the
+    same instruction bodies inside a plain switch.
+
+    The core itself is in chip8_run.h.
+ *********************************/
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(CHIP8_NO_COMPUTED_GOTO)
+#define CHIP8_COMPUTED_GOTO 1
+const int run_cycles_threaded = 1;
+#else
+#define CHIP8_COMPUTED_GOTO 0
+const int run_cycles_threaded = 0;
+#endif
+
+/*********************************
+    Quirk profiles
+
+    One specialized copy of the quirk dependent handlers and of run_cycles
+    per profile, see chip8_quirks.h.
+ *********************************/
+
+#define QUIRK_PROFILE VIP
+#include "chip8_quirks.h"
+#define QUIRK_PROFILE CHIP48
+#include "chip8_quirks.h"
+#define QUIRK_PROFILE SCHIP
+#include "chip8_quirks.h"
+#define QUIRK_PROFILE XOCHIP
+#include "chip8_quirks.h"
+
+#define QUIRK_FLAGS(profile, name)                                                        \
+  {name, QUIRKS_##profile##_VF_RESET, QUIRKS_##profile##_SHIFT_VY,                        \
+   QUIRKS_##profile##_MEMORY_INCREMENT, QUIRKS_##profile##_WRAP, QUIRKS_##profile##_JUMP_VX}
+
+const Chip8QuirkFlags quirk_flags[QUIRKS_COUNT] = {
+    [QUIRKS_VIP] = QUIRK_FLAGS(VIP, "vip"),
+    [QUIRKS_CHIP48] = QUIRK_FLAGS(CHIP48, "chip48"),
+    [QUIRKS_SCHIP] = QUIRK_FLAGS(SCHIP, "schip"),
+    [QUIRKS_XOCHIP] = QUIRK_FLAGS(XOCHIP, "xochip"),
+};
+
+static const Chip8Handler *const quirk_handlers[QUIRKS_COUNT] = {
+    [QUIRKS_VIP] = handlers_VIP,
+    [QUIRKS_CHIP48] = handlers_CHIP48,
+    [QUIRKS_SCHIP] = handlers_SCHIP,
+    [QUIRKS_XOCHIP] = handlers_XOCHIP,
+};
+
+static void (*const quirk_run_cycles[QUIRKS_COUNT])(Chip8 *chip8, u32 n) = {
+    [QUIRKS_VIP] = run_cycles_VIP,
+    [QUIRKS_CHIP48] = run_cycles_CHIP48,
+    [QUIRKS_SCHIP] = run_cycles_SCHIP,
+    [QUIRKS_XOCHIP] = run_cycles_XOCHIP,
+};
+
+void run_cycles(Chip8 *chip8, u32 n) {
+  quirk_run_cycles[chip8->quirks](chip8, n);
+}
+
+void set_quirks(Chip8 *chip8, Chip8Quirks quirks) {
+  if (chip8->handlers == quirk_handlers[quirks]) {
+    return;
+  }
+  chip8->quirks = quirks;
+  chip8->handlers = quirk_handlers[quirks];
+  // predecoded and translated code has the old behavior baked in
+  invalidate_code(chip8, 0, sizeof(chip8->memory));
+}
+
+int quirks_by_name(const char *name) {
+  for (int quirks = 0; quirks < QUIRKS_COUNT; quirks++) {
+    if (strcmp(name, quirk_flags[quirks].name) == 0) {
+      return quirks;
+    }
+  }
+  return -1;
+}
+
+Chip8Quirks quirks_for_rom(const char *file_name) {
+  const char *extension = strrchr(file_name, '.');
+  if (extension != NULL && strcmp(extension, ".sc8") == 0) {
+    return QUIRKS_SCHIP;
+  }
+  if (extension != NULL && strcmp(extension, ".xo8") == 0) {
+    return QUIRKS_XOCHIP;
+  }
+  return QUIRKS_VIP;
+}
@@ -0,0 +1,346 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stdint.h>
+
+/*******************************
+    Chip8 general memory layout
+
+    0x000-0x1FF -> Chip8 interpreter (contains font set in emu)
+    0x050-0x0A0 -> Used for the built in 4x5 pixel font set (0-F)
+    0x200-0xFFF -> Program ROM and free RAM
+ ********************************/
+
+#define u8 uint8_t
+#define u16 uint16_t
+#define u32 uint32_t
+
+#define MEMORY_SIZE 4096
+// every address is taken modulo MEMORY_SIZE, I, pc and I + n run past 0xFFF
+// but no instruction reads or writes outside of Chip8.memory
+#define ADDRESS_MASK (MEMORY_SIZE - 1)
+#define STACK_MASK 15 // same for the stack, 2nnn/00EE index it with sp & STACK_MASK
+#define START_ADDRESS 0x200 // 0x200 needs 12 bits to be displayed 512 in base 10
+#define ROM_SIZE_MAX (4096 - START_ADDRESS)
+#define FONTSET_START_ADDRESS 0x50
+#define FONTSET_SIZE 80
+
+#define SCREEN_WIDTH 64
+#define SCREEN_HEIGHT 32
+#define VIDEO_SUBSCRIBERS_MAX 8 // frame consumers that can track dirty rows at once
+#define KEYPAD_MAX 16
+#define MEMORY_BLOCK_SHIFT 6 // Chip8.memory_dirty tracks 64 blocks of 64 bytes
+
+/*********************************
+    Quirk profiles
+
+    The CHIP-8 variants disagree on a handful of instructions. Each profile
+    is a set of compile time flags, chip8_quirks.h turns every profile into
+    its own specialized interpreter and load_rom picks one of them.
+ *********************************/
+
+// COSMAC VIP, the original interpreter
+#define QUIRKS_VIP_VF_RESET 1         // 8xy1, 8xy2 and 8xy3 reset VF to 0
+#define QUIRKS_VIP_SHIFT_VY 1         // 8xy6 and 8xyE shift Vy into Vx instead of shifting Vx
+#define QUIRKS_VIP_MEMORY_INCREMENT 1 // Fx55/Fx65 leave I behind the last register (2: on it, 0: unchanged)
+#define QUIRKS_VIP_WRAP 0             // Dxyn wraps sprites around the screen edge instead of clipping
+#define QUIRKS_VIP_JUMP_VX 0          // Bnnn jumps to xnn + Vx instead of nnn + V0
+
+// CHIP-48 on the HP-48
+#define QUIRKS_CHIP48_VF_RESET 0
+#define QUIRKS_CHIP48_SHIFT_VY 0
+#define QUIRKS_CHIP48_MEMORY_INCREMENT 2
+#define QUIRKS_CHIP48_WRAP 0
+#define QUIRKS_CHIP48_JUMP_VX 1
+
+// SUPER-CHIP 1.1
+#define QUIRKS_SCHIP_VF_RESET 0
+#define QUIRKS_SCHIP_SHIFT_VY 0
+#define QUIRKS_SCHIP_MEMORY_INCREMENT 0
+#define QUIRKS_SCHIP_WRAP 0
+#define QUIRKS_SCHIP_JUMP_VX 1
+
+// XO-CHIP
+#define QUIRKS_XOCHIP_VF_RESET 0
+#define QUIRKS_XOCHIP_SHIFT_VY 1
+#define QUIRKS_XOCHIP_MEMORY_INCREMENT 1
+#define QUIRKS_XOCHIP_WRAP 1
+#define QUIRKS_XOCHIP_JUMP_VX 0
+
+typedef enum Chip8Quirks {
+  QUIRKS_VIP,
+  QUIRKS_CHIP48,
+  QUIRKS_SCHIP,
+  QUIRKS_XOCHIP,
+  QUIRKS_COUNT
+} Chip8Quirks;
+
+// the flags of a profile as data, for code generators that have to follow
+// the selected profile (the JIT)
+typedef struct Chip8QuirkFlags {
+  const char *name;
+  u8 vf_reset;
+  u8 shift_vy;
+  u8 memory_increment;
+  u8 wrap;
+  u8 jump_vx;
+} Chip8QuirkFlags;
+
+extern const Chip8QuirkFlags quirk_flags[QUIRKS_COUNT];
+
+struct Chip8;
+struct Chip8Insn;
+typedef void (*Chip8Handler)(struct Chip8 *chip8, const struct Chip8Insn *insn);
+
+// superinstructions the predecode cache fuses common sequences into, see
+// run_fused
+typedef enum Chip8Fusion {
+  FUSION_NONE,
+  FUSION_Annn_Dxyn,      // point I at a sprite and draw it
+  FUSION_Annn_Fx1E,      // index into a table
+  FUSION_Annn_Fx65,      // load registers from a table
+  FUSION_6xkk_6xkk,      // register loads
+  FUSION_6xkk_6xkk_6xkk,
+  FUSION_7xkk_3xkk,      // loop counters
+  FUSION_7xkk_4xkk,
+  FUSION_Fx07_3xkk,      // delay timer polling
+  FUSION_COUNT
+} Chip8Fusion;
+
+typedef struct Chip8 {
+  u8 V[16];        // general purpose registers rangig from V1 to VE
+  u8 memory[4096]; // 4K RAM
+  u16 I;           // index register
+  u16 pc;          // program counter
+  u16 stack[16];   // stack for storing instructions
+  u8 sp;           // stack pointer
+  u8 delay_timer;
+  u8 sound_timer;
+  u8 keypad[KEYPAD_MAX];
+  uint64_t video[SCREEN_HEIGHT]; // one bit per pixel, a row per word, see video_pixel
+  u32 video_dirty;               // rows changed not handed to the subscribers yet, see video_take_dirty
+  uint64_t random_state;         // Cxkk's generator, see seed_random
+  u16 opcode;                    // opcodes each 2 bytes long
+
+  u8 quirks;                    // Chip8Quirks, set with set_quirks
+  const Chip8Handler *handlers; // handler table of the quirk profile, indexed by Chip8Op
+
+  struct Chip8Insn *decode_cache; // predecoded 0x200-0xFFE, NULL if not enabled
+
+  // called by invalidate_code so engines with their own translated code
+  // (e.g. the JIT) can drop it, code_write_data is passed through for them
+  void (*on_code_write)(struct Chip8 *chip8, u16 address, u16 length);
+  void *code_write_data;
+  // memory blocks written since whoever tracks them (the rewind buffer)
+  // last cleared it, bit b for the bytes from b << MEMORY_BLOCK_SHIFT on.
+  // Set by invalidate_code, so every write that keeps the decode cache
+  // right also shows up in here
+  uint64_t memory_dirty;
+
+  // idle loops fast-forwarded by skip_idle_loop and the instructions elided
+  u32 idle_skips;
+  uint64_t idle_elided;
+
+  uint64_t fusion_hits[FUSION_COUNT]; // superinstructions executed by run_fused
+
+  // dirty rows not yet taken by each subscriber, see video_subscribe
+  u32 video_subscribers; // one bit per subscriber id in use
+  u32 video_pending[VIDEO_SUBSCRIBERS_MAX];
+} Chip8;
+
+// every instruction the decoder knows about, used as index into the handler table
+typedef enum Chip8Op {
+  OP_ILLEGAL,
+  OP_0nnn,
+  OP_00E0,
+  OP_00EE,
+  OP_1nnn,
+  OP_2nnn,
+  OP_3xkk,
+  OP_4xkk,
+  OP_5xy0,
+  OP_6xkk,
+  OP_7xkk,
+  OP_8xy0,
+  OP_8xy1,
+  OP_8xy2,
+  OP_8xy3,
+  OP_8xy4,
+  OP_8xy5,
+  OP_8xy6,
+  OP_8xy7,
+  OP_8xyE,
+  OP_9xy0,
+  OP_Annn,
+  OP_Bnnn,
+  OP_Cxkk,
+  OP_Dxyn,
+  OP_Ex9E,
+  OP_ExA1,
+  OP_Fx07,
+  OP_Fx0A,
+  OP_Fx15,
+  OP_Fx18,
+  OP_Fx1E,
+  OP_Fx29,
+  OP_Fx33,
+  OP_Fx55,
+  OP_Fx65,
+  OP_COUNT
+} Chip8Op;
+
+// an instruction with its operands already extracted from the opcode
+typedef struct Chip8Insn {
+  Chip8Handler handler; // NULL while the entry still has to be decoded
+  u8 op;                // Chip8Op
+  u8 fusion;            // Chip8Fusion, handler then runs the whole sequence
+  u8 x;
+  u8 y;
+  u8 n;
+  u8 kk;
+  u16 nnn;
+} Chip8Insn;
+
+#define DECODE_CACHE_SIZE (4096 - START_ADDRESS - 1) // one entry per address up to 0xFFE
+
+/*********************************
+    Framebuffer access
+
+    Chip8.video holds one uint64_t per row, the leftmost pixel is the top
+    bit. Renderers and other frame consumers read it through these instead
+    of picking the bits apart themselves.
+ *********************************/
+
+// 1 if the pixel at column x of row y is lit
+static inline int video_pixel(const Chip8 *chip8, u32 x, u32 y) {
+  return (chip8->video[y] >> (SCREEN_WIDTH - 1 - x)) & 1;
+}
+
+// 1 if key is held, values past the keypad (Ex9E with Vx > 0xF) never are
+static inline int key_down(const Chip8 *chip8, u8 key) {
+  return key < KEYPAD_MAX && chip8->keypad[key];
+}
+
+// clears the screen, marking the rows that had lit pixels dirty
+void clear_video(Chip8 *chip8);
+// expands row y into one u32 per pixel, on for lit pixels and off otherwise
+void video_expand_row(const Chip8 *chip8, u32 y, u32 *out, u32 on, u32 off);
+
+// 00E0 and Dxyn mark the rows they change in Chip8.video_dirty, bit y for
+// row y. Every frame consumer (renderer, recorder, encoder, ...) subscribes
+// once and then takes the rows that changed since its last call, so each of
+// them sees every change exactly once no matter how often the others look.
+// Restoring a save state or a fork marks the rows it changes the same way.
+// The rewind buffer is one of them.
+// returns the subscriber id, -1 if all VIDEO_SUBSCRIBERS_MAX are taken
+// a new subscriber starts with every row dirty
+int video_subscribe(Chip8 *chip8);
+void video_unsubscribe(Chip8 *chip8, int id);
+// rows changed since the last call for this subscriber, then clears them
+u32 video_take_dirty(Chip8 *chip8, int id);
+
+// 64-bit hash of the whole screen. Dirty rows only say a row was drawn to,
+// a sprite drawn and erased again within one frame leaves it dirty but
+// unchanged, so frame consumers compare hashes to drop identical frames.
+uint64_t video_hash(const Chip8 *chip8);
+
+extern const char *const op_names[OP_COUNT];
+extern const char *const fusion_names[FUSION_COUNT];
+
+int load_rom(Chip8 *chip8, const char *file_name);
+// copies a ROM already in memory to START_ADDRESS, -1 if it is too big
+// unlike load_rom it keeps the quirk profile, see quirks_for_rom
+int load_rom_image(Chip8 *chip8, const u8 *image, u32 size);
+// init_chip8 seeds Cxkk with 1, so runs are reproducible unless reseeded
+void init_chip8(Chip8 *chip8);
+// every instance has its own generator, nothing is shared between them
+void seed_random(Chip8 *chip8, uint64_t seed);
+// sets the whole keypad from a bitmask, bit k for key k
+void set_keypad(Chip8 *chip8, u16 keys);
+
+// decodes a raw opcode into its Chip8Op without executing it
+Chip8Op decode_opcode(u16 opcode);
+// builds the 64K opcode -> handler table, called by init_chip8
+void init_dispatch_table(void);
+// fills insn with the handler and operands of opcode
+void decode_insn(const Chip8 *chip8, struct Chip8Insn *insn, u16 opcode);
+
+// switches to the interpreter specialized for quirks, drops all decoded code
+void set_quirks(Chip8 *chip8, Chip8Quirks quirks);
+// profile by name ("vip", "chip48", "schip", "xochip"), -1 if unknown
+int quirks_by_name(const char *name);
+// profile load_rom uses for a file: .sc8 is SUPER-CHIP, .xo8 XO-CHIP, anything else VIP
+Chip8Quirks quirks_for_rom(const char *file_name);
+
+// Fetch, decode and execute one instruction through the handler table
+void process_instruction(Chip8 *chip8);
+// same as process_instruction but decodes with the original nested switch
+void process_instruction_switch(Chip8 *chip8);
+
+// number of instructions of the timer/key polling loop starting at address,
+// 0 if there is none (only the instructions are matched, not the state)
+u32 idle_loop_length(const u8 *memory, u16 address);
+// if pc is at the head of an idle loop that can not be left before the next
+// timer tick or key change, fast-forwards through its whole iterations that
+// fit into n and returns how many instructions that elided, 0 otherwise
+u32 skip_idle_loop(Chip8 *chip8, u32 n);
+
+// how an instruction uses VF, returned by vf_usage
+#define VF_READ 1  // depends on the current value of VF
+#define VF_WRITE 2 // overwrites VF without looking at its old value
+u8 vf_usage(const Chip8 *chip8, u16 opcode);
+// 1 if the straight-line code starting at address overwrites VF before
+// anything reads it, only instructions below end are looked at
+int vf_is_dead(const Chip8 *chip8, u16 address, u16 end);
+
+// runs n instructions without returning in between, see chip8.c for details
+void run_cycles(Chip8 *chip8, u32 n);
+// 1 if run_cycles was built with computed goto dispatch, 0 for the switch
+extern const int run_cycles_threaded;
+
+// allocates the predecode cache, entries are decoded lazily on first execution
+// returns 0 on success, -1 if the allocation failed
+int enable_decode_cache(Chip8 *chip8);
+void free_decode_cache(Chip8 *chip8);
+// drops cached instructions overlapping [address, address + length)
+void invalidate_code(Chip8 *chip8, u16 address, u16 length);
+// same as process_instruction but executes out of the predecode cache
+void process_instruction_cached(Chip8 *chip8);
+// runs n instructions out of the predecode cache, executing fused sequences
+// with a single dispatch and fast-forwarding idle loops
+void run_fused(Chip8 *chip8, u32 n);
+
+/*********************************
+all 34 instructions of the Chip8
+8xy1, 8xy2, 8xy3, 8xy6, 8xyE, Bnnn, Dxyn, Fx55 and Fx65
+depend on the quirk profile and live in chip8_quirks.h
+*********************************/
+void op_illegal(Chip8 *chip8, const Chip8Insn *insn);
+void op_0nnn(Chip8 *chip8, const Chip8Insn *insn);
+void op_00E0(Chip8 *chip8, const Chip8Insn *insn);
+void op_00EE(Chip8 *chip8, const Chip8Insn *insn);
+void op_1nnn(Chip8 *chip8, const Chip8Insn *insn);
+void op_2nnn(Chip8 *chip8, const Chip8Insn *insn);
+void op_3xkk(Chip8 *chip8, const Chip8Insn *insn);
+void op_4xkk(Chip8 *chip8, const Chip8Insn *insn);
+void op_5xy0(Chip8 *chip8, const Chip8Insn *insn);
+void op_6xkk(Chip8 *chip8, const Chip8Insn *insn);
+void op_7xkk(Chip8 *chip8, const Chip8Insn *insn);
+void op_8xy0(Chip8 *chip8, const Chip8Insn *insn);
+void op_8xy4(Chip8 *chip8, const Chip8Insn *insn);
+void op_8xy5(Chip8 *chip8, const Chip8Insn *insn);
+void op_8xy7(Chip8 *chip8, const Chip8Insn *insn);
+void op_9xy0(Chip8 *chip8, const Chip8Insn *insn);
+void op_Annn(Chip8 *chip8, const Chip8Insn *insn);
+void op_Cxkk(Chip8 *chip8, const Chip8Insn *insn);
+void op_Ex9E(Chip8 *chip8, const Chip8Insn *insn);
+void op_ExA1(Chip8 *chip8, const Chip8Insn *insn);
+void op_Fx07(Chip8 *chip8, const Chip8Insn *insn);
+void op_Fx0A(Chip8 *chip8, const Chip8Insn *insn);
+void op_Fx15(Chip8 *chip8, const Chip8Insn *insn);
+void op_Fx18(Chip8 *chip8, const Chip8Insn *insn);
+void op_Fx1E(Chip8 *chip8, const Chip8Insn *insn);
+void op_Fx29(Chip8 *chip8, const Chip8Insn *insn);
+void op_Fx33(Chip8 *chip8, const Chip8Insn *insn);
+
+#endif
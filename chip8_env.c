@@ -0,0 +1,373 @@
+#define _POSIX_C_SOURCE 199309L
+#include "chip8_env.h"
+#include "sched.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct EnvInstance {
+  Chip8 chip8;
+  Chip8Sched sched;
+  uint64_t episode; // episodes started so far
+  uint64_t frames;  // of the current episode
+  double score;     // the reward reader's value after the last step
+} EnvInstance;
+
+typedef enum EnvTask {
+  ENV_RESET,
+  ENV_STEP,
+} EnvTask;
+
+struct Chip8Env {
+  EnvInstance *instances;
+  u32 count;
+  u32 frameskip;
+  u8 image[ROM_SIZE_MAX];
+  u32 image_size;
+
+  Chip8EnvObs obs;
+  Chip8Reader reward;
+  float reward_scale;
+  Chip8Reader done;
+  double done_value;
+  uint64_t max_frames;
+  Chip8Quirks quirks;
+  u32 ips;
+
+  // the pool: chip8_env_step publishes a task and bumps generation, every
+  // thread (the caller being thread 0) works on its slice of the instances
+  // and the last one to finish wakes the caller up again
+  pthread_t *threads;
+  u32 thread_count;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t finished;
+  u32 generation;
+  u32 busy; // threads still working on the task
+  int quit;
+
+  EnvTask task;
+  const u16 *actions;
+  u8 *obs_out;
+  float *reward_out;
+  u8 *done_out;
+};
+
+typedef struct EnvWorker {
+  Chip8Env *env;
+  u32 id;
+} EnvWorker;
+
+double chip8_read(const Chip8Reader *reader, const Chip8 *chip8) {
+  const u8 *memory = chip8->memory;
+  u16 address = reader->address & ADDRESS_MASK;
+  switch (reader->kind) {
+  case CHIP8_READ_BYTE:
+    return memory[address];
+  case CHIP8_READ_BCD:
+    return memory[address] * 100 + memory[(address + 1) & ADDRESS_MASK] * 10 + memory[(address + 2) & ADDRESS_MASK];
+  case CHIP8_READ_REGISTER:
+    return chip8->V[reader->address & 0xF];
+  case CHIP8_READ_CUSTOM:
+    return reader->read(chip8, reader->data);
+  default:
+    return 0;
+  }
+}
+
+/*********************************
+    instances
+ *********************************/
+
+// episode e of instance i is seeded with 1 + i + e * count, so no two
+// episodes of an environment see the same random numbers
+static void reset_instance(Chip8Env *env, u32 i) {
+  EnvInstance *instance = &env->instances[i];
+  Chip8 *chip8 = &instance->chip8;
+  // keep the decode cache, it only has to be emptied
+  struct Chip8Insn *cache = chip8->decode_cache;
+  memset(chip8, 0, sizeof(*chip8));
+  memset(cache, 0, DECODE_CACHE_SIZE * sizeof(Chip8Insn));
+  chip8->decode_cache = cache;
+
+  init_chip8(chip8);
+  seed_random(chip8, 1 + i + instance->episode * env->count);
+  load_rom_image(chip8, env->image, env->image_size);
+  set_quirks(chip8, env->quirks);
+  sched_init(&instance->sched, run_fused, env->ips, 0);
+  instance->episode++;
+  instance->frames = 0;
+  instance->score = chip8_read(&env->reward, chip8);
+}
+
+static void write_obs(const Chip8Env *env, const Chip8 *chip8, u8 *out) {
+  if (env->obs == CHIP8_OBS_PACKED) {
+    memcpy(out, chip8->video, sizeof(chip8->video));
+    return;
+  }
+  for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
+    uint64_t row = chip8->video[y];
+    for (u32 x = 0; x < SCREEN_WIDTH; x++) {
+      *out++ = -(u8)((row >> (SCREEN_WIDTH - 1 - x)) & 1);
+    }
+  }
+}
+
+static void step_instance(Chip8Env *env, u32 i) {
+  EnvInstance *instance = &env->instances[i];
+  Chip8 *chip8 = &instance->chip8;
+  set_keypad(chip8, env->actions[i]);
+  sched_run_ticks(&instance->sched, chip8, env->frameskip);
+  instance->frames += env->frameskip;
+
+  double score = chip8_read(&env->reward, chip8);
+  if (env->reward_out != NULL) {
+    env->reward_out[i] = env->reward_scale * (score - instance->score);
+  }
+  instance->score = score;
+
+  u8 done = (env->done.kind != CHIP8_READ_NONE && chip8_read(&env->done, chip8) == env->done_value) ||
+            (env->max_frames > 0 && instance->frames >= env->max_frames);
+  if (env->done_out != NULL) {
+    env->done_out[i] = done;
+  }
+  if (done) {
+    reset_instance(env, i);
+  }
+}
+
+static void run_slice(Chip8Env *env, u32 id) {
+  u32 begin = (uint64_t)env->count * id / env->thread_count;
+  u32 end = (uint64_t)env->count * (id + 1) / env->thread_count;
+  u32 obs_size = chip8_env_obs_size(env);
+  for (u32 i = begin; i < end; i++) {
+    if (env->task == ENV_STEP) {
+      step_instance(env, i);
+    } else {
+      reset_instance(env, i);
+    }
+    if (env->obs_out != NULL) {
+      write_obs(env, &env->instances[i].chip8, env->obs_out + (size_t)i * obs_size);
+    }
+  }
+}
+
+/*********************************
+    pool
+ *********************************/
+
+static void *worker_main(void *arg) {
+  EnvWorker *worker = arg;
+  Chip8Env *env = worker->env;
+  u32 seen = 0;
+  for (;;) {
+    pthread_mutex_lock(&env->lock);
+    while (env->generation == seen && !env->quit) {
+      pthread_cond_wait(&env->wake, &env->lock);
+    }
+    if (env->quit) {
+      pthread_mutex_unlock(&env->lock);
+      break;
+    }
+    seen = env->generation;
+    pthread_mutex_unlock(&env->lock);
+
+    run_slice(env, worker->id);
+
+    pthread_mutex_lock(&env->lock);
+    if (--env->busy == 0) {
+      pthread_cond_signal(&env->finished);
+    }
+    pthread_mutex_unlock(&env->lock);
+  }
+  free(worker);
+  return NULL;
+}
+
+static void run_task(Chip8Env *env, EnvTask task, const u16 *actions, void *obs_out, float *reward_out,
+                     u8 *done_out) {
+  pthread_mutex_lock(&env->lock);
+  env->task = task;
+  env->actions = actions;
+  env->obs_out = obs_out;
+  env->reward_out = reward_out;
+  env->done_out = done_out;
+  env->busy = env->thread_count - 1;
+  env->generation++;
+  pthread_cond_broadcast(&env->wake);
+  pthread_mutex_unlock(&env->lock);
+
+  run_slice(env, 0);
+
+  pthread_mutex_lock(&env->lock);
+  while (env->busy > 0) {
+    pthread_cond_wait(&env->finished, &env->lock);
+  }
+  pthread_mutex_unlock(&env->lock);
+}
+
+/*********************************
+    API
+ *********************************/
+
+static Chip8Env *create_env(const u8 *image, u32 size, u32 n_envs, u32 frameskip, Chip8Quirks quirks) {
+  if (n_envs == 0 || frameskip == 0) {
+    printf("An environment needs at least one instance and frameskip >= 1\n");
+    return NULL;
+  }
+  if (size > ROM_SIZE_MAX) {
+    printf("The ROM does not fit into memory, at most %d bytes\n", ROM_SIZE_MAX);
+    return NULL;
+  }
+  Chip8Env *env = calloc(1, sizeof(Chip8Env));
+  if (env == NULL) {
+    return NULL;
+  }
+  memcpy(env->image, image, size);
+  env->image_size = size;
+
+  env->count = n_envs;
+  env->frameskip = frameskip;
+  env->obs = CHIP8_OBS_PACKED;
+  env->reward_scale = 1;
+  env->quirks = quirks;
+  env->ips = SCHED_DEFAULT_IPS;
+  env->instances = calloc(n_envs, sizeof(EnvInstance));
+  if (env->instances == NULL) {
+    printf("Error allocating %u instances\n", n_envs);
+    free(env);
+    return NULL;
+  }
+  for (u32 i = 0; i < n_envs; i++) {
+    if (enable_decode_cache(&env->instances[i].chip8) != 0) {
+      env->count = i;
+      chip8_env_destroy(env);
+      return NULL;
+    }
+  }
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  env->thread_count = cores < 1 ? 1 : cores > n_envs ? n_envs : cores;
+  env->threads = calloc(env->thread_count, sizeof(pthread_t));
+  if (env->threads == NULL) {
+    env->thread_count = 1;
+  }
+  pthread_mutex_init(&env->lock, NULL);
+  pthread_cond_init(&env->wake, NULL);
+  pthread_cond_init(&env->finished, NULL);
+  for (u32 t = 1; t < env->thread_count; t++) {
+    EnvWorker *worker = malloc(sizeof(EnvWorker));
+    if (worker != NULL) {
+      worker->env = env;
+      worker->id = t;
+    }
+    if (worker == NULL || pthread_create(&env->threads[t], NULL, worker_main, worker) != 0) {
+      // run with the threads started so far
+      printf("Error starting environment thread %u\n", t);
+      free(worker);
+      env->thread_count = t;
+      break;
+    }
+  }
+  chip8_env_reset(env, NULL);
+  return env;
+}
+
+Chip8Env *chip8_env_create(const char *rom, u32 n_envs, u32 frameskip) {
+  u8 image[ROM_SIZE_MAX];
+  FILE *rom_file = fopen(rom, "rb");
+  if (rom_file == NULL) {
+    printf("Error opening `%s`\n", rom);
+    return NULL;
+  }
+  u32 size = fread(image, 1, ROM_SIZE_MAX, rom_file);
+  int too_big = fgetc(rom_file) != EOF;
+  fclose(rom_file);
+  if (too_big) {
+    printf("`%s` does not fit into memory, at most %d bytes\n", rom, ROM_SIZE_MAX);
+    return NULL;
+  }
+  return create_env(image, size, n_envs, frameskip, quirks_for_rom(rom));
+}
+
+Chip8Env *chip8_env_create_image(const u8 *image, u32 size, u32 n_envs, u32 frameskip) {
+  return create_env(image, size, n_envs, frameskip, QUIRKS_VIP);
+}
+
+void chip8_env_destroy(Chip8Env *env) {
+  if (env == NULL) {
+    return;
+  }
+  if (env->threads != NULL) {
+    pthread_mutex_lock(&env->lock);
+    env->quit = 1;
+    pthread_cond_broadcast(&env->wake);
+    pthread_mutex_unlock(&env->lock);
+    for (u32 t = 1; t < env->thread_count; t++) {
+      pthread_join(env->threads[t], NULL);
+    }
+    pthread_mutex_destroy(&env->lock);
+    pthread_cond_destroy(&env->wake);
+    pthread_cond_destroy(&env->finished);
+    free(env->threads);
+  }
+  for (u32 i = 0; i < env->count; i++) {
+    free_decode_cache(&env->instances[i].chip8);
+  }
+  free(env->instances);
+  free(env);
+}
+
+u32 chip8_env_count(const Chip8Env *env) {
+  return env->count;
+}
+
+u32 chip8_env_obs_size(const Chip8Env *env) {
+  return env->obs == CHIP8_OBS_PACKED ? SCREEN_HEIGHT * sizeof(uint64_t) : SCREEN_WIDTH * SCREEN_HEIGHT;
+}
+
+void chip8_env_set_obs(Chip8Env *env, Chip8EnvObs obs) {
+  env->obs = obs;
+}
+
+void chip8_env_set_reward(Chip8Env *env, Chip8Reader reader, float scale) {
+  env->reward = reader;
+  env->reward_scale = scale;
+  for (u32 i = 0; i < env->count; i++) {
+    env->instances[i].score = chip8_read(&reader, &env->instances[i].chip8);
+  }
+}
+
+void chip8_env_set_done(Chip8Env *env, Chip8Reader reader, double done_value) {
+  env->done = reader;
+  env->done_value = done_value;
+}
+
+void chip8_env_set_max_frames(Chip8Env *env, uint64_t frames) {
+  env->max_frames = frames;
+}
+
+void chip8_env_set_quirks(Chip8Env *env, Chip8Quirks quirks) {
+  env->quirks = quirks;
+}
+
+void chip8_env_set_ips(Chip8Env *env, u32 ips) {
+  env->ips = ips > 0 ? ips : SCHED_DEFAULT_IPS;
+}
+
+void chip8_env_reset(Chip8Env *env, void *obs_out) {
+  for (u32 i = 0; i < env->count; i++) {
+    env->instances[i].episode = 0;
+  }
+  run_task(env, ENV_RESET, NULL, obs_out, NULL, NULL);
+}
+
+void chip8_env_step(Chip8Env *env, const u16 *actions, void *obs_out, float *reward_out, u8 *done_out) {
+  run_task(env, ENV_STEP, actions, obs_out, reward_out, done_out);
+}
+
+const Chip8 *chip8_env_machine(const Chip8Env *env, u32 i) {
+  return &env->instances[i].chip8;
+}
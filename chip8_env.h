@@ -0,0 +1,84 @@
+#ifndef CHIP8_ENV_H
+#define CHIP8_ENV_H
+
+#include "chip8.h"
+
+/*********************************
+    Vector environment
+
+    N instances of a ROM stepped together for reinforcement learning. A
+    step holds the keys of every instance's action for `frameskip` 60Hz
+    frames, then writes the observations, rewards and done flags straight
+    into buffers the caller owns, one contiguous block per output with
+    instance i at index i. The instances are split over a pool of threads
+    started by chip8_env_create; a step allocates nothing and copies
+    nothing besides the observations themselves.
+
+    An action is the keypad as a bit mask (bit k holds key k), so it goes
+    through set_keypad like the headless tools' input scripts, there is no
+    window and no polling involved.
+
+    Rewards and episode ends come from readers that pick a value out of the
+    machine, e.g. the score digits a game keeps in memory for op_Fx33 to
+    draw. The reward of a step is how much the reward reader's value went
+    up, an episode ends once the done reader's value reaches done_value or
+    after max_frames. Instances that are done are reset on the spot, their
+    observation is already the first one of the next episode.
+ *********************************/
+
+typedef enum Chip8EnvObs {
+  CHIP8_OBS_PACKED, // the SCREEN_HEIGHT uint64_t rows of Chip8.video
+  CHIP8_OBS_PIXELS, // SCREEN_WIDTH x SCREEN_HEIGHT u8, 255 lit and 0 dark
+} Chip8EnvObs;
+
+typedef enum Chip8ReaderKind {
+  CHIP8_READ_NONE,     // always 0
+  CHIP8_READ_BYTE,     // memory[address]
+  CHIP8_READ_BCD,      // three decimal digits at address, as Fx33 writes them
+  CHIP8_READ_REGISTER, // V[address]
+  CHIP8_READ_CUSTOM,   // read(chip8, data)
+} Chip8ReaderKind;
+
+typedef struct Chip8Reader {
+  u8 kind; // Chip8ReaderKind
+  u16 address;
+  double (*read)(const Chip8 *chip8, void *data);
+  void *data;
+} Chip8Reader;
+
+double chip8_read(const Chip8Reader *reader, const Chip8 *chip8);
+
+typedef struct Chip8Env Chip8Env;
+
+// loads the ROM once, sets up n_envs instances and one thread per core, at
+// most one per instance. NULL on errors
+Chip8Env *chip8_env_create(const char *rom, u32 n_envs, u32 frameskip);
+// the same for a ROM already in memory, e.g. one embedded in the host
+// program. It gets the quirk profile of a .ch8 file
+Chip8Env *chip8_env_create_image(const u8 *image, u32 size, u32 n_envs, u32 frameskip);
+void chip8_env_destroy(Chip8Env *env);
+u32 chip8_env_count(const Chip8Env *env);
+
+// bytes of one instance's observation
+u32 chip8_env_obs_size(const Chip8Env *env);
+void chip8_env_set_obs(Chip8Env *env, Chip8EnvObs obs);
+void chip8_env_set_reward(Chip8Env *env, Chip8Reader reader, float scale);
+void chip8_env_set_done(Chip8Env *env, Chip8Reader reader, double done_value);
+// 0: episodes only end through the done reader
+void chip8_env_set_max_frames(Chip8Env *env, uint64_t frames);
+// from the next reset on, by default the quirk profile load_rom would pick
+// and SCHED_DEFAULT_IPS
+void chip8_env_set_quirks(Chip8Env *env, Chip8Quirks quirks);
+void chip8_env_set_ips(Chip8Env *env, u32 ips);
+
+// restarts every instance from its first episode, obs_out may be NULL.
+// Episode e of instance i is seeded with 1 + i + e * n_envs
+void chip8_env_reset(Chip8Env *env, void *obs_out);
+// actions[i] is the key mask of instance i. obs_out holds
+// chip8_env_obs_size bytes per instance, reward_out and done_out one entry
+// each, any of them may be NULL
+void chip8_env_step(Chip8Env *env, const u16 *actions, void *obs_out, float *reward_out, u8 *done_out);
+// the machine of instance i, valid until the next step or reset
+const Chip8 *chip8_env_machine(const Chip8Env *env, u32 i);
+
+#endif
@@ -0,0 +1,281 @@
+#include "chip8_fork.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FORK_CHUNK 256 // pages or forks allocated at once
+// memory_dirty blocks per page
+#define FORK_PAGE_BLOCKS (FORK_PAGE_SIZE >> MEMORY_BLOCK_SHIFT)
+#define FORK_PAGE_MASK ((1ull << FORK_PAGE_BLOCKS) - 1)
+
+// both start with a pointer sized field, the slab's free list link while
+// they are not in use
+typedef struct ForkPage {
+  size_t refs;
+  u8 bytes[FORK_PAGE_SIZE];
+} ForkPage;
+
+struct Chip8Fork {
+  ForkPage *pages[FORK_PAGES];
+  u8 V[16];
+  u16 I;
+  u16 pc;
+  u16 stack[16];
+  u8 sp;
+  u8 delay_timer;
+  u8 sound_timer;
+  u8 quirks;
+  u8 keypad[KEYPAD_MAX];
+  uint64_t random_state;
+  uint64_t video[SCREEN_HEIGHT];
+};
+
+// pages and forks are carved out of chunks and recycled through a free
+// list, a search makes and drops them by the million
+typedef struct ForkSlab {
+  void *free;
+  size_t size; // of an object
+  void **chunks;
+  u32 chunk_count;
+} ForkSlab;
+
+struct Chip8Tree {
+  Chip8 machine;
+  ForkPage *held[FORK_PAGES]; // what the machine's memory holds, a reference each
+  ForkSlab pages;
+  ForkSlab forks;
+  ForkStats stats;
+};
+
+/*********************************
+    slabs
+ *********************************/
+
+static int slab_grow(ForkSlab *slab) {
+  void **chunks = realloc(slab->chunks, (slab->chunk_count + 1) * sizeof(void *));
+  if (chunks == NULL) {
+    return -1;
+  }
+  slab->chunks = chunks;
+  u8 *chunk = malloc(FORK_CHUNK * slab->size);
+  if (chunk == NULL) {
+    return -1;
+  }
+  slab->chunks[slab->chunk_count++] = chunk;
+  for (u32 i = 0; i < FORK_CHUNK; i++) {
+    void *object = chunk + i * slab->size;
+    *(void **)object = slab->free;
+    slab->free = object;
+  }
+  return 0;
+}
+
+static void *slab_alloc(ForkSlab *slab) {
+  if (slab->free == NULL && slab_grow(slab) != 0) {
+    printf("Error allocating forks\n");
+    return NULL;
+  }
+  void *object = slab->free;
+  slab->free = *(void **)object;
+  return object;
+}
+
+static void slab_free(ForkSlab *slab, void *object) {
+  *(void **)object = slab->free;
+  slab->free = object;
+}
+
+static void slab_destroy(ForkSlab *slab) {
+  for (u32 i = 0; i < slab->chunk_count; i++) {
+    free(slab->chunks[i]);
+  }
+  free(slab->chunks);
+}
+
+/*********************************
+    pages
+ *********************************/
+
+static ForkPage *page_retain(ForkPage *page) {
+  page->refs++;
+  return page;
+}
+
+static void page_release(Chip8Tree *tree, ForkPage *page) {
+  if (page == NULL || --page->refs > 0) {
+    return;
+  }
+  slab_free(&tree->pages, page);
+  tree->stats.live_pages--;
+  tree->stats.live_bytes -= sizeof(ForkPage);
+}
+
+// the machine's memory of page p as a new page, held by the machine
+static int copy_page(Chip8Tree *tree, u32 p) {
+  ForkPage *page = slab_alloc(&tree->pages);
+  if (page == NULL) {
+    return -1;
+  }
+  page->refs = 1;
+  memcpy(page->bytes, tree->machine.memory + p * FORK_PAGE_SIZE, FORK_PAGE_SIZE);
+  page_release(tree, tree->held[p]);
+  tree->held[p] = page;
+  tree->stats.live_pages++;
+  tree->stats.live_bytes += sizeof(ForkPage);
+  tree->stats.pages_copied++;
+  return 0;
+}
+
+static u32 dirty_pages(uint64_t blocks) {
+  u32 pages = 0;
+  for (u32 p = 0; p < FORK_PAGES; p++) {
+    pages |= (u32)(((blocks >> (p * FORK_PAGE_BLOCKS)) & FORK_PAGE_MASK) != 0) << p;
+  }
+  return pages;
+}
+
+/*********************************
+    API
+ *********************************/
+
+Chip8Tree *chip8_tree_create(void) {
+  Chip8Tree *tree = calloc(1, sizeof(Chip8Tree));
+  if (tree == NULL) {
+    printf("Error allocating a fork tree\n");
+    return NULL;
+  }
+  init_chip8(&tree->machine);
+  tree->pages.size = sizeof(ForkPage);
+  tree->forks.size = sizeof(Chip8Fork);
+  return tree;
+}
+
+void chip8_tree_destroy(Chip8Tree *tree) {
+  if (tree == NULL) {
+    return;
+  }
+  free_decode_cache(&tree->machine);
+  slab_destroy(&tree->pages);
+  slab_destroy(&tree->forks);
+  free(tree);
+}
+
+Chip8 *chip8_tree_machine(Chip8Tree *tree) {
+  return &tree->machine;
+}
+
+const ForkStats *chip8_tree_stats(const Chip8Tree *tree) {
+  return &tree->stats;
+}
+
+Chip8Fork *chip8_fork_save(Chip8Tree *tree) {
+  Chip8 *chip8 = &tree->machine;
+  Chip8Fork *fork = slab_alloc(&tree->forks);
+  if (fork == NULL) {
+    return NULL;
+  }
+  // pages written since the machine got them, or never saved at all
+  uint64_t blocks = chip8->memory_dirty;
+  u32 dirty = dirty_pages(blocks);
+  chip8->memory_dirty = 0;
+  for (u32 p = 0; p < FORK_PAGES; p++) {
+    if (((dirty & (1u << p)) || tree->held[p] == NULL) && copy_page(tree, p) != 0) {
+      // the pages copied so far stay with the machine, the rest stay dirty
+      chip8->memory_dirty = blocks & (~0ull << (p * FORK_PAGE_BLOCKS));
+      while (p-- > 0) {
+        page_release(tree, fork->pages[p]);
+      }
+      slab_free(&tree->forks, fork);
+      return NULL;
+    }
+    fork->pages[p] = page_retain(tree->held[p]);
+  }
+
+  memcpy(fork->V, chip8->V, sizeof(fork->V));
+  fork->I = chip8->I;
+  fork->pc = chip8->pc;
+  memcpy(fork->stack, chip8->stack, sizeof(fork->stack));
+  fork->sp = chip8->sp;
+  fork->delay_timer = chip8->delay_timer;
+  fork->sound_timer = chip8->sound_timer;
+  fork->quirks = chip8->quirks;
+  memcpy(fork->keypad, chip8->keypad, sizeof(fork->keypad));
+  fork->random_state = chip8->random_state;
+  memcpy(fork->video, chip8->video, sizeof(fork->video));
+
+  tree->stats.saves++;
+  tree->stats.live_forks++;
+  tree->stats.live_bytes += sizeof(Chip8Fork);
+  return fork;
+}
+
+Chip8Fork *chip8_fork_clone(Chip8Tree *tree, const Chip8Fork *fork) {
+  Chip8Fork *clone = slab_alloc(&tree->forks);
+  if (clone == NULL) {
+    return NULL;
+  }
+  *clone = *fork;
+  for (u32 p = 0; p < FORK_PAGES; p++) {
+    page_retain(clone->pages[p]);
+  }
+  tree->stats.saves++;
+  tree->stats.live_forks++;
+  tree->stats.live_bytes += sizeof(Chip8Fork);
+  return clone;
+}
+
+void chip8_fork_load(Chip8Tree *tree, const Chip8Fork *fork) {
+  Chip8 *chip8 = &tree->machine;
+  // a different profile drops the decoded code and marks all memory
+  // written, the pages are then compared below
+  set_quirks(chip8, fork->quirks);
+  u32 dirty = dirty_pages(chip8->memory_dirty);
+  for (u32 p = 0; p < FORK_PAGES; p++) {
+    ForkPage *page = fork->pages[p];
+    if (page == tree->held[p] && !(dirty & (1u << p))) {
+      continue;
+    }
+    u8 *memory = chip8->memory + p * FORK_PAGE_SIZE;
+    // a page of another branch often still holds the same code, which
+    // keeps its decoded instructions then
+    if (memcmp(memory, page->bytes, FORK_PAGE_SIZE) != 0) {
+      memcpy(memory, page->bytes, FORK_PAGE_SIZE);
+      invalidate_code(chip8, p * FORK_PAGE_SIZE, FORK_PAGE_SIZE);
+    }
+    page_release(tree, tree->held[p]);
+    tree->held[p] = page_retain(page);
+    tree->stats.pages_loaded++;
+  }
+  // the memory is the fork's pages now, nothing written since
+  chip8->memory_dirty = 0;
+
+  u32 rows = 0;
+  for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
+    rows |= (u32)(chip8->video[y] != fork->video[y]) << y;
+  }
+  memcpy(chip8->video, fork->video, sizeof(chip8->video));
+  chip8->video_dirty |= rows;
+
+  memcpy(chip8->V, fork->V, sizeof(chip8->V));
+  chip8->I = fork->I;
+  chip8->pc = fork->pc;
+  memcpy(chip8->stack, fork->stack, sizeof(chip8->stack));
+  chip8->sp = fork->sp;
+  chip8->delay_timer = fork->delay_timer;
+  chip8->sound_timer = fork->sound_timer;
+  memcpy(chip8->keypad, fork->keypad, sizeof(chip8->keypad));
+  chip8->random_state = fork->random_state;
+  tree->stats.loads++;
+}
+
+void chip8_fork_release(Chip8Tree *tree, Chip8Fork *fork) {
+  if (fork == NULL) {
+    return;
+  }
+  for (u32 p = 0; p < FORK_PAGES; p++) {
+    page_release(tree, fork->pages[p]);
+  }
+  slab_free(&tree->forks, fork);
+  tree->stats.live_forks--;
+  tree->stats.live_bytes -= sizeof(Chip8Fork);
+}
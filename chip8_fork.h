@@ -0,0 +1,72 @@
+#ifndef CHIP8_FORK_H
+#define CHIP8_FORK_H
+
+#include "chip8.h"
+#include <stddef.h>
+
+/*********************************
+    Forkable instances
+
+    For solvers that explore input trees and clone a machine at every
+    node. A Chip8Fork is a machine frozen at one point: its registers,
+    timers, keypad, generator and screen (about 400 bytes), and the 4K of
+    memory as FORK_PAGES pages of FORK_PAGE_SIZE bytes. Pages are shared by
+    reference counted pointer between every fork that holds the same bytes
+    and only copied once a write makes them differ, so a child that only
+    changed its score costs one page next to its parent.
+
+    Forks do not run themselves. A Chip8Tree owns one ordinary Chip8, the
+    machine, that forks are loaded into and saved from:
+
+      root = chip8_fork_save(tree)            after setting up the machine
+      chip8_fork_load(tree, node)             continue from a node
+      ... set keys, run a few frames ...
+      child = chip8_fork_save(tree)
+
+    The machine remembers which pages its memory holds and which of them
+    were written since (Chip8.memory_dirty, set by Fx33 and Fx55 through
+    invalidate_code). Saving copies only the pages written, loading only
+    the pages the fork does not share with the machine, which for a parent
+    and its children are a handful. chip8_fork_clone copies no memory at
+    all.
+
+    The interpreter keeps working on flat memory, nothing about the cores
+    changes. A tree and its forks belong to one thread, a solver with more
+    threads uses a tree per thread.
+ *********************************/
+
+#define FORK_PAGE_SHIFT 8
+#define FORK_PAGE_SIZE (1u << FORK_PAGE_SHIFT)
+#define FORK_PAGES (4096 / FORK_PAGE_SIZE)
+
+typedef struct Chip8Fork Chip8Fork;
+typedef struct Chip8Tree Chip8Tree;
+
+typedef struct ForkStats {
+  uint64_t saves;        // forks made by chip8_fork_save and chip8_fork_clone
+  uint64_t loads;
+  uint64_t pages_copied; // by saves, pages written since the machine held them
+  uint64_t pages_loaded; // by loads, pages the machine did not share with the fork
+  u32 live_forks;        // not released yet
+  u32 live_pages;        // held by live forks or the machine
+  size_t live_bytes;     // of the live forks and pages
+} ForkStats;
+
+// NULL on errors
+Chip8Tree *chip8_tree_create(void);
+// releases every fork still alive
+void chip8_tree_destroy(Chip8Tree *tree);
+// the machine forks are saved from and loaded into, set it up like any
+// other (init_chip8 already ran, enable_decode_cache is worth it)
+Chip8 *chip8_tree_machine(Chip8Tree *tree);
+const ForkStats *chip8_tree_stats(const Chip8Tree *tree);
+
+// freezes the machine into a new fork, NULL if out of memory
+Chip8Fork *chip8_fork_save(Chip8Tree *tree);
+// a second fork of the same point, shares all of its memory
+Chip8Fork *chip8_fork_clone(Chip8Tree *tree, const Chip8Fork *fork);
+// puts the machine where fork is, the fork stays valid
+void chip8_fork_load(Chip8Tree *tree, const Chip8Fork *fork);
+void chip8_fork_release(Chip8Tree *tree, Chip8Fork *fork);
+
+#endif
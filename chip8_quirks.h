@@ -0,0 +1,212 @@
+/*********************************
+    Quirk specialized interpreter
+
+    Not a normal header: chip8.c includes it once per quirk profile with
+    QUIRK_PROFILE set to the profile's name (VIP, CHIP48, ...). Every
+    include expands into its own copy of the instructions that differ
+    between the CHIP-8 variants, a handler table and the run_cycles cores
+    from chip8_run.h.
+    The QUIRKS_<profile>_* flags from chip8.h are compile time constants in
+    here, so the unused branches are dropped by the preprocessor and the
+    selected interpreter pays nothing for the quirks it does not have.
+
+    All names get the profile appended, QUIRK_FN(op_8xy1) is op_8xy1_VIP.
+ *********************************/
+
+#ifndef QUIRK_PROFILE
+#error "define QUIRK_PROFILE before including chip8_quirks.h"
+#endif
+
+#define QUIRK_CAT_(a, b, c) a##b##c
+#define QUIRK_CAT(a, b, c) QUIRK_CAT_(a, b, c)
+#define QUIRK_FN(name) QUIRK_CAT(name, _, QUIRK_PROFILE)
+#define QUIRK(flag) QUIRK_CAT(QUIRKS_, QUIRK_PROFILE, flag)
+
+// 8xy1: Set Vx = Vx OR Vy
+static void QUIRK_FN(op_8xy1)(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 y = insn->y;
+  chip8->V[x] |= chip8->V[y];
+#if QUIRK(_VF_RESET)
+  chip8->V[0xF] = 0;
+#endif
+}
+
+// 8xy2: Set Vx = Vx AND Vy
+static void QUIRK_FN(op_8xy2)(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 y = insn->y;
+  chip8->V[x] &= chip8->V[y];
+#if QUIRK(_VF_RESET)
+  chip8->V[0xF] = 0;
+#endif
+}
+
+// 8xy3: Set Vx = Vx XOR Vy
+static void QUIRK_FN(op_8xy3)(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 y = insn->y;
+  chip8->V[x] ^= chip8->V[y];
+#if QUIRK(_VF_RESET)
+  chip8->V[0xF] = 0;
+#endif
+}
+
+// If the least-significant bit of Vx is 1, then VF is set to 1, otherwise 0.
+// Then Vx is divided by 2.
+// A right shift is performed (division by 2), and the least significant bit is saved in Register VF.
+// 8xy6: Set Vx = Vx SHR 1
+static void QUIRK_FN(op_8xy6)(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+
+#if QUIRK(_SHIFT_VY)
+  u8 y = insn->y;
+  chip8->V[x] = chip8->V[y];
+#endif
+  u8 lsb = chip8->V[x] & 0x0001;
+  chip8->V[x] >>= 1;
+  chip8->V[0xF] = lsb;
+}
+
+// If the most-significant bit of Vx is 1, then VF is set to 1, otherwise to 0.
+// Then Vx is multiplied by 2.
+// A left shift is performed (multiplication by 2), and the most significant bit
+// is saved in Register VF.
+// 8xyE: Set Vx = Vx SHL 1.
+static void QUIRK_FN(op_8xyE)(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+
+#if QUIRK(_SHIFT_VY)
+  u8 y = insn->y;
+  chip8->V[x] = chip8->V[y];
+#endif
+
+  // msb: 1111 0000 >> 7 = 0000 00011
+  u8 msb = (chip8->V[x] & 0xF0) >> 7;
+  chip8->V[x] <<= 1;
+  chip8->V[0xF] = msb;
+}
+
+// Bnnn: Jump to location nnn + V0
+// (BXNN on CHIP-48 and SUPER-CHIP: jump to xnn + Vx)
+static void QUIRK_FN(op_Bnnn)(Chip8 *chip8, const Chip8Insn *insn) {
+  u16 nnn = insn->nnn;
+#if QUIRK(_JUMP_VX)
+  chip8->pc = (nnn + chip8->V[insn->x]);
+#else
+  chip8->pc = (nnn + chip8->V[0]);
+#endif
+}
+
+// Every screen row is one uint64_t with the leftmost pixel in the top bit,
+// so a sprite row is just its byte shifted into place. One AND against the
+// screen row tells whether it collides with a lit pixel and one XOR draws it.
+// Dxyn: Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision
+static void QUIRK_FN(op_Dxyn)(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  u8 y = insn->y;
+  u8 n = insn->n;
+
+  u8 x_coord = chip8->V[x] % SCREEN_WIDTH;  // SCREEN_WIDTH is 64
+  u8 y_coord = chip8->V[y] % SCREEN_HEIGHT; // SCREEN_HEIGHT is 32
+  u8 collision = 0;
+
+#if QUIRK(_WRAP)
+  // the parts of the sprite past the right and bottom edge wrap around, so
+  // the byte is rotated instead of shifted
+  for (u8 row = 0; row < n; row++) {
+    uint64_t sprite_row = (uint64_t)chip8->memory[(chip8->I + row) & ADDRESS_MASK] << 56;
+    if (x_coord != 0) {
+      sprite_row = (sprite_row >> x_coord) | (sprite_row << (64 - x_coord));
+    }
+    uint64_t *screen_row = &chip8->video[(y_coord + row) % SCREEN_HEIGHT];
+#else
+  // sprites are clipped at the right and bottom edge, the bits shifted out
+  // to the right are simply gone
+  for (u8 row = 0; row < n && y_coord + row < SCREEN_HEIGHT; row++) {
+    uint64_t sprite_row = ((uint64_t)chip8->memory[(chip8->I + row) & ADDRESS_MASK] << 56) >> x_coord;
+    uint64_t *screen_row = &chip8->video[y_coord + row];
+#endif
+
+    collision |= (*screen_row & sprite_row) != 0;
+    *screen_row ^= sprite_row;
+    chip8->video_dirty |= (u32)(sprite_row != 0) << (screen_row - chip8->video);
+  }
+  chip8->V[0xF] = collision;
+}
+
+// Fx55: Store registers V0 through Vx in memory starting at location I
+static void QUIRK_FN(op_Fx55)(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  for (u8 i = 0; i <= x; ++i) {
+    chip8->memory[(chip8->I + i) & ADDRESS_MASK] = chip8->V[i];
+  }
+  invalidate_code(chip8, chip8->I, x + 1);
+#if QUIRK(_MEMORY_INCREMENT) == 1
+  chip8->I = (chip8->I + x + 1) & ADDRESS_MASK;
+#elif QUIRK(_MEMORY_INCREMENT) == 2
+  chip8->I = (chip8->I + x) & ADDRESS_MASK;
+#endif
+}
+
+// Fx65: Read registers V0 through Vx from meory starting at location I
+static void QUIRK_FN(op_Fx65)(Chip8 *chip8, const Chip8Insn *insn) {
+  u8 x = insn->x;
+  for (u8 i = 0; i <= x; ++i) {
+    chip8->V[i] = chip8->memory[(chip8->I + i) & ADDRESS_MASK];
+  }
+#if QUIRK(_MEMORY_INCREMENT) == 1
+  chip8->I = (chip8->I + x + 1) & ADDRESS_MASK;
+#elif QUIRK(_MEMORY_INCREMENT) == 2
+  chip8->I = (chip8->I + x) & ADDRESS_MASK;
+#endif
+}
+
+static const Chip8Handler QUIRK_FN(handlers)[OP_COUNT] = {
+    [OP_ILLEGAL] = op_illegal,
+    [OP_0nnn] = op_0nnn,
+    [OP_00E0] = op_00E0,
+    [OP_00EE] = op_00EE,
+    [OP_1nnn] = op_1nnn,
+    [OP_2nnn] = op_2nnn,
+    [OP_3xkk] = op_3xkk,
+    [OP_4xkk] = op_4xkk,
+    [OP_5xy0] = op_5xy0,
+    [OP_6xkk] = op_6xkk,
+    [OP_7xkk] = op_7xkk,
+    [OP_8xy0] = op_8xy0,
+    [OP_8xy1] = QUIRK_FN(op_8xy1),
+    [OP_8xy2] = QUIRK_FN(op_8xy2),
+    [OP_8xy3] = QUIRK_FN(op_8xy3),
+    [OP_8xy4] = op_8xy4,
+    [OP_8xy5] = op_8xy5,
+    [OP_8xy6] = QUIRK_FN(op_8xy6),
+    [OP_8xy7] = op_8xy7,
+    [OP_8xyE] = QUIRK_FN(op_8xyE),
+    [OP_9xy0] = op_9xy0,
+    [OP_Annn] = op_Annn,
+    [OP_Bnnn] = QUIRK_FN(op_Bnnn),
+    [OP_Cxkk] = op_Cxkk,
+    [OP_Dxyn] = QUIRK_FN(op_Dxyn),
+    [OP_Ex9E] = op_Ex9E,
+    [OP_ExA1] = op_ExA1,
+    [OP_Fx07] = op_Fx07,
+    [OP_Fx0A] = op_Fx0A,
+    [OP_Fx15] = op_Fx15,
+    [OP_Fx18] = op_Fx18,
+    [OP_Fx1E] = op_Fx1E,
+    [OP_Fx29] = op_Fx29,
+    [OP_Fx33] = op_Fx33,
+    [OP_Fx55] = QUIRK_FN(op_Fx55),
+    [OP_Fx65] = QUIRK_FN(op_Fx65),
+};
+
+// see run_cycles in chip8.c, the core itself is in chip8_run.h
+#define RUN_FN QUIRK_FN(run_cycles)
+#include "chip8_run.h"
+
+#undef QUIRK_CAT_
+#undef QUIRK_CAT
+#undef QUIRK_FN
+#undef QUIRK
+#undef QUIRK_PROFILE
@@ -0,0 +1,338 @@
+/*********************************
+    run_cycles core
+
+    Not a normal header either: chip8_quirks.h includes it once per quirk
+    profile, with RUN_FN set to the name of the function to define.
+ *********************************/
+
+#ifndef RUN_FN
+#error "define RUN_FN before including chip8_run.h"
+#endif
+
+static void RUN_FN(Chip8 *chip8, u32 n) {
+  u8 *V = chip8->V;
+  u8 *memory = chip8->memory;
+  u16 pc = chip8->pc;
+  u16 I = chip8->I;
+  u16 opcode = chip8->opcode;
+  Chip8Insn insn;
+
+#define X ((opcode & 0x0F00) >> 8)
+#define Y ((opcode & 0x00F0) >> 4)
+#define KK (opcode & 0x00FF)
+#define NNN (opcode & 0x0FFF)
+
+// hands the instruction to its op_* handler with the real state in place
+#define CALL_HANDLER(handler)    \
+  chip8->pc = pc;                \
+  chip8->I = I;                  \
+  chip8->opcode = opcode;        \
+  decode_operands(&insn, opcode); \
+  handler(chip8, &insn);         \
+  pc = chip8->pc;                \
+  I = chip8->I;
+
+#define SET_FLAG(op, a, b) V[0xF] = flag_value((op), (a), (b));
+
+#define FETCH()                                 \
+  if (n == 0) {                                 \
+    goto done;                                  \
+  }                                             \
+  n--;                                          \
+  opcode = (memory[pc & ADDRESS_MASK] << 8) | memory[(pc + 1) & ADDRESS_MASK]; \
+  pc += 2;
+
+#if CHIP8_COMPUTED_GOTO
+  static void *const labels[OP_COUNT] = {
+      [OP_ILLEGAL] = &&L_OP_ILLEGAL,
+      [OP_0nnn] = &&L_OP_0nnn,
+      [OP_00E0] = &&L_OP_00E0,
+      [OP_00EE] = &&L_OP_00EE,
+      [OP_1nnn] = &&L_OP_1nnn,
+      [OP_2nnn] = &&L_OP_2nnn,
+      [OP_3xkk] = &&L_OP_3xkk,
+      [OP_4xkk] = &&L_OP_4xkk,
+      [OP_5xy0] = &&L_OP_5xy0,
+      [OP_6xkk] = &&L_OP_6xkk,
+      [OP_7xkk] = &&L_OP_7xkk,
+      [OP_8xy0] = &&L_OP_8xy0,
+      [OP_8xy1] = &&L_OP_8xy1,
+      [OP_8xy2] = &&L_OP_8xy2,
+      [OP_8xy3] = &&L_OP_8xy3,
+      [OP_8xy4] = &&L_OP_8xy4,
+      [OP_8xy5] = &&L_OP_8xy5,
+      [OP_8xy6] = &&L_OP_8xy6,
+      [OP_8xy7] = &&L_OP_8xy7,
+      [OP_8xyE] = &&L_OP_8xyE,
+      [OP_9xy0] = &&L_OP_9xy0,
+      [OP_Annn] = &&L_OP_Annn,
+      [OP_Bnnn] = &&L_OP_Bnnn,
+      [OP_Cxkk] = &&L_OP_Cxkk,
+      [OP_Dxyn] = &&L_OP_Dxyn,
+      [OP_Ex9E] = &&L_OP_Ex9E,
+      [OP_ExA1] = &&L_OP_ExA1,
+      [OP_Fx07] = &&L_OP_Fx07,
+      [OP_Fx0A] = &&L_OP_Fx0A,
+      [OP_Fx15] = &&L_OP_Fx15,
+      [OP_Fx18] = &&L_OP_Fx18,
+      [OP_Fx1E] = &&L_OP_Fx1E,
+      [OP_Fx29] = &&L_OP_Fx29,
+      [OP_Fx33] = &&L_OP_Fx33,
+      [OP_Fx55] = &&L_OP_Fx55,
+      [OP_Fx65] = &&L_OP_Fx65,
+  };
+#define CASE(op) L_##op:
+#define NEXT()  \
+  FETCH();      \
+  goto *labels[dispatch_table[opcode]];
+
+  NEXT();
+  {
+#else
+#define CASE(op) case op:
+#define NEXT() continue;
+
+  for (;;) {
+    FETCH();
+    switch (dispatch_table[opcode]) {
+#endif
+
+    CASE(OP_ILLEGAL) {
+      CALL_HANDLER(op_illegal);
+      NEXT();
+    }
+    CASE(OP_0nnn) {
+      NEXT();
+    }
+    CASE(OP_00E0) {
+      clear_video(chip8);
+      NEXT();
+    }
+    CASE(OP_00EE) {
+      chip8->sp--;
+      pc = chip8->stack[chip8->sp & STACK_MASK];
+      NEXT();
+    }
+    CASE(OP_1nnn) {
+      u16 back = pc - NNN;
+      pc = NNN;
+      // a jump 1 to 3 instructions back may close an idle loop
+      if (back == 2 || back == 4 || back == 6) {
+        chip8->pc = pc;
+        n -= skip_idle_loop(chip8, n);
+      }
+      NEXT();
+    }
+    CASE(OP_2nnn) {
+      chip8->stack[chip8->sp & STACK_MASK] = pc;
+      chip8->sp++;
+      pc = NNN;
+      NEXT();
+    }
+    CASE(OP_3xkk) {
+      if (V[X] == KK) {
+        pc += 2;
+      }
+      NEXT();
+    }
+    CASE(OP_4xkk) {
+      if (V[X] != KK) {
+        pc += 2;
+      }
+      NEXT();
+    }
+    CASE(OP_5xy0) {
+      if (V[X] == V[Y]) {
+        pc += 2;
+      }
+      NEXT();
+    }
+    CASE(OP_6xkk) {
+      V[X] = KK;
+      NEXT();
+    }
+    CASE(OP_7xkk) {
+      V[X] += KK;
+      NEXT();
+    }
+    CASE(OP_8xy0) {
+      V[X] = V[Y];
+      NEXT();
+    }
+    CASE(OP_8xy1) {
+      V[X] |= V[Y];
+#if QUIRK(_VF_RESET)
+      SET_FLAG(OP_8xy6, 0, 0);
+#endif
+      NEXT();
+    }
+    CASE(OP_8xy2) {
+      V[X] &= V[Y];
+#if QUIRK(_VF_RESET)
+      SET_FLAG(OP_8xy6, 0, 0);
+#endif
+      NEXT();
+    }
+    CASE(OP_8xy3) {
+      V[X] ^= V[Y];
+#if QUIRK(_VF_RESET)
+      SET_FLAG(OP_8xy6, 0, 0);
+#endif
+      NEXT();
+    }
+    CASE(OP_8xy4) {
+      u8 vx = V[X];
+      u8 vy = V[Y];
+      V[X] = vx + vy;
+      SET_FLAG(OP_8xy4, vx, vy);
+      NEXT();
+    }
+    CASE(OP_8xy5) {
+      u8 temp = V[X];
+      V[X] -= V[Y];
+      SET_FLAG(OP_8xy5, temp, V[Y]);
+      NEXT();
+    }
+    CASE(OP_8xy6) {
+#if QUIRK(_SHIFT_VY)
+      V[X] = V[Y];
+#endif
+      u8 lsb = V[X] & 0x01;
+      V[X] >>= 1;
+      SET_FLAG(OP_8xy6, lsb, 0);
+      NEXT();
+    }
+    CASE(OP_8xy7) {
+      u8 temp = V[X];
+      V[X] = V[Y] - V[X];
+      SET_FLAG(OP_8xy7, temp, V[Y]);
+      NEXT();
+    }
+    CASE(OP_8xyE) {
+#if QUIRK(_SHIFT_VY)
+      V[X] = V[Y];
+#endif
+      u8 msb = V[X] >> 7;
+      V[X] <<= 1;
+      SET_FLAG(OP_8xyE, msb, 0);
+      NEXT();
+    }
+    CASE(OP_9xy0) {
+      if (V[X] != V[Y]) {
+        pc += 2;
+      }
+      NEXT();
+    }
+    CASE(OP_Annn) {
+      I = NNN;
+      NEXT();
+    }
+    CASE(OP_Bnnn) {
+#if QUIRK(_JUMP_VX)
+      pc = NNN + V[X];
+#else
+      pc = NNN + V[0];
+#endif
+      NEXT();
+    }
+    CASE(OP_Cxkk) {
+      V[X] = random_byte(chip8) & KK;
+      NEXT();
+    }
+    CASE(OP_Dxyn) {
+      CALL_HANDLER(QUIRK_FN(op_Dxyn));
+      NEXT();
+    }
+    CASE(OP_Ex9E) {
+      if (key_down(chip8, V[X])) {
+        pc += 2;
+      }
+      NEXT();
+    }
+    CASE(OP_ExA1) {
+      if (!key_down(chip8, V[X])) {
+        pc += 2;
+      }
+      NEXT();
+    }
+    CASE(OP_Fx07) {
+      V[X] = chip8->delay_timer;
+      NEXT();
+    }
+    CASE(OP_Fx0A) {
+      CALL_HANDLER(op_Fx0A);
+      n -= skip_idle_loop(chip8, n);
+      NEXT();
+    }
+    CASE(OP_Fx15) {
+      chip8->delay_timer = V[X];
+      NEXT();
+    }
+    CASE(OP_Fx18) {
+      chip8->sound_timer = V[X];
+      NEXT();
+    }
+    CASE(OP_Fx1E) {
+      I = (I + V[X]) & ADDRESS_MASK;
+      NEXT();
+    }
+    CASE(OP_Fx29) {
+      I = FONTSET_START_ADDRESS + (V[X] * 5);
+      NEXT();
+    }
+    CASE(OP_Fx33) {
+      u8 digit = V[X];
+      memory[I & ADDRESS_MASK] = digit / 100;
+      memory[(I + 1) & ADDRESS_MASK] = (digit / 10) % 10;
+      memory[(I + 2) & ADDRESS_MASK] = digit % 10;
+      invalidate_code(chip8, I, 3);
+      NEXT();
+    }
+    CASE(OP_Fx55) {
+      u8 x = X;
+      for (u8 i = 0; i <= x; ++i) {
+        memory[(I + i) & ADDRESS_MASK] = V[i];
+      }
+      invalidate_code(chip8, I, x + 1);
+#if QUIRK(_MEMORY_INCREMENT) == 1
+      I = (I + x + 1) & ADDRESS_MASK;
+#elif QUIRK(_MEMORY_INCREMENT) == 2
+      I = (I + x) & ADDRESS_MASK;
+#endif
+      NEXT();
+    }
+    CASE(OP_Fx65) {
+      u8 x = X;
+      for (u8 i = 0; i <= x; ++i) {
+        V[i] = memory[(I + i) & ADDRESS_MASK];
+      }
+#if QUIRK(_MEMORY_INCREMENT) == 1
+      I = (I + x + 1) & ADDRESS_MASK;
+#elif QUIRK(_MEMORY_INCREMENT) == 2
+      I = (I + x) & ADDRESS_MASK;
+#endif
+      NEXT();
+    }
+#if !CHIP8_COMPUTED_GOTO
+    }
+#endif
+  }
+
+done:
+  chip8->pc = pc;
+  chip8->I = I;
+  chip8->opcode = opcode;
+
+#undef X
+#undef Y
+#undef KK
+#undef NNN
+#undef CALL_HANDLER
+#undef SET_FLAG
+#undef FETCH
+#undef CASE
+#undef NEXT
+}
+
+#undef RUN_FN
+
@@ -0,0 +1,268 @@
+#define _POSIX_C_SOURCE 200112L
+#include "emu_thread.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define EMU_FRAME_INDEX 3u
+#define EMU_FRAME_FRESH 4u
+#define EMU_SPIN_SECONDS 0.0005 // the end of every wait is spun, sleeping is not that precise
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// sleeps most of the way to deadline and spins for the rest
+static void wait_until(double deadline) {
+  double sleep_until = deadline - EMU_SPIN_SECONDS;
+  if (now_seconds() < sleep_until) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)sleep_until;
+    ts.tv_nsec = (long)((sleep_until - ts.tv_sec) * 1e9);
+    // it returns the error instead of setting errno. Only a signal is worth
+    // another sleep, anything else would fail again, the spin covers it
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+  }
+  while (now_seconds() < deadline) {
+  }
+}
+
+void emu_jitter_add(EmuJitter *jitter, double late) {
+  jitter->samples++;
+  jitter->total += late;
+  if (late > jitter->max) {
+    jitter->max = late;
+  }
+}
+
+double emu_jitter_mean_ms(const EmuJitter *jitter) {
+  return jitter->samples > 0 ? jitter->total / jitter->samples * 1000 : 0;
+}
+
+double emu_jitter_max_ms(const EmuJitter *jitter) {
+  return jitter->max * 1000;
+}
+
+/*********************************
+    Triple buffer
+ *********************************/
+
+static void buffer_init(EmuTripleBuffer *buffer) {
+  memset(buffer, 0, sizeof(*buffer));
+  buffer->back = 0;
+  buffer->middle = 1;
+  buffer->front = 2;
+}
+
+static EmuFrame *buffer_back(EmuTripleBuffer *buffer) {
+  return &buffer->frames[buffer->back];
+}
+
+// hands the back frame to the consumer and takes the middle one in return
+static void buffer_publish(EmuTripleBuffer *buffer) {
+  u32 previous = __atomic_exchange_n(&buffer->middle, buffer->back | EMU_FRAME_FRESH, __ATOMIC_ACQ_REL);
+  buffer->back = previous & EMU_FRAME_INDEX;
+}
+
+static const EmuFrame *buffer_take(EmuTripleBuffer *buffer) {
+  // only the consumer clears the fresh bit, so it cannot go away in between
+  if (!(__atomic_load_n(&buffer->middle, __ATOMIC_ACQUIRE) & EMU_FRAME_FRESH)) {
+    return NULL;
+  }
+  u32 previous = __atomic_exchange_n(&buffer->middle, buffer->front, __ATOMIC_ACQ_REL);
+  buffer->front = previous & EMU_FRAME_INDEX;
+  return &buffer->frames[buffer->front];
+}
+
+/*********************************
+    Emulation loop
+ *********************************/
+
+static void apply_keys(Emu *emu) {
+  set_keypad(emu->chip8, __atomic_load_n(&emu->keys, __ATOMIC_RELAXED));
+}
+
+// serves a save or load posted from the other thread, the release store
+// hands the state back to it
+static void serve_request(Emu *emu) {
+  u32 request = __atomic_load_n(&emu->request, __ATOMIC_ACQUIRE);
+  if (request == EMU_REQUEST_NONE) {
+    return;
+  }
+  int result = 0;
+  if (request == EMU_REQUEST_SAVE) {
+    savestate_snapshot(emu->chip8, emu->state);
+  } else {
+    result = savestate_restore(emu->chip8, emu->state);
+  }
+  emu->request_result = result;
+  __atomic_store_n(&emu->request, EMU_REQUEST_NONE, __ATOMIC_RELEASE);
+}
+
+static void capture(Emu *emu) {
+  if (emu->rewind != NULL) {
+    rewind_capture(emu->rewind, emu->chip8);
+  }
+}
+
+static void publish_frame(Emu *emu, const Chip8Sched *sched, const EmuJitter *jitter, int turbo, int rewinding) {
+  EmuFrame *frame = buffer_back(&emu->buffer);
+  memcpy(frame->video, emu->chip8->video, sizeof(frame->video));
+  frame->time = now_seconds();
+  frame->turbo = turbo;
+  frame->rewinding = rewinding;
+  if (emu->rewind != NULL) {
+    frame->rewind = *rewind_stats(emu->rewind);
+  }
+  frame->tick = sched->ticks;
+  frame->instructions = sched->instructions;
+  frame->stalls = sched->stalls;
+  frame->dropped = sched->dropped;
+  frame->jitter = *jitter;
+  buffer_publish(&emu->buffer);
+}
+
+static void *emu_main(void *data) {
+  Emu *emu = data;
+  EmuJitter jitter = {0};
+  Chip8Sched sched;
+#ifdef CHIP8_THREADED
+  // build with ./build.sh -DCHIP8_THREADED
+  sched_init(&sched, run_cycles, emu->ips, now_seconds());
+#else
+  sched_init(&sched, run_fused, emu->ips, now_seconds());
+#endif
+  publish_frame(emu, &sched, &jitter, 0, 0);
+  int turbo = 0;
+  int rewinding = 0;
+  double next_publish = 0;
+  double next_step = 0;
+
+  while (__atomic_load_n(&emu->running, __ATOMIC_RELAXED)) {
+    if (emu->rewind != NULL && __atomic_load_n(&emu->rewinding, __ATOMIC_RELAXED)) {
+      // one captured frame back per tick, at the normal frame rate even
+      // if the frames were captured in turbo mode
+      if (!rewinding) {
+        rewinding = 1;
+        next_step = now_seconds();
+      }
+      wait_until(next_step);
+      next_step += 1.0 / SCHED_TICK_RATE;
+      serve_request(emu);
+      rewind_step(emu->rewind, emu->chip8);
+      publish_frame(emu, &sched, &jitter, 0, rewinding);
+      continue;
+    }
+    if (rewinding) {
+      rewinding = 0;
+      sched_resync(&sched, now_seconds());
+    }
+
+    if (__atomic_load_n(&emu->turbo, __ATOMIC_RELAXED)) {
+      turbo = 1;
+      serve_request(emu);
+      apply_keys(emu);
+      sched_advance(&sched, emu->chip8, EMU_TURBO_BATCH);
+      double now = now_seconds();
+      if (now >= next_publish) {
+        capture(emu);
+        publish_frame(emu, &sched, &jitter, turbo, 0);
+        next_publish = now + 1.0 / SCHED_TICK_RATE;
+      }
+      continue;
+    }
+    if (turbo) {
+      turbo = 0;
+      sched_resync(&sched, now_seconds());
+    }
+
+    double deadline = sched_next_tick(&sched);
+    wait_until(deadline);
+    double now = now_seconds();
+    emu_jitter_add(&jitter, now - deadline);
+
+    serve_request(emu);
+    apply_keys(emu);
+    sched_run_until(&sched, emu->chip8, now);
+    capture(emu);
+    publish_frame(emu, &sched, &jitter, turbo, 0);
+  }
+  return NULL;
+}
+
+int emu_start(Emu *emu, Chip8 *chip8, u32 ips) {
+  memset(emu, 0, sizeof(*emu));
+  emu->chip8 = chip8;
+  emu->ips = ips;
+  buffer_init(&emu->buffer);
+  // emulation goes on without rewinding if there is no memory for it
+  emu->rewind = rewind_create(EMU_REWIND_BYTES, EMU_REWIND_FRAMES, EMU_REWIND_KEYFRAME);
+  emu->running = 1;
+  if (pthread_create(&emu->thread, NULL, emu_main, emu) != 0) {
+    printf("Error starting the emulation thread\n");
+    rewind_destroy(emu->rewind);
+    return -1;
+  }
+  return 0;
+}
+
+void emu_stop(Emu *emu) {
+  __atomic_store_n(&emu->running, 0, __ATOMIC_RELAXED);
+  pthread_join(emu->thread, NULL);
+  rewind_destroy(emu->rewind);
+  emu->rewind = NULL;
+}
+
+void emu_set_keys(Emu *emu, u16 keys) {
+  __atomic_store_n(&emu->keys, keys, __ATOMIC_RELAXED);
+}
+
+void emu_set_turbo(Emu *emu, int on) {
+  __atomic_store_n(&emu->turbo, on, __ATOMIC_RELAXED);
+}
+
+void emu_set_rewind(Emu *emu, int on) {
+  __atomic_store_n(&emu->rewinding, on, __ATOMIC_RELAXED);
+}
+
+static int post_request(Emu *emu, EmuRequest request, Chip8State *state) {
+  if (emu_busy(emu)) {
+    return -1;
+  }
+  emu->state = state;
+  __atomic_store_n(&emu->request, request, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int emu_save(Emu *emu, Chip8State *state) {
+  return post_request(emu, EMU_REQUEST_SAVE, state);
+}
+
+int emu_load(Emu *emu, const Chip8State *state) {
+  // only read while loading
+  return post_request(emu, EMU_REQUEST_LOAD, (Chip8State *)state);
+}
+
+int emu_busy(Emu *emu) {
+  return __atomic_load_n(&emu->request, __ATOMIC_ACQUIRE) != EMU_REQUEST_NONE;
+}
+
+int emu_request_result(Emu *emu) {
+  return emu->request_result;
+}
+
+const EmuFrame *emu_take_frame(Emu *emu) {
+  return buffer_take(&emu->buffer);
+}
+
+u32 emu_frame_diff(const EmuFrame *frame, const uint64_t *video) {
+  u32 rows = 0;
+  for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
+    rows |= (u32)(frame->video[y] != video[y]) << y;
+  }
+  return rows;
+}
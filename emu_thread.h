@@ -0,0 +1,131 @@
+#ifndef CHIP8_EMU_THREAD_H
+#define CHIP8_EMU_THREAD_H
+
+#include "chip8.h"
+#include "rewind.h"
+#include "savestate.h"
+#include "sched.h"
+#include <pthread.h>
+
+#define EMU_TURBO_BATCH 65536 // instructions between clock reads in turbo mode
+#define EMU_REWIND_BYTES (4u << 20)     // rewind history, about 5 minutes at ~100 bytes a frame
+#define EMU_REWIND_FRAMES (5 * 60 * 60) // at most 5 minutes of frames
+#define EMU_REWIND_KEYFRAME 60          // frames between keyframes
+
+/*********************************
+    Emulation thread
+
+    Runs the CPU and the timers of one Chip8 on its own thread, so a slow
+    frame or a vsync stall of the renderer never delays emulation. The
+    thread wakes up for every timer tick of its scheduler (sched.h), runs
+    the instructions due by then and publishes the screen.
+
+    The threads only share these, none of them behind a lock:
+      frames  a triple buffer, the emulator publishes a copy of the screen
+              after every timer tick and the renderer takes the newest one
+      keys    the keypad as an atomic bitmask, bit k for key k
+      turbo   set by emu_set_turbo
+      rewind  set by emu_set_rewind
+      request a save or load posted by emu_save/emu_load, served between
+              two ticks and cleared once done
+      running cleared by emu_stop
+
+    In turbo mode the thread runs instructions as fast as the host allows,
+    the timers still tick every ips / 60 instructions, and only publishes a
+    frame every 1/60s of host time. The renderer never sees more frames
+    than it can show.
+
+    Every frame the thread runs is captured into a rewind buffer (rewind.h).
+    While rewinding is on it steps back one captured frame per tick instead
+    of running, and carries on from there once it is off.
+
+    Once emu_start returns the Chip8 belongs to the emulation thread until
+    emu_stop, everything else reads frames.
+ *********************************/
+
+// how late a loop woke up compared to its deadline
+typedef struct EmuJitter {
+  uint64_t samples;
+  double total; // seconds
+  double max;   // seconds
+} EmuJitter;
+
+void emu_jitter_add(EmuJitter *jitter, double late);
+// average and worst lateness in milliseconds
+double emu_jitter_mean_ms(const EmuJitter *jitter);
+double emu_jitter_max_ms(const EmuJitter *jitter);
+
+// the renderer may skip frames, so there is no dirty row mask in here,
+// emu_frame_diff compares against the last frame it did take
+typedef struct EmuFrame {
+  uint64_t video[SCREEN_HEIGHT];
+  uint64_t tick;         // timer ticks emulated before this frame
+  uint64_t instructions; // instructions executed before this frame
+  double time;           // host seconds of the monotonic clock when published
+  int turbo;
+  int rewinding;
+  u32 stalls;            // see Chip8Sched
+  uint64_t dropped;
+  EmuJitter jitter;      // of the emulation loop up to this frame
+  RewindStats rewind;    // all zero without a rewind buffer
+} EmuFrame;
+
+// slots are owned by the producer (back), the consumer (front) or waiting
+// in between (middle). middle is only ever swapped atomically, its
+// EMU_FRAME_FRESH bit says the consumer has not taken it yet.
+typedef struct EmuTripleBuffer {
+  EmuFrame frames[3];
+  u32 back;
+  u32 middle;
+  u32 front;
+} EmuTripleBuffer;
+
+typedef enum EmuRequest {
+  EMU_REQUEST_NONE,
+  EMU_REQUEST_SAVE,
+  EMU_REQUEST_LOAD,
+} EmuRequest;
+
+typedef struct Emu {
+  Chip8 *chip8;
+  u32 ips;
+  EmuTripleBuffer buffer;
+  u32 keys;
+  int turbo;
+  int rewinding;       // set by emu_set_rewind
+  Chip8Rewind *rewind; // NULL if it could not be allocated
+  u32 request;         // EmuRequest, back to EMU_REQUEST_NONE once served
+  Chip8State *state;   // of the request
+  int request_result;  // of the last request served
+  int running;
+  pthread_t thread;
+} Emu;
+
+// starts emulating chip8 at ips instructions per second on a new thread
+// returns -1 if it could not
+int emu_start(Emu *emu, Chip8 *chip8, u32 ips);
+// stops the thread and waits for it, the Chip8 can be used again after
+void emu_stop(Emu *emu);
+// keys pressed right now, bit k for key k, picked up before the next tick
+void emu_set_keys(Emu *emu, u16 keys);
+// runs uncapped while on, back to real time from where it is when off
+void emu_set_turbo(Emu *emu, int on);
+// runs backwards through the captured frames while on
+void emu_set_rewind(Emu *emu, int on);
+// snapshots the machine into state before the next tick. Returns -1 if
+// the last request is still pending, state must stay untouched until
+// emu_busy returns 0
+int emu_save(Emu *emu, Chip8State *state);
+// restores state before the next tick, same rules as emu_save
+int emu_load(Emu *emu, const Chip8State *state);
+// 1 while a save or load is pending, afterwards emu_request_result tells
+// if it worked (0) or not (-1)
+int emu_busy(Emu *emu);
+int emu_request_result(Emu *emu);
+// newest frame published since the last call, NULL if there is none
+// the frame stays valid until the next call
+const EmuFrame *emu_take_frame(Emu *emu);
+// rows that differ between frame and video, bit y for row y
+u32 emu_frame_diff(const EmuFrame *frame, const uint64_t *video);
+
+#endif
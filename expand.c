@@ -0,0 +1,118 @@
+#include "expand.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EXPAND_X86 1
+#include <immintrin.h>
+#else
+#define EXPAND_X86 0
+#endif
+
+// copies the first line of an expanded row over the other scale - 1
+static void repeat_line(u32 *line, u32 stride, u32 scale) {
+  for (u32 i = 1; i < scale; i++) {
+    memcpy(line + i * stride, line, SCREEN_WIDTH * scale * sizeof(u32));
+  }
+}
+
+static void expand_scalar(const uint64_t *video, u32 rows, u32 *out, u32 stride, u32 scale, u32 on, u32 off) {
+  for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
+    if (!(rows & (1u << y))) {
+      continue;
+    }
+    uint64_t row = video[y];
+    u32 *first = out + y * scale * stride;
+    u32 *line = first;
+    for (u32 x = 0; x < SCREEN_WIDTH; x++) {
+      u32 color = (row >> (SCREEN_WIDTH - 1 - x)) & 1 ? on : off;
+      for (u32 i = 0; i < scale; i++) {
+        *line++ = color;
+      }
+    }
+    repeat_line(first, stride, scale);
+  }
+}
+
+#if EXPAND_X86
+
+// For scale < lanes: a group of pixels whose blocks fill whole vectors,
+// lanes / gcd(lanes, scale) of them. Writes the bit every output lane of
+// the group tests (the group's first pixel is the top bit) and returns the
+// group size.
+static u32 expand_lane_masks(u32 lanes, u32 scale, u32 *masks) {
+  u32 group = lanes;
+  while (group % 2 == 0 && (group / 2) * scale % lanes == 0) {
+    group /= 2;
+  }
+  for (u32 lane = 0; lane < group * scale; lane++) {
+    masks[lane] = 1u << (group - 1 - lane / scale);
+  }
+  return group;
+}
+
+static int sse2_supported(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+}
+
+static int avx2_supported(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+#define EXPAND_ISA sse2
+#define EXPAND_TARGET __attribute__((target("sse2")))
+#define EXPAND_LANES 4
+#define EXPAND_VEC __m128i
+#define EXPAND_SET1(v) _mm_set1_epi32((int)(v))
+#define EXPAND_AND(a, b) _mm_and_si128(a, b)
+#define EXPAND_XOR(a, b) _mm_xor_si128(a, b)
+#define EXPAND_CMPEQ(a, b) _mm_cmpeq_epi32(a, b)
+#define EXPAND_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define EXPAND_STORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#include "expand_kernel.h"
+
+#define EXPAND_ISA avx2
+#define EXPAND_TARGET __attribute__((target("avx2")))
+#define EXPAND_LANES 8
+#define EXPAND_VEC __m256i
+#define EXPAND_SET1(v) _mm256_set1_epi32((int)(v))
+#define EXPAND_AND(a, b) _mm256_and_si256(a, b)
+#define EXPAND_XOR(a, b) _mm256_xor_si256(a, b)
+#define EXPAND_CMPEQ(a, b) _mm256_cmpeq_epi32(a, b)
+#define EXPAND_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define EXPAND_STORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#include "expand_kernel.h"
+
+#endif
+
+const ExpandKernel expand_kernels[] = {
+    {"scalar", expand_scalar, NULL},
+#if EXPAND_X86
+    {"sse2", expand_sse2, sse2_supported},
+    {"avx2", expand_avx2, avx2_supported},
+#endif
+};
+const u32 expand_kernel_count = sizeof(expand_kernels) / sizeof(expand_kernels[0]);
+
+int expand_kernel_supported(const ExpandKernel *kernel) {
+  return kernel->supported == NULL || kernel->supported();
+}
+
+const ExpandKernel *expand_kernel_best(void) {
+  for (u32 i = expand_kernel_count; i-- > 1;) {
+    if (expand_kernel_supported(&expand_kernels[i])) {
+      return &expand_kernels[i];
+    }
+  }
+  return &expand_kernels[0];
+}
+
+const ExpandKernel *expand_kernel_find(const char *name) {
+  for (u32 i = 0; i < expand_kernel_count; i++) {
+    if (strcmp(expand_kernels[i].name, name) == 0) {
+      return expand_kernel_supported(&expand_kernels[i]) ? &expand_kernels[i] : NULL;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef CHIP8_EXPAND_H
+#define CHIP8_EXPAND_H
+
+#include "chip8.h"
+
+/*********************************
+    Framebuffer expansion kernels
+
+    Turn the 1 bit pixels of a screen (Chip8.video or a copy of it, one
+    uint64_t per row as described there) into one u32 color per pixel, for
+    texture uploads, frame dumps and scaled output. Every pixel becomes a
+    scale x scale block, scale 1 is the plain 64x32 image and CELL_SIZE the
+    size of the window.
+
+    There is a scalar kernel that runs everywhere and SSE2/AVX2 kernels on
+    x86 hosts built with gcc or clang. expand_kernel_best picks the fastest
+    one the CPU supports at runtime.
+ *********************************/
+
+// expands the screen rows set in `rows` (bit y for row y, e.g. from
+// video_take_dirty), row y goes to the `scale` lines starting at
+// out + y * scale * stride. stride is in pixels, at least SCREEN_WIDTH * scale.
+// on is the color of lit pixels, off of the others
+typedef void (*ExpandFunc)(const uint64_t *video, u32 rows, u32 *out, u32 stride, u32 scale, u32 on, u32 off);
+
+typedef struct ExpandKernel {
+  const char *name;
+  ExpandFunc expand;
+  int (*supported)(void); // NULL if the kernel runs everywhere
+} ExpandKernel;
+
+// slowest first, expand_kernels[0] is the scalar reference
+extern const ExpandKernel expand_kernels[];
+extern const u32 expand_kernel_count;
+
+int expand_kernel_supported(const ExpandKernel *kernel);
+// fastest kernel this CPU supports, never NULL
+const ExpandKernel *expand_kernel_best(void);
+// kernel by name if this CPU supports it, NULL otherwise
+const ExpandKernel *expand_kernel_find(const char *name);
+
+#endif
@@ -0,0 +1,88 @@
+/*********************************
+    SIMD expansion kernel
+
+    Not a normal header: expand.c includes it once per instruction set with
+    EXPAND_ISA set to its name and the EXPAND_* vector macros defined, the
+    same way chip8_quirks.h is expanded per quirk profile.
+
+    Below LANES pixels per block the lanes of one vector come from several
+    screen pixels. The row is consumed in groups of `group` pixels that
+    fill a whole number of vectors, every lane tests its pixel's bit with
+    one AND and CMPEQ against the masks from expand_lane_masks. From LANES
+    up every pixel is a run of whole vectors, the last one overlapping the
+    previous when scale is not a multiple of LANES.
+ *********************************/
+
+#ifndef EXPAND_ISA
+#error "define EXPAND_ISA before including expand_kernel.h"
+#endif
+
+#define EXPAND_CAT_(a, b) a##_##b
+#define EXPAND_CAT(a, b) EXPAND_CAT_(a, b)
+#define EXPAND_FN(name) EXPAND_CAT(name, EXPAND_ISA)
+
+static EXPAND_TARGET void EXPAND_FN(expand)(const uint64_t *video, u32 rows, u32 *out, u32 stride, u32 scale,
+                                             u32 on, u32 off) {
+  EXPAND_VEC off_vec = EXPAND_SET1(off);
+  EXPAND_VEC diff_vec = EXPAND_SET1(on ^ off);
+
+  EXPAND_VEC masks[EXPAND_LANES];
+  u32 group = 0;
+  u32 vectors = 0;
+  if (scale < EXPAND_LANES) {
+    u32 lane_masks[EXPAND_LANES * EXPAND_LANES];
+    group = expand_lane_masks(EXPAND_LANES, scale, lane_masks);
+    vectors = group * scale / EXPAND_LANES;
+    for (u32 k = 0; k < vectors; k++) {
+      masks[k] = EXPAND_LOAD(lane_masks + k * EXPAND_LANES);
+    }
+  }
+
+  for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
+    if (!(rows & (1u << y))) {
+      continue;
+    }
+    uint64_t row = video[y];
+    u32 *first = out + y * scale * stride;
+    u32 *line = first;
+
+    if (scale < EXPAND_LANES) {
+      for (u32 shift = SCREEN_WIDTH; shift > 0; shift -= group) {
+        EXPAND_VEC bits = EXPAND_SET1((row >> (shift - group)) & ((1u << group) - 1));
+        for (u32 k = 0; k < vectors; k++) {
+          EXPAND_VEC lit = EXPAND_CMPEQ(EXPAND_AND(bits, masks[k]), masks[k]);
+          EXPAND_STORE(line, EXPAND_XOR(off_vec, EXPAND_AND(lit, diff_vec)));
+          line += EXPAND_LANES;
+        }
+      }
+    } else {
+      for (u32 x = 0; x < SCREEN_WIDTH; x++) {
+        EXPAND_VEC lit = EXPAND_SET1(-(int)((row >> (SCREEN_WIDTH - 1 - x)) & 1));
+        EXPAND_VEC color = EXPAND_XOR(off_vec, EXPAND_AND(lit, diff_vec));
+        u32 i = 0;
+        for (; i + EXPAND_LANES <= scale; i += EXPAND_LANES) {
+          EXPAND_STORE(line + i, color);
+        }
+        if (i < scale) {
+          EXPAND_STORE(line + scale - EXPAND_LANES, color);
+        }
+        line += scale;
+      }
+    }
+    repeat_line(first, stride, scale);
+  }
+}
+
+#undef EXPAND_CAT_
+#undef EXPAND_CAT
+#undef EXPAND_FN
+#undef EXPAND_ISA
+#undef EXPAND_TARGET
+#undef EXPAND_LANES
+#undef EXPAND_VEC
+#undef EXPAND_SET1
+#undef EXPAND_AND
+#undef EXPAND_XOR
+#undef EXPAND_CMPEQ
+#undef EXPAND_LOAD
+#undef EXPAND_STORE
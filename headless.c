@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 199309L
+#include "chip8.h"
+#include "sched.h"
+#include "script.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*********************************
+    chip8-headless
+
+    Runs a ROM without a window for a fixed budget, feeding the keypad from
+    an input script, then dumps the machine state, the screen and timing
+    stats. Only needs the core, no raylib, X11 or GL, for CI and batch
+    servers.
+
+    usage: chip8-headless rom.ch8 [options]
+      --frames n         run n timer ticks (60Hz frames), 600 by default
+      --cycles n         run n instructions instead
+      --input file       input script, see script.h
+      --ips n            instructions per second, 700 by default
+      --quirks name      vip, chip48, schip or xochip instead of the one
+                         load_rom picks from the file extension
+      --seed n           seed for Cxkk, 1 by default
+      --out file         write the dump there instead of stdout
+      --dump-frames file write the screen after every frame, a frame that
+                         did not change is written as `repeat`
+ *********************************/
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void dump_video(FILE *out, const Chip8 *chip8) {
+  char line[SCREEN_WIDTH + 2];
+  for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
+    for (u32 x = 0; x < SCREEN_WIDTH; x++) {
+      line[x] = video_pixel(chip8, x, y) ? '#' : '.';
+    }
+    line[SCREEN_WIDTH] = '\n';
+    line[SCREEN_WIDTH + 1] = '\0';
+    fputs(line, out);
+  }
+}
+
+static void dump_state(FILE *out, const Chip8 *chip8) {
+  fprintf(out, "pc: 0x%03X\nI: 0x%03X\nsp: %u\ndelay_timer: %u\nsound_timer: %u\n", chip8->pc, chip8->I,
+          chip8->sp, chip8->delay_timer, chip8->sound_timer);
+  fprintf(out, "V:");
+  for (u32 i = 0; i < 16; i++) {
+    fprintf(out, " %02X", chip8->V[i]);
+  }
+  fprintf(out, "\nstack:");
+  for (u32 i = 0; i < chip8->sp && i < 16; i++) {
+    fprintf(out, " %03X", chip8->stack[i]);
+  }
+  fprintf(out, "\nvideo_hash: 0x%016llX\nvideo:\n", (unsigned long long)video_hash(chip8));
+  dump_video(out, chip8);
+}
+
+static int usage(const char *name) {
+  printf("usage: %s rom.ch8 [--frames n | --cycles n] [--input file] [--ips n] [--quirks name]\n"
+         "       [--seed n] [--out file] [--dump-frames file]\n",
+         name);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  double start = now_seconds();
+  const char *rom = NULL;
+  const char *input = NULL;
+  const char *out_name = NULL;
+  const char *frames_name = NULL;
+  uint64_t frames = 600;
+  uint64_t cycles = 0; // 0: budget in frames
+  u32 ips = SCHED_DEFAULT_IPS;
+  int quirks = -1;
+  uint64_t seed = 1;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (arg[0] != '-') {
+      rom = arg;
+      continue;
+    }
+    if (value == NULL) {
+      return usage(argv[0]);
+    }
+    i++;
+    if (strcmp(arg, "--frames") == 0) {
+      frames = strtoull(value, NULL, 10);
+    } else if (strcmp(arg, "--cycles") == 0) {
+      cycles = strtoull(value, NULL, 10);
+    } else if (strcmp(arg, "--input") == 0) {
+      input = value;
+    } else if (strcmp(arg, "--ips") == 0) {
+      char *end;
+      ips = strtoul(value, &end, 10);
+      if (*end != '\0') {
+        return usage(argv[0]);
+      }
+    } else if (strcmp(arg, "--quirks") == 0) {
+      quirks = quirks_by_name(value);
+      if (quirks < 0) {
+        printf("unknown quirk profile `%s`\n", value);
+        return 1;
+      }
+    } else if (strcmp(arg, "--seed") == 0) {
+      seed = strtoull(value, NULL, 10);
+    } else if (strcmp(arg, "--out") == 0) {
+      out_name = value;
+    } else if (strcmp(arg, "--dump-frames") == 0) {
+      frames_name = value;
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (rom == NULL || ips == 0) {
+    return usage(argv[0]);
+  }
+
+  static Chip8 chip8;
+  init_chip8(&chip8);
+  seed_random(&chip8, seed);
+  if (enable_decode_cache(&chip8) != 0 || load_rom(&chip8, rom) != 0) {
+    return 1;
+  }
+  if (quirks >= 0) {
+    set_quirks(&chip8, quirks);
+  }
+  Chip8Script script = {0};
+  if (input != NULL && script_load(&script, input) != 0) {
+    return 1;
+  }
+  FILE *out = stdout;
+  if (out_name != NULL && (out = fopen(out_name, "w")) == NULL) {
+    printf("Error opening `%s`\n", out_name);
+    return 1;
+  }
+  FILE *frames_out = NULL;
+  if (frames_name != NULL && (frames_out = fopen(frames_name, "w")) == NULL) {
+    printf("Error opening `%s`\n", frames_name);
+    return 1;
+  }
+
+  Chip8Sched sched;
+  double run_start = now_seconds();
+  sched_init(&sched, run_fused, ips, run_start);
+  u32 cursor = 0;
+  uint64_t last_hash = 0;
+  uint64_t repeated = 0;
+  for (uint64_t frame = 0; cycles > 0 ? sched.instructions < cycles : frame < frames; frame++) {
+    set_keypad(&chip8, script_keys(&script, &cursor, frame));
+    sched_run_frame(&sched, &chip8, cycles > 0 ? cycles : UINT64_MAX);
+
+    if (frames_out != NULL) {
+      uint64_t hash = video_hash(&chip8);
+      if (frame > 0 && hash == last_hash) {
+        fprintf(frames_out, "repeat\n");
+        repeated++;
+      } else {
+        fprintf(frames_out, "frame %llu\n", (unsigned long long)frame);
+        dump_video(frames_out, &chip8);
+      }
+      last_hash = hash;
+    }
+  }
+  double end = now_seconds();
+
+  fprintf(out, "rom: %s\nquirks: %s\nips: %u\n", rom, quirk_flags[chip8.quirks].name, ips);
+  fprintf(out, "frames: %llu\ninstructions: %llu\n", (unsigned long long)sched.ticks,
+          (unsigned long long)sched.instructions);
+  fprintf(out, "startup_us: %.1f\nrun_ms: %.3f\nmips: %.2f\n", (run_start - start) * 1e6, (end - run_start) * 1e3,
+          sched.instructions / (end - run_start) / 1e6);
+  fprintf(out, "idle_loops: %u\nidle_elided: %llu\n", chip8.idle_skips, (unsigned long long)chip8.idle_elided);
+  if (frames_out != NULL) {
+    fprintf(out, "repeated_frames: %llu\n", (unsigned long long)repeated);
+    fclose(frames_out);
+  }
+  dump_state(out, &chip8);
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  script_free(&script);
+  free_decode_cache(&chip8);
+  return 0;
+}
@@ -0,0 +1,1191 @@
+#define _DEFAULT_SOURCE
+#include "jit.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#include <sys/mman.h>
+
+/*********************************
+    Block layout
+
+    A block starts at any address the program jumps to and runs until the
+    first instruction that changes pc (1nnn, 2nnn, 00EE, Bnnn, the skips)
+    or may rewrite code (Fx33, Fx55). Every pass through a block executes
+    exactly `count` instructions, which is what lets jit_run hit a cycle
+    budget exactly.
+
+    Host registers inside a block:
+      rbx        Chip8 pointer
+      r12        Chip8Jit pointer
+      r14d       I, loaded on first use and written back at block exit
+      r15d       instructions left in the budget passed to jit_run
+      esi..r13d  up to 7 V registers, loaded on first use
+      eax..edx   scratch
+
+    Instructions without a native translation (Dxyn, Fx0A, Fx65, ...) are
+    compiled as a call to their op_* handler with the cached registers
+    written back before and reloaded after the call.
+
+    A VF update that a later instruction of the same block overwrites
+    before anything reads it (see vf_is_dead) is not compiled at all.
+    Blocks always run to their end, so nothing can see the stale VF.
+
+    Block chaining
+    Every exit with a static target (1nnn, 2nnn, both sides of a skip, the
+    fall through of a block that hit the length limit) is a patchable
+    `jmp rel32`. Until it is linked it falls through into a stub that
+    leaves to jit_run with the exit as pending link, and jit_run patches
+    the jump to the target block once that block exists. From then on the
+    two blocks run back to back without leaving native code. Every block
+    starts by taking its instruction count off r15d and leaves through its
+    bail stub when the budget would be overrun.
+
+    00EE is dynamic, so 2nnn pushes the block at its return address onto a
+    small return address stack and 00EE jumps straight to it when the
+    prediction is right and the block is still valid.
+
+    Invalidating a block patches every jump into it back to its stub.
+
+    The arena is never writable and executable at the same time. Whatever
+    translates or patches code makes it writable first, jit_run turns it
+    back to executable before entering native code, so a run of
+    translations and links costs a single pair of mprotect calls. A memory
+    write only pays for them when it hits a block that is still valid. If
+    mprotect fails the JIT interprets from then on rather than running
+    code it could not patch.
+ *********************************/
+
+#define JIT_ARENA_SIZE (4 * 1024 * 1024)
+#define JIT_MAX_BLOCKS 8192
+#define JIT_MAX_BLOCK_INSNS 32
+#define JIT_MAX_INSN_BYTES 96 // worst case native size of one instruction
+#define JIT_MAX_BLOCK_BYTES (JIT_MAX_BLOCK_INSNS * JIT_MAX_INSN_BYTES + 64)
+#define JIT_PAGE_SHIFT 6      // 64 byte pages for the translated code bitmap
+#define JIT_MAX_LINKS (JIT_MAX_BLOCKS * 2)
+#define JIT_RAS_SIZE 16       // entries of the return address stack, power of two
+
+// x86-64 register numbers
+enum {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R8 = 8,
+  R12 = 12,
+  R13 = 13,
+  R14 = 14,
+  R15 = 15
+};
+
+#define REG_CHIP8 RBX
+#define REG_JIT R12
+#define REG_I R14
+#define REG_BUDGET R15
+#define SLOT_COUNT 7
+static const u8 slot_regs[SLOT_COUNT] = {RSI, RDI, 8, 9, 10, 11, R13};
+
+// condition codes for jcc/setcc
+#define CC_B 0x2
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_AE 0x3
+#define CC_BE 0x6
+
+// ALU opcodes for the `op r/m32, r32` form and their /digit for 0x81
+#define ALU_ADD 0x01
+#define ALU_OR 0x09
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+#define EXT_ADD 0
+#define EXT_AND 4
+#define EXT_SUB 5
+#define EXT_CMP 7
+#define EXT_SHL 4
+#define EXT_SHR 5
+
+#define OFF_V offsetof(Chip8, V)
+#define OFF_I offsetof(Chip8, I)
+#define OFF_PC offsetof(Chip8, pc)
+#define OFF_STACK offsetof(Chip8, stack)
+#define OFF_SP offsetof(Chip8, sp)
+#define OFF_DELAY offsetof(Chip8, delay_timer)
+#define OFF_SOUND offsetof(Chip8, sound_timer)
+
+struct JitLink;
+
+typedef struct JitBlock {
+  u8 *code;
+  u16 start;
+  u16 end;   // first address after the block
+  u16 count; // instructions executed by every pass through the block
+  u8 valid;
+  u8 idle; // starts a timer/key polling loop, see skip_idle_loop
+  u8 exit_count;
+  struct JitLink *exits[2];
+  struct JitLink *incoming; // linked exits of other blocks jumping here
+} JitBlock;
+
+// a static exit of a block, patched to jump straight to its target block
+typedef struct JitLink {
+  u8 *jump; // rel32 field of the exit jump
+  JitBlock *from;
+  JitBlock *to; // NULL while the exit still leaves to jit_run
+  struct JitLink *next_incoming;
+  u16 target;
+} JitLink;
+
+struct Chip8Jit {
+  Chip8 *chip8;
+  u8 *arena;
+  size_t arena_used;
+  size_t arena_reserved; // trampolines at the start of the arena, never flushed
+  u8 arena_writable;     // mapped read/write instead of read/execute
+  u8 broken;             // blocks could not be patched, never enter native code again
+  // runs code until the budget is used up or an exit leaves native code,
+  // returns the remaining budget
+  u32 (*enter)(Chip8 *chip8, u8 *code, u32 budget, Chip8Jit *jit);
+  u8 *exit;
+  u8 *link_exit;
+
+  JitLink links[JIT_MAX_LINKS];
+  u32 link_count;
+  JitLink *pending_link; // unlinked exit the last enter left through
+  JitBlock *ras[JIT_RAS_SIZE];
+  u32 ras_top;
+
+  JitBlock *block_at[4096];
+  JitBlock blocks[JIT_MAX_BLOCKS];
+  u32 block_count;
+  // operands for the handler calls, one per translated instruction at most
+  Chip8Insn insns[JIT_MAX_BLOCKS * 4];
+  u32 insn_count;
+  // which 64 byte pages of memory valid blocks were translated from, or
+  // were until an invalidation that did not touch them
+  uint64_t code_pages;
+
+  Chip8JitStats stats;
+};
+
+// state of one block translation
+typedef struct Emitter {
+  u8 *p;
+  int8_t vreg_slot[16];
+  int8_t slot_vreg[SLOT_COUNT];
+  u8 slot_dirty[SLOT_COUNT];
+  u32 slot_used[SLOT_COUNT];
+  u32 tick;
+  u8 i_state; // 0 = not loaded, 1 = loaded, 2 = loaded and modified
+} Emitter;
+
+/*********************************
+    Instruction encoding
+ *********************************/
+
+static void emit8(Emitter *e, u8 b) {
+  *e->p++ = b;
+}
+
+static void emit16(Emitter *e, u16 v) {
+  memcpy(e->p, &v, 2);
+  e->p += 2;
+}
+
+static void emit32(Emitter *e, u32 v) {
+  memcpy(e->p, &v, 4);
+  e->p += 4;
+}
+
+static void emit64(Emitter *e, uint64_t v) {
+  memcpy(e->p, &v, 8);
+  e->p += 8;
+}
+
+// REX prefix for a reg/rm pair, `force` emits it without extended registers
+// too, which is needed to address sil/dil as byte registers
+static void emit_rex(Emitter *e, int w, int reg, int rm, int force) {
+  u8 rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+  if (rex != 0x40 || force) {
+    emit8(e, rex);
+  }
+}
+
+static void emit_modrm(Emitter *e, int mod, int reg, int rm) {
+  emit8(e, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+// <alu> dst, src on 32 bit registers
+static void emit_alu_rr(Emitter *e, u8 alu, int dst, int src) {
+  emit_rex(e, 0, src, dst, 0);
+  emit8(e, alu);
+  emit_modrm(e, 3, src, dst);
+}
+
+// <alu> dst, imm32
+static void emit_alu_ri(Emitter *e, int ext, int dst, u32 imm) {
+  emit_rex(e, 0, 0, dst, 0);
+  emit8(e, 0x81);
+  emit_modrm(e, 3, ext, dst);
+  emit32(e, imm);
+}
+
+static void emit_mov_ri(Emitter *e, int dst, u32 imm) {
+  emit_rex(e, 0, 0, dst, 0);
+  emit8(e, 0xB8 + (dst & 7));
+  emit32(e, imm);
+}
+
+// shl/shr dst, imm8
+static void emit_shift_ri(Emitter *e, int ext, int dst, u8 imm) {
+  emit_rex(e, 0, 0, dst, 0);
+  emit8(e, 0xC1);
+  emit_modrm(e, 3, ext, dst);
+  emit8(e, imm);
+}
+
+// movzx dst, src8 keeps V registers in their 0-255 range
+static void emit_movzx8_rr(Emitter *e, int dst, int src) {
+  emit_rex(e, 0, dst, src, 1);
+  emit8(e, 0x0F);
+  emit8(e, 0xB6);
+  emit_modrm(e, 3, dst, src);
+}
+
+// setcc dst8 followed by movzx dst, dst8
+static void emit_setcc(Emitter *e, u8 cc, int dst) {
+  emit_rex(e, 0, 0, dst, 1);
+  emit8(e, 0x0F);
+  emit8(e, 0x90 | cc);
+  emit_modrm(e, 3, 0, dst);
+  emit_movzx8_rr(e, dst, dst);
+}
+
+// movzx dst, byte [rbx + disp]
+static void emit_load8(Emitter *e, int dst, u32 disp) {
+  emit_rex(e, 0, dst, REG_CHIP8, 0);
+  emit8(e, 0x0F);
+  emit8(e, 0xB6);
+  emit_modrm(e, 2, dst, REG_CHIP8);
+  emit32(e, disp);
+}
+
+// mov byte [rbx + disp], src8
+static void emit_store8(Emitter *e, u32 disp, int src) {
+  emit_rex(e, 0, src, REG_CHIP8, 1);
+  emit8(e, 0x88);
+  emit_modrm(e, 2, src, REG_CHIP8);
+  emit32(e, disp);
+}
+
+// movzx dst, word [rbx + disp]
+static void emit_load16(Emitter *e, int dst, u32 disp) {
+  emit_rex(e, 0, dst, REG_CHIP8, 0);
+  emit8(e, 0x0F);
+  emit8(e, 0xB7);
+  emit_modrm(e, 2, dst, REG_CHIP8);
+  emit32(e, disp);
+}
+
+// mov word [rbx + disp], src16
+static void emit_store16(Emitter *e, u32 disp, int src) {
+  emit8(e, 0x66);
+  emit_rex(e, 0, src, REG_CHIP8, 0);
+  emit8(e, 0x89);
+  emit_modrm(e, 2, src, REG_CHIP8);
+  emit32(e, disp);
+}
+
+// mov word [rbx + disp], imm16
+static void emit_store16_imm(Emitter *e, u32 disp, u16 imm) {
+  emit8(e, 0x66);
+  emit8(e, 0xC7);
+  emit_modrm(e, 2, 0, REG_CHIP8);
+  emit32(e, disp);
+  emit16(e, imm);
+}
+
+// jmp rel32 to target
+static void emit_jmp(Emitter *e, const u8 *target) {
+  emit8(e, 0xE9);
+  emit32(e, (u32)(target - (e->p + 4)));
+}
+
+// jcc rel32 with the target patched in later, returns the rel32 field
+static u8 *emit_jcc(Emitter *e, u8 cc) {
+  emit8(e, 0x0F);
+  emit8(e, 0x80 | cc);
+  emit32(e, 0);
+  return e->p - 4;
+}
+
+static void patch_rel32(u8 *field, const u8 *target) {
+  u32 rel = (u32)(target - (field + 4));
+  memcpy(field, &rel, 4);
+}
+
+// modrm + sib for [r12 + disp32]
+static void emit_jit_mem(Emitter *e, int reg, u32 disp) {
+  emit_modrm(e, 2, reg, 4);
+  emit8(e, 0x24);
+  emit32(e, disp);
+}
+
+// modrm + sib for [base + rax*8 + disp32]
+static void emit_indexed_mem(Emitter *e, int reg, int base, u32 disp) {
+  emit_modrm(e, 2, reg, 4);
+  emit8(e, 0xC0 | (base & 7));
+  emit32(e, disp);
+}
+
+/*********************************
+    Register cache
+ *********************************/
+
+static void evict_slot(Emitter *e, int slot) {
+  int vreg = e->slot_vreg[slot];
+  if (vreg < 0) {
+    return;
+  }
+  if (e->slot_dirty[slot]) {
+    emit_store8(e, OFF_V + vreg, slot_regs[slot]);
+  }
+  e->vreg_slot[vreg] = -1;
+  e->slot_vreg[slot] = -1;
+  e->slot_dirty[slot] = 0;
+}
+
+// picks a free slot or the least recently used one
+static int alloc_slot(Emitter *e) {
+  int best = 0;
+  for (int slot = 0; slot < SLOT_COUNT; slot++) {
+    if (e->slot_vreg[slot] < 0) {
+      return slot;
+    }
+    if (e->slot_used[slot] < e->slot_used[best]) {
+      best = slot;
+    }
+  }
+  evict_slot(e, best);
+  return best;
+}
+
+static int map_vreg(Emitter *e, int vreg, int load) {
+  int slot = e->vreg_slot[vreg];
+  if (slot < 0) {
+    slot = alloc_slot(e);
+    e->vreg_slot[vreg] = slot;
+    e->slot_vreg[slot] = vreg;
+    if (load) {
+      emit_load8(e, slot_regs[slot], OFF_V + vreg);
+    }
+  }
+  e->slot_used[slot] = ++e->tick;
+  return slot;
+}
+
+// host register holding the current value of Vx
+static int get_v(Emitter *e, int vreg) {
+  return slot_regs[map_vreg(e, vreg, 1)];
+}
+
+// host register that Vx is about to be written to
+static int def_v(Emitter *e, int vreg) {
+  int slot = map_vreg(e, vreg, 0);
+  e->slot_dirty[slot] = 1;
+  return slot_regs[slot];
+}
+
+static int get_i(Emitter *e) {
+  if (e->i_state == 0) {
+    emit_load16(e, REG_I, OFF_I);
+    e->i_state = 1;
+  }
+  return REG_I;
+}
+
+static int def_i(Emitter *e) {
+  e->i_state = 2;
+  return REG_I;
+}
+
+// writes every modified register back to the Chip8
+static void flush_regs(Emitter *e) {
+  for (int slot = 0; slot < SLOT_COUNT; slot++) {
+    if (e->slot_vreg[slot] >= 0 && e->slot_dirty[slot]) {
+      emit_store8(e, OFF_V + e->slot_vreg[slot], slot_regs[slot]);
+      e->slot_dirty[slot] = 0;
+    }
+  }
+  if (e->i_state == 2) {
+    emit_store16(e, OFF_I, REG_I);
+    e->i_state = 1;
+  }
+}
+
+// forgets all cached registers, used after calling into C
+static void drop_regs(Emitter *e) {
+  for (int slot = 0; slot < SLOT_COUNT; slot++) {
+    e->slot_vreg[slot] = -1;
+    e->slot_dirty[slot] = 0;
+  }
+  memset(e->vreg_slot, -1, sizeof(e->vreg_slot));
+  e->i_state = 0;
+}
+
+/*********************************
+    Translation
+ *********************************/
+
+// leaves the block with pc = target through a linkable jump, registers
+// have to be flushed already
+static void emit_exit(Chip8Jit *jit, Emitter *e, JitBlock *block, u16 target) {
+  JitLink *link = &jit->links[jit->link_count++];
+  link->from = block;
+  link->to = NULL;
+  link->next_incoming = NULL;
+  link->target = target;
+  block->exits[block->exit_count++] = link;
+
+  emit_store16_imm(e, OFF_PC, target);
+  emit8(e, 0xE9);
+  emit32(e, 0);
+  link->jump = e->p - 4;
+  // not linked yet: mov rax, link; jmp link_exit
+  emit8(e, 0x48);
+  emit8(e, 0xB8 + RAX);
+  emit64(e, (uint64_t)(uintptr_t)link);
+  emit_jmp(e, jit->link_exit);
+}
+
+// pushes the block at the return address of a 2nnn onto the return stack
+static void emit_ras_push(Emitter *e, u16 return_pc) {
+  // eax = ras_top = (ras_top + 1) & mask
+  emit_rex(e, 0, RAX, REG_JIT, 0);
+  emit8(e, 0x8B);
+  emit_jit_mem(e, RAX, offsetof(Chip8Jit, ras_top));
+  emit_alu_ri(e, EXT_ADD, RAX, 1);
+  emit_alu_ri(e, EXT_AND, RAX, JIT_RAS_SIZE - 1);
+  emit_rex(e, 0, RAX, REG_JIT, 0);
+  emit8(e, 0x89);
+  emit_jit_mem(e, RAX, offsetof(Chip8Jit, ras_top));
+  // ras[eax] = block_at[return_pc]
+  emit_rex(e, 1, RCX, REG_JIT, 0);
+  emit8(e, 0x8B);
+  emit_jit_mem(e, RCX, offsetof(Chip8Jit, block_at) + return_pc * sizeof(JitBlock *));
+  emit_rex(e, 1, RCX, REG_JIT, 0);
+  emit8(e, 0x89);
+  emit_indexed_mem(e, RCX, REG_JIT, offsetof(Chip8Jit, ras));
+}
+
+// pops the return stack, ecx holds the real return address, jumps to the
+// predicted block if it is right and still valid, leaves to jit_run if not
+static void emit_ras_return(Chip8Jit *jit, Emitter *e) {
+  // rdx = ras[ras_top]; ras_top = (ras_top - 1) & mask
+  emit_rex(e, 0, RAX, REG_JIT, 0);
+  emit8(e, 0x8B);
+  emit_jit_mem(e, RAX, offsetof(Chip8Jit, ras_top));
+  emit_rex(e, 1, RDX, REG_JIT, 0);
+  emit8(e, 0x8B);
+  emit_indexed_mem(e, RDX, REG_JIT, offsetof(Chip8Jit, ras));
+  emit_alu_ri(e, EXT_SUB, RAX, 1);
+  emit_alu_ri(e, EXT_AND, RAX, JIT_RAS_SIZE - 1);
+  emit_rex(e, 0, RAX, REG_JIT, 0);
+  emit8(e, 0x89);
+  emit_jit_mem(e, RAX, offsetof(Chip8Jit, ras_top));
+  // test rdx, rdx
+  emit_rex(e, 1, RDX, RDX, 0);
+  emit8(e, 0x85);
+  emit_modrm(e, 3, RDX, RDX);
+  u8 *miss_null = emit_jcc(e, CC_E);
+  // cmp cx, [rdx + start]
+  emit8(e, 0x66);
+  emit8(e, 0x3B);
+  emit_modrm(e, 2, RCX, RDX);
+  emit32(e, offsetof(JitBlock, start));
+  u8 *miss_pc = emit_jcc(e, CC_NE);
+  // cmp byte [rdx + valid], 0
+  emit8(e, 0x80);
+  emit_modrm(e, 2, 7, RDX);
+  emit32(e, offsetof(JitBlock, valid));
+  emit8(e, 0);
+  u8 *miss_invalid = emit_jcc(e, CC_E);
+  // inc qword [r12 + ras_hits]; jmp [rdx + code]
+  emit_rex(e, 1, 0, REG_JIT, 0);
+  emit8(e, 0xFF);
+  emit_jit_mem(e, 0, offsetof(Chip8Jit, stats.ras_hits));
+  emit8(e, 0xFF);
+  emit_modrm(e, 2, 4, RDX);
+  emit32(e, offsetof(JitBlock, code));
+
+  patch_rel32(miss_null, e->p);
+  patch_rel32(miss_pc, e->p);
+  patch_rel32(miss_invalid, e->p);
+  emit_jmp(e, jit->exit);
+}
+
+// compiles the instruction as a call to its op_* handler
+static void emit_handler_call(Chip8Jit *jit, Emitter *e, u16 addr, u16 opcode) {
+  Chip8Insn *insn = &jit->insns[jit->insn_count++];
+  decode_insn(jit->chip8, insn, opcode);
+
+  flush_regs(e);
+  emit_store16_imm(e, OFF_PC, addr + 2);
+  // mov rdi, rbx
+  emit8(e, 0x48);
+  emit8(e, 0x89);
+  emit_modrm(e, 3, RBX, RDI);
+  // mov rsi, insn
+  emit8(e, 0x48);
+  emit8(e, 0xB8 + RSI);
+  emit64(e, (uint64_t)(uintptr_t)insn);
+  // mov rax, handler; call rax
+  emit8(e, 0x48);
+  emit8(e, 0xB8 + RAX);
+  emit64(e, (uint64_t)(uintptr_t)insn->handler);
+  emit8(e, 0xFF);
+  emit_modrm(e, 3, 2, RAX);
+  drop_regs(e);
+  jit->stats.handler_calls++;
+}
+
+// skip instructions: the flags are set by the caller, cc is the condition
+// under which the next instruction is skipped
+static void emit_skip(Chip8Jit *jit, Emitter *e, JitBlock *block, u8 cc, u16 addr) {
+  u8 *taken = emit_jcc(e, cc);
+  emit_exit(jit, e, block, addr + 2);
+  patch_rel32(taken, e->p);
+  emit_exit(jit, e, block, addr + 4);
+}
+
+// W^X: the arena is either writable or executable, see the banner above.
+// Both return -1 once mprotect failed, the JIT is broken from then on
+static int arena_write(Chip8Jit *jit) {
+  if (jit->broken) {
+    return -1;
+  }
+  if (!jit->arena_writable) {
+    if (mprotect(jit->arena, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE) != 0) {
+      printf("Error making the JIT arena writable, errno: %d\n", errno);
+      jit->broken = 1;
+      return -1;
+    }
+    jit->arena_writable = 1;
+  }
+  return 0;
+}
+
+static int arena_execute(Chip8Jit *jit) {
+  if (jit->broken) {
+    return -1;
+  }
+  if (jit->arena_writable) {
+    if (mprotect(jit->arena, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC) != 0) {
+      printf("Error making the JIT arena executable, errno: %d\n", errno);
+      jit->broken = 1;
+      return -1;
+    }
+    jit->arena_writable = 0;
+  }
+  return 0;
+}
+
+// the pages of memory (see code_pages) block was translated from
+static uint64_t block_pages(const JitBlock *block) {
+  uint64_t pages = 0;
+  for (u32 page = block->start >> JIT_PAGE_SHIFT; page <= (u32)(block->end - 1) >> JIT_PAGE_SHIFT; page++) {
+    pages |= 1ull << page;
+  }
+  return pages;
+}
+
+static void flush_arena(Chip8Jit *jit) {
+  jit->arena_used = jit->arena_reserved;
+  jit->block_count = 0;
+  jit->insn_count = 0;
+  jit->link_count = 0;
+  jit->pending_link = NULL;
+  memset(jit->ras, 0, sizeof(jit->ras));
+  jit->code_pages = 0;
+  memset(jit->block_at, 0, sizeof(jit->block_at));
+  jit->stats.flushes++;
+}
+
+static JitBlock *translate(Chip8Jit *jit, u16 start) {
+  if (jit->arena_used + JIT_MAX_BLOCK_BYTES > JIT_ARENA_SIZE ||
+      jit->block_count == JIT_MAX_BLOCKS || jit->link_count + 2 > JIT_MAX_LINKS ||
+      jit->insn_count + JIT_MAX_BLOCK_INSNS > sizeof(jit->insns) / sizeof(jit->insns[0])) {
+    flush_arena(jit);
+  }
+  if (arena_write(jit) != 0) {
+    return NULL;
+  }
+
+  Chip8 *chip8 = jit->chip8;
+  // set_quirks drops every block, so the profile is fixed for this one
+  const Chip8QuirkFlags *quirks = &quirk_flags[chip8->quirks];
+  JitBlock *block = &jit->blocks[jit->block_count++];
+  Emitter e = {0};
+  e.p = jit->arena + jit->arena_used;
+  drop_regs(&e);
+  block->code = e.p;
+  block->start = start;
+  block->idle = idle_loop_length(chip8->memory, start) != 0;
+  block->exit_count = 0;
+  block->incoming = NULL;
+
+  // cmp r15d, count; jb bail; sub r15d, count (count is patched in at the end)
+  emit_alu_ri(&e, EXT_CMP, REG_BUDGET, 0);
+  u8 *count_cmp = e.p - 4;
+  u8 *bail = emit_jcc(&e, CC_B);
+  emit_alu_ri(&e, EXT_SUB, REG_BUDGET, 0);
+  u8 *count_sub = e.p - 4;
+
+  u16 addr = start;
+  u16 count = 0;
+  int open = 1;
+  while (open) {
+    if (addr > 0xFFE || count == JIT_MAX_BLOCK_INSNS) {
+      flush_regs(&e);
+      emit_exit(jit, &e, block, addr);
+      break;
+    }
+
+    u16 opcode = (chip8->memory[addr] << 8) | chip8->memory[(addr + 1) & ADDRESS_MASK];
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    u8 kk = opcode & 0x00FF;
+    u16 nnn = opcode & 0x0FFF;
+    count++;
+    Chip8Op op = decode_opcode(opcode);
+
+    // the flag of the arithmetic instructions is only needed if the rest of
+    // the block may read it
+    int flag_live = 1;
+    if (((op >= OP_8xy4 && op <= OP_8xyE) || (op >= OP_8xy1 && op <= OP_8xy3 && quirks->vf_reset)) &&
+        vf_is_dead(chip8, addr + 2, addr + 2 + 2 * (JIT_MAX_BLOCK_INSNS - count))) {
+      flag_live = 0;
+      jit->stats.flags_elided++;
+    }
+
+    switch (op) {
+    case OP_1nnn: {
+      flush_regs(&e);
+      emit_exit(jit, &e, block, nnn);
+      open = 0;
+      break;
+    }
+    case OP_2nnn: {
+      flush_regs(&e);
+      // stack[sp & 15] = addr + 2; sp++
+      emit_load8(&e, RAX, OFF_SP);
+      emit_alu_ri(&e, EXT_AND, RAX, STACK_MASK);
+      emit8(&e, 0x66);
+      emit8(&e, 0xC7);
+      emit_modrm(&e, 2, 0, RSP); // [rbx + rax*2 + disp32]
+      emit8(&e, 0x43);
+      emit32(&e, OFF_STACK);
+      emit16(&e, addr + 2);
+      emit8(&e, 0xFE);
+      emit_modrm(&e, 2, 0, REG_CHIP8);
+      emit32(&e, OFF_SP);
+      if (addr + 2 <= 0xFFE) {
+        emit_ras_push(&e, addr + 2);
+      }
+      emit_exit(jit, &e, block, nnn);
+      open = 0;
+      break;
+    }
+    case OP_00EE: {
+      flush_regs(&e);
+      // sp--; pc = stack[sp & 15]
+      emit8(&e, 0xFE);
+      emit_modrm(&e, 2, 1, REG_CHIP8);
+      emit32(&e, OFF_SP);
+      emit_load8(&e, RAX, OFF_SP);
+      emit_alu_ri(&e, EXT_AND, RAX, STACK_MASK);
+      emit8(&e, 0x0F);
+      emit8(&e, 0xB7);
+      emit_modrm(&e, 2, RCX, RSP); // movzx ecx, word [rbx + rax*2 + disp32]
+      emit8(&e, 0x43);
+      emit32(&e, OFF_STACK);
+      emit_store16(&e, OFF_PC, RCX);
+      emit_ras_return(jit, &e);
+      open = 0;
+      break;
+    }
+    case OP_Bnnn: {
+      emit_alu_rr(&e, ALU_MOV, RAX, get_v(&e, quirks->jump_vx ? x : 0));
+      emit_alu_ri(&e, EXT_ADD, RAX, nnn);
+      flush_regs(&e);
+      emit_store16(&e, OFF_PC, RAX);
+      emit_jmp(&e, jit->exit);
+      open = 0;
+      break;
+    }
+    case OP_3xkk: {
+      int vx = get_v(&e, x);
+      flush_regs(&e);
+      emit_alu_ri(&e, EXT_CMP, vx, kk);
+      emit_skip(jit, &e, block, CC_E, addr);
+      open = 0;
+      break;
+    }
+    case OP_4xkk: {
+      int vx = get_v(&e, x);
+      flush_regs(&e);
+      emit_alu_ri(&e, EXT_CMP, vx, kk);
+      emit_skip(jit, &e, block, CC_NE, addr);
+      open = 0;
+      break;
+    }
+    case OP_5xy0: {
+      int vx = get_v(&e, x);
+      int vy = get_v(&e, y);
+      flush_regs(&e);
+      emit_alu_rr(&e, ALU_CMP, vx, vy);
+      emit_skip(jit, &e, block, CC_E, addr);
+      open = 0;
+      break;
+    }
+    case OP_9xy0: {
+      int vx = get_v(&e, x);
+      int vy = get_v(&e, y);
+      flush_regs(&e);
+      emit_alu_rr(&e, ALU_CMP, vx, vy);
+      emit_skip(jit, &e, block, CC_NE, addr);
+      open = 0;
+      break;
+    }
+    case OP_6xkk: {
+      emit_mov_ri(&e, def_v(&e, x), kk);
+      break;
+    }
+    case OP_7xkk: {
+      int vx = get_v(&e, x);
+      def_v(&e, x);
+      emit_alu_ri(&e, EXT_ADD, vx, kk);
+      emit_movzx8_rr(&e, vx, vx);
+      break;
+    }
+    case OP_8xy0: {
+      int vy = get_v(&e, y);
+      emit_alu_rr(&e, ALU_MOV, def_v(&e, x), vy);
+      break;
+    }
+    case OP_8xy1:
+    case OP_8xy2:
+    case OP_8xy3: {
+      static const u8 alu[] = {ALU_OR, ALU_AND, ALU_XOR};
+      int vx = get_v(&e, x);
+      int vy = get_v(&e, y);
+      def_v(&e, x);
+      emit_alu_rr(&e, alu[(opcode & 0x000F) - 1], vx, vy);
+      if (quirks->vf_reset && flag_live) {
+        emit_mov_ri(&e, def_v(&e, 0xF), 0);
+      }
+      break;
+    }
+    case OP_8xy4: {
+      int vx = get_v(&e, x);
+      int vy = get_v(&e, y);
+      emit_alu_rr(&e, ALU_MOV, RAX, vx);
+      emit_alu_rr(&e, ALU_ADD, RAX, vy);
+      if (flag_live) {
+        emit_alu_rr(&e, ALU_MOV, RCX, RAX);
+        emit_shift_ri(&e, EXT_SHR, RCX, 8);
+      }
+      emit_movzx8_rr(&e, def_v(&e, x), RAX);
+      if (flag_live) {
+        emit_alu_rr(&e, ALU_MOV, def_v(&e, 0xF), RCX);
+      }
+      break;
+    }
+    case OP_8xy5: {
+      // VF = Vx >= Vy, compared before Vx is written
+      int vx = get_v(&e, x);
+      int vy = get_v(&e, y);
+      emit_alu_rr(&e, ALU_MOV, RAX, vx);
+      if (flag_live) {
+        emit_alu_rr(&e, ALU_CMP, RAX, vy);
+        emit_setcc(&e, CC_AE, RCX);
+      }
+      emit_alu_rr(&e, ALU_SUB, RAX, vy);
+      emit_movzx8_rr(&e, def_v(&e, x), RAX);
+      if (flag_live) {
+        emit_alu_rr(&e, ALU_MOV, def_v(&e, 0xF), RCX);
+      }
+      break;
+    }
+    case OP_8xy7: {
+      // VF = Vx <= Vy, where op_8xy7 reads Vy after Vx was overwritten
+      int vx = get_v(&e, x);
+      int vy = get_v(&e, y);
+      emit_alu_rr(&e, ALU_MOV, RAX, vy);
+      emit_alu_rr(&e, ALU_SUB, RAX, vx);
+      emit_movzx8_rr(&e, RAX, RAX);
+      if (flag_live) {
+        emit_alu_rr(&e, ALU_CMP, vx, x == y ? RAX : vy);
+        emit_setcc(&e, CC_BE, RCX);
+      }
+      emit_alu_rr(&e, ALU_MOV, def_v(&e, x), RAX);
+      if (flag_live) {
+        emit_alu_rr(&e, ALU_MOV, def_v(&e, 0xF), RCX);
+      }
+      break;
+    }
+    case OP_8xy6: {
+      int vy = get_v(&e, quirks->shift_vy ? y : x);
+      emit_alu_rr(&e, ALU_MOV, RAX, vy);
+      if (flag_live) {
+        emit_alu_rr(&e, ALU_MOV, RCX, RAX);
+        emit_alu_ri(&e, EXT_AND, RCX, 1);
+      }
+      emit_shift_ri(&e, EXT_SHR, RAX, 1);
+      emit_alu_rr(&e, ALU_MOV, def_v(&e, x), RAX);
+      if (flag_live) {
+        emit_alu_rr(&e, ALU_MOV, def_v(&e, 0xF), RCX);
+      }
+      break;
+    }
+    case OP_8xyE: {
+      int vy = get_v(&e, quirks->shift_vy ? y : x);
+      emit_alu_rr(&e, ALU_MOV, RAX, vy);
+      if (flag_live) {
+        emit_alu_rr(&e, ALU_MOV, RCX, RAX);
+        emit_shift_ri(&e, EXT_SHR, RCX, 7);
+      }
+      emit_shift_ri(&e, EXT_SHL, RAX, 1);
+      emit_movzx8_rr(&e, def_v(&e, x), RAX);
+      if (flag_live) {
+        emit_alu_rr(&e, ALU_MOV, def_v(&e, 0xF), RCX);
+      }
+      break;
+    }
+    case OP_0nnn: {
+      // SYS calls are ignored
+      break;
+    }
+    case OP_Annn: {
+      emit_mov_ri(&e, def_i(&e), nnn);
+      break;
+    }
+    case OP_Fx07: {
+      emit_load8(&e, def_v(&e, x), OFF_DELAY);
+      break;
+    }
+    case OP_Fx15: {
+      emit_store8(&e, OFF_DELAY, get_v(&e, x));
+      break;
+    }
+    case OP_Fx18: {
+      emit_store8(&e, OFF_SOUND, get_v(&e, x));
+      break;
+    }
+    case OP_Fx1E: {
+      int vx = get_v(&e, x);
+      int i = get_i(&e);
+      def_i(&e);
+      emit_alu_rr(&e, ALU_ADD, i, vx);
+      emit_alu_ri(&e, EXT_AND, i, ADDRESS_MASK);
+      break;
+    }
+    case OP_Fx29: {
+      // I = 0x50 + Vx * 5
+      emit_alu_rr(&e, ALU_MOV, RAX, get_v(&e, x));
+      emit8(&e, 0x8D); // lea eax, [rax + rax*4]
+      emit8(&e, 0x04);
+      emit8(&e, 0x80);
+      emit_alu_ri(&e, EXT_ADD, RAX, FONTSET_START_ADDRESS);
+      emit_alu_rr(&e, ALU_MOV, def_i(&e), RAX);
+      break;
+    }
+    case OP_Ex9E:
+    case OP_ExA1:
+    case OP_Fx0A:
+    case OP_Fx33:
+    case OP_Fx55: {
+      // may move pc or rewrite code, so the block ends with pc from memory
+      emit_handler_call(jit, &e, addr, opcode);
+      emit_jmp(&e, jit->exit);
+      open = 0;
+      break;
+    }
+    default: {
+      // 00E0, Cxkk, Dxyn, Fx65 and illegal opcodes
+      emit_handler_call(jit, &e, addr, opcode);
+      break;
+    }
+    }
+    addr += 2;
+  }
+
+  // budget too small: leave with pc at the block start
+  patch_rel32(bail, e.p);
+  emit_store16_imm(&e, OFF_PC, start);
+  emit_jmp(&e, jit->exit);
+  memcpy(count_cmp, &(u32){count}, 4);
+  memcpy(count_sub, &(u32){count}, 4);
+
+  block->end = addr;
+  block->count = count;
+  block->valid = 1;
+  jit->arena_used = e.p - jit->arena;
+  jit->block_at[start] = block;
+  jit->code_pages |= block_pages(block);
+  jit->stats.blocks_translated++;
+  jit->stats.instructions_translated += count;
+  return block;
+}
+
+static void invalidate_block(Chip8Jit *jit, JitBlock *block) {
+  block->valid = 0;
+  if (jit->block_at[block->start] == block) {
+    jit->block_at[block->start] = NULL;
+  }
+  // jumps into the block go back through their stubs
+  for (JitLink *link = block->incoming; link != NULL; link = link->next_incoming) {
+    patch_rel32(link->jump, link->jump + 4);
+    link->to = NULL;
+    jit->stats.unlinks++;
+  }
+  block->incoming = NULL;
+  // and its own exits stop being incoming links of their targets
+  for (int i = 0; i < block->exit_count; i++) {
+    JitLink *link = block->exits[i];
+    if (link->to != NULL) {
+      JitLink **prev = &link->to->incoming;
+      while (*prev != link) {
+        prev = &(*prev)->next_incoming;
+      }
+      *prev = link->next_incoming;
+      link->to = NULL;
+    }
+  }
+  jit->stats.invalidations++;
+}
+
+// patches an exit the last block left through to jump to its target block
+static void link_exit(Chip8Jit *jit, JitLink *link) {
+  if (link->target > 0xFFE || !link->from->valid || link->to != NULL) {
+    return;
+  }
+  JitBlock *to = jit->block_at[link->target];
+  // idle loops have to come back to jit_run to be fast-forwarded
+  if (to == NULL || to->idle || arena_write(jit) != 0) {
+    return;
+  }
+  patch_rel32(link->jump, to->code);
+  link->to = to;
+  link->next_incoming = to->incoming;
+  to->incoming = link;
+  jit->stats.links++;
+}
+
+// Fx33/Fx55/load_rom wrote to memory, drop every block that covers it
+static void jit_code_write(Chip8 *chip8, u16 address, u16 length) {
+  Chip8Jit *jit = chip8->code_write_data;
+  u32 end = address + length;
+  uint64_t pages = 0;
+  for (u32 page = address >> JIT_PAGE_SHIFT; page <= (end - 1) >> JIT_PAGE_SHIFT && page < 64; page++) {
+    pages |= 1ull << page;
+  }
+  if ((pages & jit->code_pages) == 0) {
+    return;
+  }
+  // the bits of blocks dropped earlier may still be set, so the pages are
+  // worked out again from the blocks that stay valid
+  uint64_t code_pages = 0;
+  int hit = 0;
+  for (u32 i = 0; i < jit->block_count; i++) {
+    const JitBlock *block = &jit->blocks[i];
+    if (!block->valid) {
+      continue;
+    }
+    if (block->start < end && block->end > address) {
+      hit = 1;
+    } else {
+      code_pages |= block_pages(block);
+    }
+  }
+  jit->code_pages = code_pages;
+  if (!hit) {
+    return;
+  }
+
+  // this runs from handlers called by native code, which ends its block
+  // after them and is only entered again once the arena is executable
+  if (arena_write(jit) != 0) {
+    return;
+  }
+  for (u32 i = 0; i < jit->block_count; i++) {
+    JitBlock *block = &jit->blocks[i];
+    if (block->valid && block->start < end && block->end > address) {
+      invalidate_block(jit, block);
+    }
+  }
+  arena_execute(jit);
+}
+
+// shared entry and exit code at the start of the arena
+static void emit_trampolines(Chip8Jit *jit) {
+  Emitter e = {0};
+  e.p = jit->arena;
+
+  // enter(chip8, code, budget, jit): save callee saved registers,
+  // rbx = chip8, r15d = budget, r12 = jit, jump to code
+  jit->enter = (u32(*)(Chip8 *, u8 *, u32, Chip8Jit *))(void *)e.p;
+  emit8(&e, 0x53);
+  emit8(&e, 0x41);
+  emit8(&e, 0x54);
+  emit8(&e, 0x41);
+  emit8(&e, 0x55);
+  emit8(&e, 0x41);
+  emit8(&e, 0x56);
+  emit8(&e, 0x41);
+  emit8(&e, 0x57);
+  emit_rex(&e, 1, RDI, REG_CHIP8, 0);
+  emit8(&e, 0x89);
+  emit_modrm(&e, 3, RDI, REG_CHIP8);
+  emit_alu_rr(&e, ALU_MOV, REG_BUDGET, RDX);
+  emit_rex(&e, 1, RCX, REG_JIT, 0);
+  emit8(&e, 0x89);
+  emit_modrm(&e, 3, RCX, REG_JIT);
+  emit8(&e, 0xFF); // jmp rsi
+  emit_modrm(&e, 3, 4, RSI);
+
+  // exit: return the remaining budget
+  jit->exit = e.p;
+  emit_alu_rr(&e, ALU_MOV, RAX, REG_BUDGET);
+  emit8(&e, 0x41);
+  emit8(&e, 0x5F);
+  emit8(&e, 0x41);
+  emit8(&e, 0x5E);
+  emit8(&e, 0x41);
+  emit8(&e, 0x5D);
+  emit8(&e, 0x41);
+  emit8(&e, 0x5C);
+  emit8(&e, 0x5B);
+  emit8(&e, 0xC3);
+
+  // link_exit: rax = the unlinked JitLink, remembered for jit_run
+  jit->link_exit = e.p;
+  emit_rex(&e, 1, RAX, REG_JIT, 0);
+  emit8(&e, 0x89);
+  emit_jit_mem(&e, RAX, offsetof(Chip8Jit, pending_link));
+  emit_jmp(&e, jit->exit);
+
+  jit->arena_reserved = jit->arena_used = 128;
+}
+
+Chip8Jit *jit_create(Chip8 *chip8) {
+  Chip8Jit *jit = calloc(1, sizeof(Chip8Jit));
+  if (jit == NULL) {
+    printf("Error allocating the JIT\n");
+    return NULL;
+  }
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_JIT
+  flags |= MAP_JIT; // macOS only hands out executable memory mapped for JITs
+#endif
+  jit->arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (jit->arena == MAP_FAILED) {
+    printf("Error mapping the JIT code arena\n");
+    free(jit);
+    return NULL;
+  }
+  jit->chip8 = chip8;
+  jit->arena_writable = 1;
+  emit_trampolines(jit);
+  chip8->on_code_write = jit_code_write;
+  chip8->code_write_data = jit;
+  return jit;
+}
+
+void jit_destroy(Chip8Jit *jit) {
+  if (jit == NULL) {
+    return;
+  }
+  if (jit->chip8->code_write_data == jit) {
+    jit->chip8->on_code_write = NULL;
+    jit->chip8->code_write_data = NULL;
+  }
+  munmap(jit->arena, JIT_ARENA_SIZE);
+  free(jit);
+}
+
+void jit_run(Chip8Jit *jit, u32 n) {
+  Chip8 *chip8 = jit->chip8;
+  while (n > 0) {
+    u16 pc = chip8->pc;
+    JitBlock *block = NULL;
+    if (pc <= 0xFFE && !jit->broken) {
+      block = jit->block_at[pc];
+      if (block == NULL) {
+        block = translate(jit, pc);
+      }
+    }
+    if (block != NULL && block->idle) {
+      n -= skip_idle_loop(chip8, n);
+      if (n == 0) {
+        break;
+      }
+    }
+    // blocks run as a whole, so the end of the budget is interpreted
+    if (block == NULL || block->count > n || arena_execute(jit) != 0) {
+      process_instruction_cached(chip8);
+      jit->stats.interpreted++;
+      n--;
+      continue;
+    }
+    jit->stats.blocks_run++;
+    n = jit->enter(chip8, block->code, n, jit);
+    if (jit->pending_link != NULL) {
+      link_exit(jit, jit->pending_link);
+      jit->pending_link = NULL;
+    }
+  }
+}
+
+#else
+
+struct Chip8Jit {
+  Chip8JitStats stats;
+};
+
+Chip8Jit *jit_create(Chip8 *chip8) {
+  printf("The JIT is only available on x86-64\n");
+  return NULL;
+}
+
+void jit_destroy(Chip8Jit *jit) {
+}
+
+void jit_run(Chip8Jit *jit, u32 n) {
+}
+
+#endif
+
+const Chip8JitStats *jit_stats(const Chip8Jit *jit) {
+  return &jit->stats;
+}
+
+void jit_print_stats(const Chip8Jit *jit) {
+  const Chip8JitStats *stats = jit_stats(jit);
+  printf("jit: %u blocks (%u instructions, %u handler calls, %u flags elided), %u invalidated, %u flushes\n",
+         stats->blocks_translated, stats->instructions_translated, stats->handler_calls,
+         stats->flags_elided, stats->invalidations, stats->flushes);
+  printf("jit: %u links, %u unlinked, %llu returns predicted\n", stats->links, stats->unlinks,
+         (unsigned long long)stats->ras_hits);
+  printf("jit: %llu blocks run, %llu instructions interpreted\n",
+         (unsigned long long)stats->blocks_run, (unsigned long long)stats->interpreted);
+}
@@ -0,0 +1,38 @@
+#ifndef CHIP8_JIT_H
+#define CHIP8_JIT_H
+
+#include "chip8.h"
+
+/*********************************
+    x86-64 dynamic recompiler
+
+    Translates CHIP-8 basic blocks into native code on first execution.
+    Only available on x86-64 hosts with mmap, jit_create returns NULL
+    everywhere else so callers can stay on the interpreter.
+ *********************************/
+
+typedef struct Chip8Jit Chip8Jit;
+
+typedef struct Chip8JitStats {
+  u32 blocks_translated;
+  u32 instructions_translated;
+  u32 handler_calls;    // instructions compiled as calls to their op_* handler
+  u32 flags_elided;     // VF updates dropped because the block overwrites VF first
+  u32 invalidations;    // blocks dropped because code was written to
+  u32 flushes;          // times the whole code arena was thrown away
+  u32 links;            // block exits patched to jump to their target
+  u32 unlinks;          // links undone because their target was invalidated
+  uint64_t blocks_run;  // blocks entered from jit_run
+  uint64_t ras_hits;    // 00EE returns predicted by the return address stack
+  uint64_t interpreted; // instructions run by the interpreter instead
+} Chip8JitStats;
+
+// attaches a JIT to chip8, returns NULL if the host is not supported
+Chip8Jit *jit_create(Chip8 *chip8);
+void jit_destroy(Chip8Jit *jit);
+// runs exactly n instructions
+void jit_run(Chip8Jit *jit, u32 n);
+const Chip8JitStats *jit_stats(const Chip8Jit *jit);
+void jit_print_stats(const Chip8Jit *jit);
+
+#endif
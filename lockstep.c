@@ -0,0 +1,349 @@
+#include "lockstep.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LOCKSTEP_X86 1
+#include <immintrin.h>
+#else
+#define LOCKSTEP_X86 0
+#endif
+
+struct Chip8Lockstep {
+  // the registers of every lane, V[r][lane]. The copies in the lanes'
+  // Chip8 are only current while the interpreter runs an instruction there
+  u8 V[16][LOCKSTEP_LANES_MAX];
+  u16 I[LOCKSTEP_LANES_MAX];
+  u16 pc[LOCKSTEP_LANES_MAX];
+  u8 sp[LOCKSTEP_LANES_MAX];
+  u8 delay_timer[LOCKSTEP_LANES_MAX];
+  u8 sound_timer[LOCKSTEP_LANES_MAX];
+  // calls and key tests are frequent enough to not go through the Chip8
+  u16 stack[16][LOCKSTEP_LANES_MAX];
+  u16 keys[LOCKSTEP_LANES_MAX];
+
+  u32 count;
+  u32 active; // bit per lane in use
+  Chip8Quirks quirks;
+  const LockstepKernel *kernel;
+  Chip8 *chip8; // one per lane: memory, stack, screen and keypad
+  LockstepStats stats;
+
+  // bytes any lane wrote to with Fx33/Fx55. Everywhere else the lanes still
+  // have the ROM image, so lanes at the same pc run the same opcode
+  u8 written[4096 / 8];
+};
+
+static int is_written(const Chip8Lockstep *lockstep, u16 address) {
+  return (lockstep->written[address >> 3] >> (address & 7)) & 1;
+}
+
+static void lockstep_code_write(Chip8 *chip8, u16 address, u16 length) {
+  Chip8Lockstep *lockstep = chip8->code_write_data;
+  for (u32 a = address; a < (u32)address + length && a < 4096; a++) {
+    lockstep->written[a >> 3] |= 1 << (a & 7);
+  }
+}
+
+static u16 fetch(const Chip8 *chip8, u16 pc) {
+  return (chip8->memory[pc & ADDRESS_MASK] << 8) | chip8->memory[(pc + 1) & ADDRESS_MASK];
+}
+
+// copies all of the lane's registers into its Chip8
+static Chip8 *load_lane(Chip8Lockstep *lockstep, u32 lane) {
+  Chip8 *chip8 = &lockstep->chip8[lane];
+  for (u32 r = 0; r < 16; r++) {
+    chip8->V[r] = lockstep->V[r][lane];
+  }
+  chip8->I = lockstep->I[lane];
+  chip8->pc = lockstep->pc[lane];
+  chip8->sp = lockstep->sp[lane];
+  chip8->delay_timer = lockstep->delay_timer[lane];
+  chip8->sound_timer = lockstep->sound_timer[lane];
+  for (u32 i = 0; i < 16; i++) {
+    chip8->stack[i] = lockstep->stack[i][lane];
+  }
+  return chip8;
+}
+
+// runs insn on the lane through the interpreter's handler. Apart from
+// Fx55/Fx65 every instruction reads and writes at most V0, Vx, Vy and VF
+// besides I, pc, sp and the timers, so only those are copied over
+static void run_scalar(Chip8Lockstep *lockstep, u32 lane, u16 opcode, const Chip8Insn *insn) {
+  Chip8 *chip8 = &lockstep->chip8[lane];
+  const u8 regs[4] = {0, insn->x, insn->y, 0xF};
+  int all = insn->op == OP_Fx55 || insn->op == OP_Fx65;
+  for (u32 i = 0; i < (all ? 16 : 4); i++) {
+    u8 r = all ? i : regs[i];
+    chip8->V[r] = lockstep->V[r][lane];
+  }
+  chip8->I = lockstep->I[lane];
+  chip8->sp = lockstep->sp[lane];
+  chip8->delay_timer = lockstep->delay_timer[lane];
+  chip8->sound_timer = lockstep->sound_timer[lane];
+  chip8->opcode = opcode;
+  chip8->pc = lockstep->pc[lane] + 2;
+
+  insn->handler(chip8, insn);
+
+  for (u32 i = 0; i < (all ? 16 : 4); i++) {
+    u8 r = all ? i : regs[i];
+    lockstep->V[r][lane] = chip8->V[r];
+  }
+  lockstep->I[lane] = chip8->I;
+  lockstep->pc[lane] = chip8->pc;
+  lockstep->sp[lane] = chip8->sp;
+  lockstep->delay_timer[lane] = chip8->delay_timer;
+  lockstep->sound_timer[lane] = chip8->sound_timer;
+}
+
+// 2nnn, 00EE, Ex9E and ExA1 lane by lane, without copying the registers
+// around. The stack index wraps instead of running past the stack
+static void run_control(Chip8Lockstep *lockstep, u32 lanes, const Chip8Insn *insn) {
+  for (; lanes != 0; lanes &= lanes - 1) {
+    u32 lane = __builtin_ctz(lanes);
+    u16 pc = lockstep->pc[lane] + 2;
+    u8 value = lockstep->V[insn->x][lane];
+    switch (insn->op) {
+    case OP_2nnn:
+      lockstep->stack[lockstep->sp[lane]++ & 15][lane] = pc;
+      pc = insn->nnn;
+      break;
+    case OP_00EE:
+      pc = lockstep->stack[--lockstep->sp[lane] & 15][lane];
+      break;
+    case OP_Ex9E:
+      pc += value < KEYPAD_MAX && ((lockstep->keys[lane] >> value) & 1) ? 2 : 0;
+      break;
+    case OP_ExA1:
+      pc += value < KEYPAD_MAX && ((lockstep->keys[lane] >> value) & 1) ? 0 : 2;
+      break;
+    }
+    lockstep->pc[lane] = pc;
+  }
+}
+
+static int is_control(u8 op) {
+  return op == OP_2nnn || op == OP_00EE || op == OP_Ex9E || op == OP_ExA1;
+}
+
+// instructions that only touch the registers, which the kernels run for a
+// whole group. The rest (screen, stack, keypad, memory, random numbers)
+// goes lane by lane through run_control or run_scalar
+static int is_vector(u8 op) {
+  return (op >= OP_1nnn && op <= OP_Bnnn && op != OP_2nnn) || op == OP_Fx07 || op == OP_Fx15 || op == OP_Fx18 ||
+         op == OP_Fx1E || op == OP_Fx29;
+}
+
+/*********************************
+    kernels
+ *********************************/
+
+// the reference: every lane through the interpreter
+static void run_lanes(Chip8Lockstep *lockstep, u32 lanes, const Chip8Insn *insn) {
+  u16 opcode = fetch(&lockstep->chip8[__builtin_ctz(lanes)], lockstep->pc[__builtin_ctz(lanes)]);
+  for (; lanes != 0; lanes &= lanes - 1) {
+    run_scalar(lockstep, __builtin_ctz(lanes), opcode, insn);
+  }
+}
+
+static u32 match_pc_scalar(const u16 *pcs, u16 pc) {
+  u32 lanes = 0;
+  for (u32 lane = 0; lane < LOCKSTEP_LANES_MAX; lane++) {
+    lanes |= (u32)(pcs[lane] == pc) << lane;
+  }
+  return lanes;
+}
+
+#if LOCKSTEP_X86
+
+static int avx2_supported(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+static int avx512_supported(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+}
+
+// a byte of 0xFF for every lane set in `lanes`
+__attribute__((target("avx2"))) static inline __m256i lane_bytes(u32 lanes) {
+  const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, //
+                                          2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i bits = _mm256_set1_epi64x(0x8040201008040201ll);
+  __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32((int)lanes), spread);
+  return _mm256_cmpeq_epi8(_mm256_and_si256(bytes, bits), bits);
+}
+
+#define LOCKSTEP_ISA avx2
+#define LOCKSTEP_TARGET __attribute__((target("avx2")))
+#define LOCKSTEP_MASK __m256i
+#define LOCKSTEP_MAKE_MASK(lanes) lane_bytes(lanes)
+#define LOCKSTEP_SELECT8(mask, old, new) _mm256_blendv_epi8(old, new, mask)
+// half 0 is lanes 0-15, half 1 lanes 16-31
+#define LOCKSTEP_SELECT16(mask, half, old, new) \
+  _mm256_blendv_epi8(old, new, _mm256_cvtepi8_epi16(_mm256_extracti128_si256(mask, half)))
+#define LOCKSTEP_MATCH16(pcs, pc)                                                                         \
+  ((u32)_mm256_movemask_epi8(_mm256_permute4x64_epi64(                                                   \
+      _mm256_packs_epi16(_mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(pcs)), pc),             \
+                         _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)((pcs) + 16)), pc)), \
+      0xD8)))
+#include "lockstep_kernel.h"
+
+#define LOCKSTEP_ISA avx512
+#define LOCKSTEP_TARGET __attribute__((target("avx2,avx512f,avx512bw,avx512vl")))
+#define LOCKSTEP_MASK __mmask32
+#define LOCKSTEP_MAKE_MASK(lanes) ((__mmask32)(lanes))
+#define LOCKSTEP_SELECT8(mask, old, new) _mm256_mask_blend_epi8(mask, old, new)
+#define LOCKSTEP_SELECT16(mask, half, old, new) _mm256_mask_blend_epi16((__mmask16)((mask) >> 16 * (half)), old, new)
+#define LOCKSTEP_MATCH16(pcs, pc) \
+  ((u32)_mm512_cmpeq_epi16_mask(_mm512_loadu_si512(pcs), _mm512_broadcastw_epi16(_mm256_castsi256_si128(pc))))
+#include "lockstep_kernel.h"
+
+#endif
+
+const LockstepKernel lockstep_kernels[] = {
+    {"scalar", run_lanes, match_pc_scalar, NULL},
+#if LOCKSTEP_X86
+    {"avx2", run_avx2, match_pc_avx2, avx2_supported},
+    {"avx512", run_avx512, match_pc_avx512, avx512_supported},
+#endif
+};
+const u32 lockstep_kernel_count = sizeof(lockstep_kernels) / sizeof(lockstep_kernels[0]);
+
+int lockstep_kernel_supported(const LockstepKernel *kernel) {
+  return kernel->supported == NULL || kernel->supported();
+}
+
+const LockstepKernel *lockstep_kernel_best(void) {
+  for (u32 i = lockstep_kernel_count; i-- > 1;) {
+    if (lockstep_kernel_supported(&lockstep_kernels[i])) {
+      return &lockstep_kernels[i];
+    }
+  }
+  return &lockstep_kernels[0];
+}
+
+const LockstepKernel *lockstep_kernel_find(const char *name) {
+  for (u32 i = 0; i < lockstep_kernel_count; i++) {
+    if (strcmp(lockstep_kernels[i].name, name) == 0) {
+      return lockstep_kernel_supported(&lockstep_kernels[i]) ? &lockstep_kernels[i] : NULL;
+    }
+  }
+  return NULL;
+}
+
+/*********************************
+    lanes
+ *********************************/
+
+Chip8Lockstep *lockstep_create(u32 lanes, const u8 *image, u32 size, Chip8Quirks quirks, uint64_t seed,
+                               const LockstepKernel *kernel) {
+  if (lanes == 0 || lanes > LOCKSTEP_LANES_MAX || size > ROM_SIZE_MAX) {
+    printf("A lockstep group runs 1 to %d lanes of a ROM up to %d bytes\n", LOCKSTEP_LANES_MAX, ROM_SIZE_MAX);
+    return NULL;
+  }
+  Chip8Lockstep *lockstep = calloc(1, sizeof(Chip8Lockstep));
+  Chip8 *chip8 = calloc(lanes, sizeof(Chip8));
+  if (lockstep == NULL || chip8 == NULL) {
+    printf("Error allocating %u lockstep lanes\n", lanes);
+    free(lockstep);
+    free(chip8);
+    return NULL;
+  }
+  lockstep->count = lanes;
+  lockstep->active = lanes == 32 ? 0xFFFFFFFF : (1u << lanes) - 1;
+  lockstep->quirks = quirks;
+  lockstep->kernel = kernel != NULL ? kernel : lockstep_kernel_best();
+  lockstep->chip8 = chip8;
+
+  for (u32 lane = 0; lane < LOCKSTEP_LANES_MAX; lane++) {
+    lockstep->pc[lane] = lane < lanes ? START_ADDRESS : 0xFFFF; // never matches a real pc
+  }
+  for (u32 lane = 0; lane < lanes; lane++) {
+    init_chip8(&chip8[lane]);
+    seed_random(&chip8[lane], seed + lane);
+    load_rom_image(&chip8[lane], image, size);
+    set_quirks(&chip8[lane], quirks);
+    chip8[lane].on_code_write = lockstep_code_write;
+    chip8[lane].code_write_data = lockstep;
+  }
+  return lockstep;
+}
+
+void lockstep_destroy(Chip8Lockstep *lockstep) {
+  if (lockstep == NULL) {
+    return;
+  }
+  free(lockstep->chip8);
+  free(lockstep);
+}
+
+u32 lockstep_lanes(const Chip8Lockstep *lockstep) {
+  return lockstep->count;
+}
+
+void lockstep_set_keys(Chip8Lockstep *lockstep, u32 lane, u16 keys) {
+  lockstep->keys[lane] = keys;
+  set_keypad(&lockstep->chip8[lane], keys); // for Fx0A
+}
+
+void lockstep_run(Chip8Lockstep *lockstep, u32 n) {
+  const LockstepKernel *kernel = lockstep->kernel;
+  LockstepStats *stats = &lockstep->stats;
+  for (u32 i = 0; i < n; i++) {
+    // the first lane not run yet and every other lane at its pc, until all
+    // lanes made their step. Lanes that stay together cost one group
+    u32 pending = lockstep->active;
+    while (pending != 0) {
+      u32 lane = __builtin_ctz(pending);
+      u16 pc = lockstep->pc[lane];
+      u16 opcode = fetch(&lockstep->chip8[lane], pc);
+      u32 group = kernel->match_pc(lockstep->pc, pc) & pending;
+      if (is_written(lockstep, pc & ADDRESS_MASK) || is_written(lockstep, (pc + 1) & ADDRESS_MASK)) {
+        // the lanes' code may differ here
+        for (u32 other = group & (group - 1); other != 0; other &= other - 1) {
+          u32 l = __builtin_ctz(other);
+          if (fetch(&lockstep->chip8[l], pc) != opcode) {
+            group &= ~(1u << l);
+          }
+        }
+      }
+      pending &= ~group;
+      stats->groups++;
+
+      Chip8Insn insn;
+      decode_insn(&lockstep->chip8[lane], &insn, opcode);
+      u32 lanes = __builtin_popcount(group);
+      if (is_vector(insn.op) && lanes > 1) {
+        kernel->run(lockstep, group, &insn);
+        stats->vector_groups++;
+        stats->vector += lanes;
+      } else if (is_control(insn.op)) {
+        run_control(lockstep, group, &insn);
+        stats->scalar += lanes;
+      } else {
+        run_lanes(lockstep, group, &insn);
+        stats->scalar += lanes;
+      }
+    }
+  }
+}
+
+void lockstep_run_frame(Chip8Lockstep *lockstep, u32 n) {
+  lockstep_run(lockstep, n);
+  for (u32 lane = 0; lane < LOCKSTEP_LANES_MAX; lane++) {
+    lockstep->delay_timer[lane] -= lockstep->delay_timer[lane] > 0;
+    lockstep->sound_timer[lane] -= lockstep->sound_timer[lane] > 0;
+  }
+}
+
+const Chip8 *lockstep_lane(Chip8Lockstep *lockstep, u32 lane) {
+  return load_lane(lockstep, lane);
+}
+
+const LockstepStats *lockstep_stats(const Chip8Lockstep *lockstep) {
+  return &lockstep->stats;
+}
@@ -0,0 +1,73 @@
+#ifndef CHIP8_LOCKSTEP_H
+#define CHIP8_LOCKSTEP_H
+
+#include "chip8.h"
+
+/*********************************
+    Lockstep interpreter
+
+    Runs up to LOCKSTEP_LANES_MAX instances of the same ROM side by side,
+    e.g. one per input sequence of a search or a reinforcement learning
+    environment. The registers of all lanes are kept structure of arrays
+    (V[r][lane], I[lane], pc[lane], ...), so an instruction that several
+    lanes are at is executed for all of them with a few vector operations.
+
+    Every step groups the lanes by pc. Instructions that only work on
+    registers (the ALU ones 6xkk, 7xkk, 8xy0-8xyE, Annn, Fx1E, the jumps and
+    skips, timers and Fx29) run through a SIMD kernel with the lanes of the
+    group as mask. Everything else, and every lane that went its own way,
+    goes through the interpreter's handlers on the lane's Chip8. Memory,
+    stack, screen and keypad stay in that Chip8, only the registers live in
+    here.
+
+    There is a scalar kernel that runs everywhere and AVX2/AVX-512 kernels
+    on x86 hosts built with gcc or clang, picked like the ones in expand.h.
+ *********************************/
+
+#define LOCKSTEP_LANES_MAX 32
+
+typedef struct Chip8Lockstep Chip8Lockstep;
+
+typedef struct LockstepKernel {
+  const char *name;
+  // runs insn for the lanes set in `lanes`, all of them at the same pc
+  void (*run)(Chip8Lockstep *lockstep, u32 lanes, const struct Chip8Insn *insn);
+  // lanes whose pc is `pc`
+  u32 (*match_pc)(const u16 *pcs, u16 pc);
+  int (*supported)(void); // NULL if the kernel runs everywhere
+} LockstepKernel;
+
+// slowest first, lockstep_kernels[0] is the scalar reference
+extern const LockstepKernel lockstep_kernels[];
+extern const u32 lockstep_kernel_count;
+
+int lockstep_kernel_supported(const LockstepKernel *kernel);
+// fastest kernel this CPU supports, never NULL
+const LockstepKernel *lockstep_kernel_best(void);
+// kernel by name if this CPU supports it, NULL otherwise
+const LockstepKernel *lockstep_kernel_find(const char *name);
+
+typedef struct LockstepStats {
+  uint64_t groups;        // lanes sharing a pc, executed together
+  uint64_t vector_groups; // of those, the ones run by the kernel
+  uint64_t vector;        // instructions (lanes x groups) run by the kernel
+  uint64_t scalar;        // instructions run by the interpreter instead
+} LockstepStats;
+
+// `lanes` copies of the ROM image with the given quirk profile, lane i
+// seeded with seed + i. kernel NULL picks lockstep_kernel_best
+Chip8Lockstep *lockstep_create(u32 lanes, const u8 *image, u32 size, Chip8Quirks quirks, uint64_t seed,
+                               const LockstepKernel *kernel);
+void lockstep_destroy(Chip8Lockstep *lockstep);
+u32 lockstep_lanes(const Chip8Lockstep *lockstep);
+void lockstep_set_keys(Chip8Lockstep *lockstep, u32 lane, u16 keys);
+// runs n instructions on every lane
+void lockstep_run(Chip8Lockstep *lockstep, u32 n);
+// one 60Hz frame: n instructions on every lane, then the timers tick
+void lockstep_run_frame(Chip8Lockstep *lockstep, u32 n);
+// the lane's machine with its registers brought up to date, valid until the
+// next lockstep_run
+const Chip8 *lockstep_lane(Chip8Lockstep *lockstep, u32 lane);
+const LockstepStats *lockstep_stats(const Chip8Lockstep *lockstep);
+
+#endif
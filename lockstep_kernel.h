@@ -0,0 +1,201 @@
+/*********************************
+    SIMD lockstep kernel
+
+    Not a normal header: lockstep.c includes it once per instruction set
+    with LOCKSTEP_ISA set to its name and the LOCKSTEP_* macros defined, the
+    same way expand_kernel.h is expanded.
+
+    One vector holds a register (or timer) of all 32 lanes, I and pc take
+    two of 16 lanes each. An instruction is computed for every lane and
+    written back only to the lanes of the group, through a byte mask (AVX2)
+    or a mask register (AVX-512). VF is loaded again after Vx is stored, so
+    x = F ends up with the flag like in the interpreter. Skips and Bnnn
+    leave the lanes of a group at different addresses, the next step then
+    splits them into groups of their own.
+ *********************************/
+
+#ifndef LOCKSTEP_ISA
+#error "define LOCKSTEP_ISA before including lockstep_kernel.h"
+#endif
+
+#define LOCKSTEP_CAT_(a, b) a##_##b
+#define LOCKSTEP_CAT(a, b) LOCKSTEP_CAT_(a, b)
+#define LOCKSTEP_FN(name) LOCKSTEP_CAT(name, LOCKSTEP_ISA)
+
+#define LOCKSTEP_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define LOCKSTEP_STORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+// bytes of lanes 0-15 (half 0) or 16-31 (half 1) zero extended to 16 bits
+#define LOCKSTEP_WIDEN(v, half) \
+  _mm256_cvtepu8_epi16((half) ? _mm256_extracti128_si256(v, 1) : _mm256_castsi256_si128(v))
+
+static LOCKSTEP_TARGET u32 LOCKSTEP_FN(match_pc)(const u16 *pcs, u16 pc) {
+  __m256i value = _mm256_set1_epi16((short)pc);
+  return LOCKSTEP_MATCH16(pcs, value);
+}
+
+static LOCKSTEP_TARGET void LOCKSTEP_FN(run)(Chip8Lockstep *lockstep, u32 lanes, const Chip8Insn *insn) {
+  LOCKSTEP_MASK mask = LOCKSTEP_MAKE_MASK(lanes);
+  const Chip8QuirkFlags *quirks = &quirk_flags[lockstep->quirks];
+  u8 *vx = lockstep->V[insn->x];
+  u8 *vf = lockstep->V[0xF];
+  u16 *I = lockstep->I;
+  u16 *pc = lockstep->pc;
+  const __m256i one = _mm256_set1_epi8(1);
+
+  __m256i old = LOCKSTEP_LOAD(vx);
+  __m256i a = old;
+  __m256i b = LOCKSTEP_LOAD(lockstep->V[insn->y]);
+  __m256i result = a;
+  __m256i flag = _mm256_setzero_si256();
+  int sets_flag = 0;
+  // where the lanes continue: after the instruction, past the next one for
+  // the lanes in `skip`, or the jump target
+  __m256i pc_low = LOCKSTEP_LOAD(pc);
+  __m256i pc_high = LOCKSTEP_LOAD(pc + 16);
+  __m256i next_low = _mm256_add_epi16(pc_low, _mm256_set1_epi16(2));
+  __m256i next_high = _mm256_add_epi16(pc_high, _mm256_set1_epi16(2));
+  __m256i skip = _mm256_setzero_si256();
+
+  switch (insn->op) {
+  case OP_1nnn:
+    next_low = next_high = _mm256_set1_epi16((short)insn->nnn);
+    break;
+  case OP_3xkk:
+  case OP_4xkk:
+    skip = _mm256_cmpeq_epi8(a, _mm256_set1_epi8((char)insn->kk));
+    if (insn->op == OP_4xkk) {
+      skip = _mm256_xor_si256(skip, _mm256_set1_epi8(-1));
+    }
+    break;
+  case OP_5xy0:
+  case OP_9xy0:
+    skip = _mm256_cmpeq_epi8(a, b);
+    if (insn->op == OP_9xy0) {
+      skip = _mm256_xor_si256(skip, _mm256_set1_epi8(-1));
+    }
+    break;
+  case OP_6xkk:
+    result = _mm256_set1_epi8((char)insn->kk);
+    break;
+  case OP_7xkk:
+    result = _mm256_add_epi8(a, _mm256_set1_epi8((char)insn->kk));
+    break;
+  case OP_8xy0:
+    result = b;
+    break;
+  case OP_8xy1:
+    result = _mm256_or_si256(a, b);
+    sets_flag = quirks->vf_reset;
+    break;
+  case OP_8xy2:
+    result = _mm256_and_si256(a, b);
+    sets_flag = quirks->vf_reset;
+    break;
+  case OP_8xy3:
+    result = _mm256_xor_si256(a, b);
+    sets_flag = quirks->vf_reset;
+    break;
+  case OP_8xy4:
+    // carried out iff the sum wrapped below a
+    result = _mm256_add_epi8(a, b);
+    flag = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(result, a), result), one);
+    sets_flag = 1;
+    break;
+  case OP_8xy5:
+  case OP_8xy7:
+    // the interpreter compares against Vy after Vx was written, which only
+    // matters for x = y
+    result = insn->op == OP_8xy5 ? _mm256_sub_epi8(a, b) : _mm256_sub_epi8(b, a);
+    if (insn->x == insn->y) {
+      b = result;
+    }
+    flag = insn->op == OP_8xy5 ? _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a)  // a >= b
+                               : _mm256_cmpeq_epi8(_mm256_min_epu8(a, b), a); // a <= b
+    flag = _mm256_and_si256(flag, one);
+    sets_flag = 1;
+    break;
+  case OP_8xy6:
+    if (quirks->shift_vy) {
+      a = b;
+    }
+    flag = _mm256_and_si256(a, one);
+    result = _mm256_and_si256(_mm256_srli_epi16(a, 1), _mm256_set1_epi8(0x7F));
+    sets_flag = 1;
+    break;
+  case OP_8xyE:
+    if (quirks->shift_vy) {
+      a = b;
+    }
+    flag = _mm256_and_si256(_mm256_srli_epi16(a, 7), one);
+    result = _mm256_add_epi8(a, a);
+    sets_flag = 1;
+    break;
+  case OP_Annn: {
+    __m256i nnn = _mm256_set1_epi16((short)insn->nnn);
+    LOCKSTEP_STORE(I, LOCKSTEP_SELECT16(mask, 0, LOCKSTEP_LOAD(I), nnn));
+    LOCKSTEP_STORE(I + 16, LOCKSTEP_SELECT16(mask, 1, LOCKSTEP_LOAD(I + 16), nnn));
+    break;
+  }
+  case OP_Bnnn: {
+    __m256i offset = quirks->jump_vx ? a : LOCKSTEP_LOAD(lockstep->V[0]);
+    __m256i nnn = _mm256_set1_epi16((short)insn->nnn);
+    next_low = _mm256_add_epi16(nnn, LOCKSTEP_WIDEN(offset, 0));
+    next_high = _mm256_add_epi16(nnn, LOCKSTEP_WIDEN(offset, 1));
+    break;
+  }
+  case OP_Fx07:
+    result = LOCKSTEP_LOAD(lockstep->delay_timer);
+    break;
+  case OP_Fx15:
+  case OP_Fx18: {
+    u8 *timer = insn->op == OP_Fx15 ? lockstep->delay_timer : lockstep->sound_timer;
+    LOCKSTEP_STORE(timer, LOCKSTEP_SELECT8(mask, LOCKSTEP_LOAD(timer), a));
+    break;
+  }
+  case OP_Fx1E:
+  case OP_Fx29: {
+    __m256i low = LOCKSTEP_LOAD(I);
+    __m256i high = LOCKSTEP_LOAD(I + 16);
+    __m256i low_value = LOCKSTEP_WIDEN(a, 0);
+    __m256i high_value = LOCKSTEP_WIDEN(a, 1);
+    if (insn->op == OP_Fx1E) {
+      const __m256i address_mask = _mm256_set1_epi16(ADDRESS_MASK);
+      low_value = _mm256_and_si256(_mm256_add_epi16(low, low_value), address_mask);
+      high_value = _mm256_and_si256(_mm256_add_epi16(high, high_value), address_mask);
+    } else {
+      const __m256i font = _mm256_set1_epi16(FONTSET_START_ADDRESS);
+      const __m256i five = _mm256_set1_epi16(5);
+      low_value = _mm256_add_epi16(font, _mm256_mullo_epi16(low_value, five));
+      high_value = _mm256_add_epi16(font, _mm256_mullo_epi16(high_value, five));
+    }
+    LOCKSTEP_STORE(I, LOCKSTEP_SELECT16(mask, 0, low, low_value));
+    LOCKSTEP_STORE(I + 16, LOCKSTEP_SELECT16(mask, 1, high, high_value));
+    break;
+  }
+  }
+
+  LOCKSTEP_STORE(vx, LOCKSTEP_SELECT8(mask, old, result));
+  if (sets_flag) {
+    LOCKSTEP_STORE(vf, LOCKSTEP_SELECT8(mask, LOCKSTEP_LOAD(vf), flag));
+  }
+  const __m256i two = _mm256_set1_epi16(2);
+  next_low = _mm256_add_epi16(next_low, _mm256_and_si256(_mm256_cvtepi8_epi16(_mm256_castsi256_si128(skip)), two));
+  next_high =
+      _mm256_add_epi16(next_high, _mm256_and_si256(_mm256_cvtepi8_epi16(_mm256_extracti128_si256(skip, 1)), two));
+  LOCKSTEP_STORE(pc, LOCKSTEP_SELECT16(mask, 0, pc_low, next_low));
+  LOCKSTEP_STORE(pc + 16, LOCKSTEP_SELECT16(mask, 1, pc_high, next_high));
+}
+
+#undef LOCKSTEP_CAT_
+#undef LOCKSTEP_CAT
+#undef LOCKSTEP_FN
+#undef LOCKSTEP_LOAD
+#undef LOCKSTEP_STORE
+#undef LOCKSTEP_WIDEN
+#undef LOCKSTEP_ISA
+#undef LOCKSTEP_TARGET
+#undef LOCKSTEP_MASK
+#undef LOCKSTEP_MAKE_MASK
+#undef LOCKSTEP_SELECT8
+#undef LOCKSTEP_SELECT16
+#undef LOCKSTEP_MATCH16
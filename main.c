@@ -1,731 +1,297 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include "include/raylib.h"
-#include <errno.h>
-#include <stdint.h>
+#include "chip8.h"
+#include "emu_thread.h"
+#include "expand.h"
+#include "savestate.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-// Following the Tutorial https://austinmorlan.com/posts/chip8_emulator/
-
-/*******************************
-    Chip8 general memory layout
-
-    0x000-0x1FF -> Chip8 interpreter (contains font set in emu)
-    0x050-0x0A0 -> Used for the built in 4x5 pixel font set (0-F)
-    0x200-0xFFF -> Program ROM and free RAM
- ********************************/
 
 #define CELL_SIZE 10
+#define FRAME_RATE 60
 
-#define u8 uint8_t
-#define u16 uint16_t
-#define u32 uint32_t
-
-#define START_ADDRESS 0x200 // 0x200 needs 12 bits to be displayed 512 in base 10
-#define FONTSET_START_ADDRESS 0x50
-#define FONTSET_SIZE 80
-
-#define SCREEN_WIDTH 64
-#define SCREEN_HEIGHT 32
-#define KEYPAD_MAX 16
-
-typedef struct Chip8 {
-  u8 V[16];        // general purpose registers rangig from V1 to VE
-  u8 memory[4096]; // 4K RAM
-  u16 I;           // index register
-  u16 pc;          // program counter
-  u16 stack[16];   // stack for storing instructions
-  u8 sp;           // stack pointer
-  u8 delay_timer;
-  u8 sound_timer;
-  u8 keypad[KEYPAD_MAX];
-  u32 video[SCREEN_HEIGHT][SCREEN_WIDTH]; // video display array 32 high and 64 wide
-  u16 opcode;                             // opcodes each 2 bytes long
-} Chip8;
-
-// Font each character consists of 5 bytes, example of letter "F":
-/************
-  11110000
-  10000000
-  11110000
-  10000000
-  10000000
-*************/
-// With 16 characters each 5 bytes big we need 16*5 = 80 bytes of storage for all characters
-u8 fontset[FONTSET_SIZE] =
-    {
-        0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-        0x20, 0x60, 0x20, 0x20, 0x70, // 1
-        0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-        0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-        0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-        0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-        0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-        0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-        0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-        0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-        0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-        0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-        0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-        0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-        0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-        0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-};
+/*********************************
+    16 key-layout on normal keyboard
 
-// loads rom
-// returns 0 if the loading of the file has failed
-// returns 1 if the file was loaded successfully
-int load_rom(Chip8 *chip8, const char *file_name) {
-  FILE *rom_file = fopen(file_name, "rb");
-  if (rom_file == NULL) {
-    printf("Error opening the ROM, errno: %d\n", errno);
-    return -1;
-  }
-  // read file size
-  fseek(rom_file, 0, SEEK_END);
-  u32 file_size = ftell(rom_file);
-  rewind(rom_file);
-  printf("File size of `%s` is: %d\n", file_name, file_size);
-  if (file_size < 0) {
-    printf("File size is 0, errno: %d\n", errno);
-    fclose(rom_file);
-    return -1;
-  }
+    Keypad       Keyboard
+    +-+-+-+-+    +-+-+-+-+
+    |1|2|3|C|    |1|2|3|4|
+    +-+-+-+-+    +-+-+-+-+
+    |4|5|6|D|    |Q|W|E|R|
+    +-+-+-+-+ => +-+-+-+-+
+    |7|8|9|E|    |A|S|D|F|
+    +-+-+-+-+    +-+-+-+-+
+    |A|0|B|F|    |Y|X|C|V|
+    +-+-+-+-+    +-+-+-+-+
+ *********************************/
 
-  // write the data from the file into the chip8 memory, starting at 0x200
-  fread(chip8->memory + START_ADDRESS, sizeof(u8), file_size, rom_file);
-  fclose(rom_file);
-  return 0;
-}
+static const int keymap[16] = {
+    KEY_X, KEY_ONE, KEY_TWO, KEY_THREE, // 0 1 2 3
+    KEY_Q, KEY_W,   KEY_E,   KEY_A,     // 4 5 6 7
+    KEY_S, KEY_D,   KEY_Y,   KEY_C,     // 8 9 A B
+    KEY_FOUR, KEY_R, KEY_F,  KEY_V,     // C D E F
+};
 
-void load_font(Chip8 *chip8, u8 fontset[]) {
-  for (size_t i = 0; i < FONTSET_SIZE; i++) {
-    chip8->memory[FONTSET_START_ADDRESS + i] = fontset[i];
+// the keypad as a bitmask for emu_set_keys, bit k for key k
+u16 readKeypad(void) {
+  u16 keys = 0;
+  for (int k = 0; k < 16; k++) {
+    keys |= (u16)IsKeyDown(keymap[k]) << k;
   }
+  return keys;
 }
 
-int random_byte() {
-  int num = rand() % 255 + 1;
-  return num;
-}
-
-void init_chip8(Chip8 *chip8) {
-  // init seed for random numbers
-  srand(time(0));
-  chip8->pc = START_ADDRESS;
-  load_font(chip8, fontset);
-}
 /*********************************
-all 34 instructions of the Chip8
-*********************************/
-
-// 00E0: Clear the display
-void op_00E0(Chip8 *chip8) {
-  memset(chip8->video, 0, sizeof(chip8->video));
-}
+    Render paths
+
+    texture: the framebuffer is expanded into a 64x32 RGBA texture by the
+             fastest kernel from expand.h and drawn once, scaled by
+             CELL_SIZE without filtering
+    rects:   one DrawRectangle per lit pixel into a render texture
+
+    Both draw the frames published by the emulation thread and only touch
+    the rows that differ from the previous frame taken, a frame without
+    any is skipped. Each path keeps its own rows still to draw, so
+    switching between them (F2) stays correct. F1 shows the time each path
+    spends per frame and how many frames were skipped.
+ *********************************/
 
-// 00EE: Return from a subroutine
-void op_00EE(Chip8 *chip8) {
-  chip8->sp--;
-  chip8->pc = chip8->stack[chip8->sp];
-}
+typedef enum RenderMode { RENDER_TEXTURE, RENDER_RECTS, RENDER_MODE_COUNT } RenderMode;
+static const char *render_mode_names[RENDER_MODE_COUNT] = {"texture", "rects"};
 
-// 1nnn: Jump to location nnn
-void op_1nnn(Chip8 *chip8) {
-  u16 nnn = chip8->opcode & 0x0FFF; // only look at the lowest 3 bytes the first one is the instruction
-  chip8->pc = nnn;
-}
+#define PIXEL_ON 0xFFFFFFFF  // white, RGBA in memory order
+#define PIXEL_OFF 0xFF000000 // black
 
-// 2nnn: Call subroutine at nnn
-void op_2nnn(Chip8 *chip8) {
-  u16 nnn = chip8->opcode & 0x0FFF;
-  chip8->stack[chip8->sp] = chip8->pc;
-  chip8->sp++;
-  chip8->pc = nnn;
-}
+typedef struct Screen {
+  uint64_t video[SCREEN_HEIGHT]; // of the newest frame taken
+  u32 pending[RENDER_MODE_COUNT]; // rows each path has not drawn yet
+  const ExpandKernel *expand;
+  u32 pixels[SCREEN_HEIGHT][SCREEN_WIDTH];
+  Texture2D texture;      // RENDER_TEXTURE, 1 texel per pixel
+  RenderTexture2D target; // RENDER_RECTS, CELL_SIZE pixels per pixel
+  u32 frames;
+  u32 skipped_frames; // frames where the screen did not change
+} Screen;
 
-// 3xkk: Skip next instruction if Vx = kk
-void op_3xkk(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 kk = chip8->opcode & 0x00FF;
-  if (chip8->V[x] == kk) {
-    chip8->pc += 2;
+void loadScreen(Screen *screen) {
+  // the texture starts out as garbage, draw everything once
+  for (int mode = 0; mode < RENDER_MODE_COUNT; mode++) {
+    screen->pending[mode] = 0xFFFFFFFF;
   }
+  screen->expand = expand_kernel_best();
+  Image image = {screen->pixels, SCREEN_WIDTH, SCREEN_HEIGHT, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+  screen->texture = LoadTextureFromImage(image);
+  SetTextureFilter(screen->texture, TEXTURE_FILTER_POINT);
+  screen->target = LoadRenderTexture(SCREEN_WIDTH * CELL_SIZE, SCREEN_HEIGHT * CELL_SIZE);
 }
 
-// 4xkk: Skip next instruction if Vx != kk
-void op_4xkk(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 kk = chip8->opcode & 0x00FF;
-  if (chip8->V[x] != kk) {
-    chip8->pc += 2;
-  }
+void unloadScreen(Screen *screen) {
+  UnloadTexture(screen->texture);
+  UnloadRenderTexture(screen->target);
 }
 
-// 5xy0: Skip next instruction if Vx = Vy
-void op_5xy0(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-  if (chip8->V[x] == chip8->V[y]) {
-    chip8->pc += 2;
+void takeFrame(Screen *screen, const EmuFrame *frame) {
+  u32 changed = emu_frame_diff(frame, screen->video);
+  memcpy(screen->video, frame->video, sizeof(screen->video));
+  for (int mode = 0; mode < RENDER_MODE_COUNT; mode++) {
+    screen->pending[mode] |= changed;
   }
 }
 
-// 6xkk: Set Register Vx = kk
-void op_6xkk(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8; //  x = 0x0A00 >> 8 = 0x0A = 10 otherwise 0x0A00 = 2560
-  u8 kk = chip8->opcode & 0x00FF;
-  chip8->V[x] = kk;
-}
-
-// 7xkk: Set Vx = Vx + kk
-void op_7xkk(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8; //  x = 0x0A00 >> 8 = 0x0A = 10 otherwise 0x0A00 = 2560
-  u8 kk = chip8->opcode & 0x00FF;
-  chip8->V[x] = chip8->V[x] + kk;
-}
-
-// 8xy0: Set Vx = Vy
-void op_8xy0(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-  chip8->V[x] = chip8->V[y];
-}
-
-// 8xy1: Set Vx = Vx OR Vy
-void op_8xy1(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-  chip8->V[x] |= chip8->V[y];
-  chip8->V[0xF] = 0;
-}
-
-// 8xy2: Set Vx = Vx AND Vy
-void op_8xy2(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-  chip8->V[x] &= chip8->V[y];
-  chip8->V[0xF] = 0;
-}
-
-// 8xy3: Set Vx = Vx XOR Vy
-void op_8xy3(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-  chip8->V[x] ^= chip8->V[y];
-  chip8->V[0xF] = 0;
-}
-
-// The values of Vx and Vy are added together. If the result is greater
-// than 8 bits (i.e., > 255,) VF is set to 1, otherwise 0. Only the lowest
-// 8 bits of the result are kept, and stored in Vx.
-// This is an ADD with an overflow flag. If the sum is greater than what can
-// fit into a byte (255), register VF will be set to 1 as a flag.
-// 8xy4: Set Vx = Vx + Vy, set VF = carry
-void op_8xy4(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-
-  u16 sum = (chip8->V[x] + chip8->V[y]);
-
-  chip8->V[x] = sum & 0xFF;
-
-  if (sum > 255) {
-    chip8->V[0xF] = 1;
-  } else {
-    chip8->V[0xF] = 0;
+// brings the texture of mode up to date, call outside of BeginDrawing
+// returns 0 if the screen did not change since the last call for mode
+int updateScreen(Screen *screen, RenderMode mode) {
+  screen->frames++;
+  u32 dirty = screen->pending[mode];
+  screen->pending[mode] = 0;
+  if (dirty == 0) {
+    screen->skipped_frames++;
+    return 0;
   }
-}
-
-// If Vx > Vy, then VF is set to 1, otherwise 0. Then Vy is subtracted from Vx,
-// and the results stored in Vx.
-// 8xy5: Set Vx = Vx - Vy, set VF = NOT borrow
-void op_8xy5(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-
-  u8 temp = chip8->V[x];
-  chip8->V[x] -= chip8->V[y];
-  if (temp >= chip8->V[y]) {
-    chip8->V[0xF] = 1;
-  } else {
-    chip8->V[0xF] = 0;
+  if (mode == RENDER_TEXTURE) {
+    screen->expand->expand(screen->video, dirty, &screen->pixels[0][0], SCREEN_WIDTH, 1, PIXEL_ON, PIXEL_OFF);
+    UpdateTexture(screen->texture, screen->pixels);
+    return 1;
   }
-}
-
-// If the least-significant bit of Vx is 1, then VF is set to 1, otherwise 0.
-// Then Vx is divided by 2.
-// A right shift is performed (division by 2), and the least significant bit is saved in Register VF.
-// 8xy6: Set Vx = Vx SHR 1
-void op_8xy6(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-
-  chip8->V[x] = chip8->V[y];
-  u8 lsb = chip8->V[x] & 0x0001;
-  chip8->V[x] >>= 1;
-  chip8->V[0xF] = lsb;
-}
 
-// If Vy > Vx, then VF is set to 1, otherwise 0.
-// Then Vx is subtracted from Vy, and the results stored in Vx.
-// 8xy7 Set Vx = Vy - Vx, set VF = NOT borrow
-void op_8xy7(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-
-  u8 temp = chip8->V[x];
-  chip8->V[x] = (chip8->V[y] - chip8->V[x]);
-  if (temp <= chip8->V[y]) {
-    chip8->V[0xF] = 1;
-  } else {
-    chip8->V[0xF] = 0;
+  BeginTextureMode(screen->target);
+  for (int i = 0; i < SCREEN_HEIGHT; i++) {
+    if (!(dirty & (1u << i))) {
+      continue;
+    }
+    DrawRectangle(0, i * CELL_SIZE, SCREEN_WIDTH * CELL_SIZE, CELL_SIZE, BLACK);
+    for (int j = 0; j < SCREEN_WIDTH; j++) {
+      if ((screen->video[i] >> (SCREEN_WIDTH - 1 - j)) & 1) {
+        DrawRectangle(j * CELL_SIZE, i * CELL_SIZE, CELL_SIZE, CELL_SIZE, WHITE);
+      }
+    }
   }
+  EndTextureMode();
+  return 1;
 }
 
-// If the most-significant bit of Vx is 1, then VF is set to 1, otherwise to 0.
-// Then Vx is multiplied by 2.
-// A left shift is performed (multiplication by 2), and the most significant bit
-// is saved in Register VF.
-// 8xyE: Set Vx = Vx SHL 1.
-void op_8xyE(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-
-  chip8->V[x] = chip8->V[y];
-
-  // msb: 1111 0000 >> 7 = 0000 00011
-  u8 msb = (chip8->V[x] & 0xF0) >> 7;
-  chip8->V[x] <<= 1;
-  chip8->V[0xF] = msb;
-}
-
-// 9xy0: Skip next instruction if Vx != Vy
-void op_9xy0(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-  if (chip8->V[x] != chip8->V[y]) {
-    chip8->pc += 2;
+void drawScreen(const Screen *screen, RenderMode mode) {
+  if (mode == RENDER_TEXTURE) {
+    DrawTexturePro(screen->texture, (Rectangle){0, 0, SCREEN_WIDTH, SCREEN_HEIGHT},
+                   (Rectangle){0, 0, SCREEN_WIDTH * CELL_SIZE, SCREEN_HEIGHT * CELL_SIZE},
+                   (Vector2){0, 0}, 0, WHITE);
+  } else {
+    // render textures are stored upside down
+    DrawTextureRec(screen->target.texture,
+                   (Rectangle){0, 0, SCREEN_WIDTH * CELL_SIZE, -SCREEN_HEIGHT * CELL_SIZE},
+                   (Vector2){0, 0}, WHITE);
   }
 }
 
-// Annn: Set I = nnn
-void op_Annn(Chip8 *chip8) {
-  u16 nnn = chip8->opcode & 0x0FFF;
-  chip8->I = nnn;
-}
-
-// Bnnn: Jump to location nnn + V0
-void op_Bnnn(Chip8 *chip8) {
-  u16 nnn = chip8->opcode & 0x0FFF;
-  chip8->pc = (nnn + chip8->V[0]);
-}
+/*********************************
+    Quick save
 
-// Cxkk: Set Vx = random byte AND kk
-void op_Cxkk(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 kk = (chip8->opcode & 0x00FF);
-  chip8->V[x] = (random_byte() & kk);
-}
+    F5 saves into the selected slot, F9 loads it back and F6/F7 select the
+    previous/next of QUICK_SLOTS slots. The emulation thread takes and
+    restores the snapshot between two ticks, then the save is also written
+    next to the ROM as <rom>.state<slot>. A slot that was not saved since
+    the start is loaded from that file.
+ *********************************/
 
-// We iterate over the sprite, row by row and column by column. We know there
-// are eight columns because a sprite is guaranteed to be eight pixels wide.
-
-// If a sprite pixel is on then there may be a collision with what’s already
-// being displayed, so we check if our screen pixel in the same location is set.
-// If so we must set the VF register to express collision.
-
-// Then we can just XOR the screen pixel with 0xFFFFFFFF to essentially XOR it
-// with the sprite pixel (which we now know is on). We can’t XOR directly because
-// the sprite pixel is either 1 or 0 while our video pixel is either 0x00000000 or 0xFFFFFFFF.
-// Dxyn: Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision
-void op_Dxyn(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 y = (chip8->opcode & 0x00F0) >> 4;
-  u8 n = (chip8->opcode & 0x000F);
-
-  u8 x_coord = chip8->V[x] % SCREEN_WIDTH;  // SCREEN_WIDTH is 64
-  u8 y_coord = chip8->V[y] % SCREEN_HEIGHT; // SCREEN_HEIGHT is 32
-
-  chip8->V[0xF] = 0;
-
-  for (u8 row = 0; row < n; row++) {
-    u8 sprite_byte = chip8->memory[chip8->I + row];
-
-    for (u8 col = 0; col < 8; col++) {
-      u8 sprite_pixel = sprite_byte & (0x80 >> col);
-      // u32 *screen_pixel = &chip8->video[((y_coord + row) * SCREEN_WIDTH) + (x_coord + col)];
-      u32 *screen_pixel = &chip8->video[y_coord + row][x_coord + col];
-
-      if (sprite_pixel) {
-        // check if screen_pixel is already on (set to 1)
-        if (*screen_pixel == 0xFFFFFFFF) {
-          chip8->V[0xF] = 1;
-        }
-
-        // XOR with sceen_pixel with sprite_pixel
-        // (NOTE): it is not directly XORed because of
-        // the difference in magnitude of both values
-        *screen_pixel ^= 0xFFFFFFFF;
-      }
+#define QUICK_SLOTS 10
+#define QUICK_MESSAGE_SECONDS 2.0
+
+typedef struct QuickSave {
+  const char *rom;
+  Chip8State slots[QUICK_SLOTS];
+  u32 saved; // slots holding a state of this session, bit n for slot n
+  int slot;  // selected
+  int saving;                // slot being saved by the emulation thread, -1 if none
+  int loading;               // slot being loaded, -1 if none
+  const Chip8State *mapped;  // the file being loaded, if not from memory
+  char message[64];
+  double message_until;
+} QuickSave;
+
+void initQuickSave(QuickSave *quick, const char *rom) {
+  memset(quick, 0, sizeof(*quick));
+  quick->rom = rom;
+  quick->saving = -1;
+  quick->loading = -1;
+}
+
+void quickMessage(QuickSave *quick, const char *message) {
+  snprintf(quick->message, sizeof(quick->message), "%s", message);
+  quick->message_until = GetTime() + QUICK_MESSAGE_SECONDS;
+}
+
+// picks up finished requests and starts new ones from the hotkeys
+void updateQuickSave(QuickSave *quick, Emu *emu) {
+  if (emu_busy(emu)) {
+    return;
+  }
+  int ok = emu_request_result(emu) == 0;
+  if (quick->saving >= 0) {
+    int slot = quick->saving;
+    quick->saving = -1;
+    if (!ok) {
+      quickMessage(quick, TextFormat("slot %d could not be saved", slot));
+    } else {
+      quick->saved |= 1u << slot;
+      ok = savestate_write(&quick->slots[slot], TextFormat("%s.state%d", quick->rom, slot)) == 0;
+      quickMessage(quick, TextFormat(ok ? "saved slot %d" : "saved slot %d, not written to disk", slot));
     }
   }
-}
-
-// Ex9E: Skip next instruction if key with value of Vx is pressed
-void op_Ex9E(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 value = chip8->V[x];
-
-  if (chip8->keypad[value]) {
-    chip8->pc += 2;
+  if (quick->loading >= 0) {
+    quickMessage(quick, TextFormat(ok ? "loaded slot %d" : "slot %d could not be loaded", quick->loading));
+    quick->loading = -1;
+    savestate_unmap(quick->mapped);
+    quick->mapped = NULL;
   }
-}
-
-// ExA1: Skip next instruction if key with the value of Vx is not pressed
-void op_ExA1(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 value = chip8->V[x];
 
-  if (!(chip8->keypad[value])) {
-    chip8->pc += 2;
+  if (IsKeyPressed(KEY_F6) || IsKeyPressed(KEY_F7)) {
+    quick->slot = (quick->slot + (IsKeyPressed(KEY_F6) ? QUICK_SLOTS - 1 : 1)) % QUICK_SLOTS;
+    quickMessage(quick, TextFormat("slot %d", quick->slot));
   }
-}
-
-// Fx07: Set Vx = delay timer value
-void op_Fx07(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  chip8->V[x] = chip8->delay_timer;
-}
-
-// Fx0A: Wait for a key press, store the value of the key in Vx
-void op_Fx0A(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  // TODO: add all remaining keypad
-  if (chip8->keypad[0]) {
-    chip8->V[x] = 0;
-  } else if (chip8->keypad[1]) {
-    chip8->V[x] = 1;
-  } else if (chip8->keypad[2]) {
-    chip8->V[x] = 2;
-  } else if (chip8->keypad[3]) {
-    chip8->V[x] = 3;
-  } else if (chip8->keypad[4]) {
-    chip8->V[x] = 4;
-  } else if (chip8->keypad[5]) {
-    chip8->V[x] = 5;
-  } else if (chip8->keypad[6]) {
-    chip8->V[x] = 6;
-  } else if (chip8->keypad[7]) {
-    chip8->V[x] = 7;
-  } else if (chip8->keypad[8]) {
-    chip8->V[x] = 8;
-  } else if (chip8->keypad[9]) {
-    chip8->V[x] = 9;
-  } else if (chip8->keypad[10]) {
-    chip8->V[x] = 10;
-  } else if (chip8->keypad[11]) {
-    chip8->V[x] = 11;
-  } else if (chip8->keypad[12]) {
-    chip8->V[x] = 12;
-  } else if (chip8->keypad[13]) {
-    chip8->V[x] = 13;
-  } else if (chip8->keypad[14]) {
-    chip8->V[x] = 14;
-  } else if (chip8->keypad[15]) {
-    chip8->V[x] = 15;
-  } else {
-    chip8->pc -= 2;
+  if (IsKeyPressed(KEY_F5) && emu_save(emu, &quick->slots[quick->slot]) == 0) {
+    quick->saving = quick->slot;
+  } else if (IsKeyPressed(KEY_F9)) {
+    const Chip8State *state = &quick->slots[quick->slot];
+    if (!(quick->saved & (1u << quick->slot))) {
+      state = quick->mapped = savestate_map(TextFormat("%s.state%d", quick->rom, quick->slot));
+    }
+    if (state == NULL) {
+      quickMessage(quick, TextFormat("slot %d is empty", quick->slot));
+    } else if (emu_load(emu, state) == 0) {
+      quick->loading = quick->slot;
+    } else {
+      quickMessage(quick, TextFormat("slot %d could not be loaded", quick->slot));
+      savestate_unmap(quick->mapped);
+      quick->mapped = NULL;
+    }
   }
 }
 
-// Fx15: Set delay timer = Vx
-void op_Fx15(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  chip8->delay_timer = chip8->V[x];
-}
-
-// Fx18: Set sound timer = Vx
-void op_Fx18(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  chip8->sound_timer = chip8->V[x];
-}
-
-// Fx1E: Set I = I + Vx
-void op_Fx1E(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  chip8->I = chip8->I + chip8->V[x];
-}
-
-// Fx29: Set I = location of sprite for digit Vx
-// Font characters are located at 0x50, each being five bytes long
-void op_Fx29(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  chip8->I = FONTSET_START_ADDRESS + (chip8->V[x] * 5);
-}
-
-// The interpreter takes the decimal value of Vx,
-// and places the hundreds digit in memory at location in I,
-// the tens digit at location I+1
-// and the ones digit at location I+2
-// Fx33: Store BCD representation of Vx in memory locations I, I+1, I+2
-void op_Fx33(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  u8 digit = chip8->V[x];
-
-  u8 digit_one = digit % 10;
-  digit /= 10;
-  u8 digit_ten = digit % 10;
-  digit /= 10;
-  u8 digit_hundred = digit % 10;
-
-  chip8->memory[chip8->I] = digit_hundred;
-  chip8->memory[chip8->I + 1] = digit_ten;
-  chip8->memory[chip8->I + 2] = digit_one;
-}
-
-// Fx55: Store registers V0 through Vx in memory starting at location I
-void op_Fx55(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  for (u8 i = 0; i <= x; ++i) {
-    chip8->memory[chip8->I + i] = chip8->V[i];
-  }
+int quickMessageShown(const QuickSave *quick) {
+  return GetTime() < quick->message_until;
 }
 
-// Fx65: Read registers V0 through Vx from meory starting at location I
-void op_Fx65(Chip8 *chip8) {
-  u8 x = (chip8->opcode & 0x0F00) >> 8;
-  for (u8 i = 0; i <= x; ++i) {
-    chip8->V[i] = chip8->memory[chip8->I + i];
-  }
+void drawQuickMessage(const QuickSave *quick) {
+  int width = MeasureText(quick->message, 20);
+  int y = SCREEN_HEIGHT * CELL_SIZE - 28;
+  DrawRectangle(0, y, width + 16, 28, Fade(DARKGRAY, 0.8f));
+  DrawText(quick->message, 8, y + 4, 20, WHITE);
 }
 
-// Fetch, Decode and Exectue instruction
-// inspired by: https://github.com/jborza/emuchip8/blob/master/cpu.c
-void process_instruction(Chip8 *chip8) {
-
-  /* Fetch */
-
-  // Catch first byte and second byte separatly because memory is u8
-  // but an instruction consists of 2 bytes
-  chip8->opcode = (chip8->memory[chip8->pc]);
-  chip8->opcode <<= 8;
-  chip8->opcode |= (chip8->memory[chip8->pc + 1]);
-  chip8->pc += 2;
-
-  /* Decode & Execute */
-
-  // an opcode consists of 4 bytes with the following encoding
-  // examples: [0xVxy0], [0xVnnn], [0xV00n], etc.
-
-  // u8 x = (chip8->opcode & 0x0F00) >> 8;
-  // u8 y = (chip8->opcode & 0x00F0) >> 4;
-  // u16 nnn = (chip8->opcode & 0x0FFF);
-  // u8 nn = (chip8->opcode & 0x00FF);
-  // u8 n = (chip8->opcode & 0x000F);
-
-  // switch to distinguish between the first bit ranging
-  // from 0 - F (16)
-  switch (chip8->opcode & 0xF000) {
-  case (0x0000): {
-    // lookup the last two bytes
-    switch (chip8->opcode & 0x00FF) {
-    case 0x00E0:
-      op_00E0(chip8);
-      break;
-    case 0x00EE:
-      op_00EE(chip8);
-      break;
-    }
-    break;
-  }
-  case (0x1000): {
-    op_1nnn(chip8);
-    break;
-  }
-  case (0x2000): {
-    op_2nnn(chip8);
-    break;
-  }
-  case (0x3000): {
-    op_3xkk(chip8);
-    break;
-  }
-  case (0x4000): {
-    op_4xkk(chip8);
-    break;
-  }
-  case (0x5000): {
-    op_5xy0(chip8);
-    break;
-  }
-  case (0x6000): {
-    op_6xkk(chip8);
-    break;
-  }
-  case (0x7000): {
-    op_7xkk(chip8);
-    break;
-  }
-  case (0x8000): {
-    switch (chip8->opcode & 0x000F) {
-    case (0x0000): {
-      op_8xy0(chip8);
-      break;
-    }
-    case (0x0001): {
-      op_8xy1(chip8);
-      break;
-    }
-    case (0x0002): {
-      op_8xy2(chip8);
-      break;
-    }
-    case (0x0003): {
-      op_8xy3(chip8);
-      break;
-    }
-    case (0x0004): {
-      op_8xy4(chip8);
-      break;
-    }
-    case (0x0005): {
-      op_8xy5(chip8);
-      break;
-    }
-    case (0x0006): {
-      op_8xy6(chip8);
-      break;
-    }
-    case (0x0007): {
-      op_8xy7(chip8);
-      break;
-    }
-    case (0x000E): {
-      op_8xyE(chip8);
-      break;
-    }
-    }
-    break;
-  }
-  case (0x9000): {
-    op_9xy0(chip8);
-    break;
-  }
-  case (0xA000): {
-    op_Annn(chip8);
-    break;
-  }
-  case (0xB000): {
-    op_Bnnn(chip8);
-    break;
-  }
-  case (0xC000): {
-    op_Cxkk(chip8);
-    break;
-  }
-  case (0xD000): {
-    op_Dxyn(chip8);
-    break;
-  }
-  case (0xE000): {
-    switch (chip8->opcode & 0x00FF) {
-    case (0x009E): {
-      op_Ex9E(chip8);
-      break;
-    }
-    case (0x00A1): {
-      op_ExA1(chip8);
-      break;
-    }
-    }
-    break;
-  }
-  case (0xF000): {
-    switch (chip8->opcode & 0x00FF) {
-    case (0x0007): {
-      op_Fx07(chip8);
-      break;
-    }
-    case (0x000A): {
-      op_Fx0A(chip8);
-      break;
-    }
-    case (0x0015): {
-      op_Fx15(chip8);
-      break;
-    }
-    case (0x0018): {
-      op_Fx18(chip8);
-      break;
-    }
-    case (0x001E): {
-      op_Fx1E(chip8);
-      break;
-    }
-    case (0x0029): {
-      op_Fx29(chip8);
-      break;
-    }
-    case (0x0033): {
-      op_Fx33(chip8);
-      break;
-    }
-    case (0x0055): {
-      op_Fx55(chip8);
-      break;
-    }
-    case (0x0065): {
-      op_Fx65(chip8);
-      break;
-    }
-    }
-    break;
-  }
-  default: {
-    printf("unknown opcode [0x0000]: 0x%X\n", chip8->opcode);
+#ifdef CHIP8_CUSTOM_FRAME_CONTROL
+// raylib built with SUPPORT_CUSTOM_FRAME_CONTROL leaves swapping, input
+// polling and frame pacing to the caller, so unchanged frames skip the
+// redraw and the swap entirely instead of presenting the same image again
+void endFrame(int present, double next_frame) {
+  if (present) {
+    SwapScreenBuffer();
   }
+  PollInputEvents();
+  double wait = next_frame - GetTime();
+  if (wait > 0) {
+    WaitTime(wait);
   }
 }
+#endif
 
 /*********************************
-    16 key-layout on normal keyboard
+    usage: chip8 [--ips n] [--turbo]
 
-    Keypad       Keyboard
-    +-+-+-+-+    +-+-+-+-+
-    |1|2|3|C|    |1|2|3|4|
-    +-+-+-+-+    +-+-+-+-+
-    |4|5|6|D|    |Q|W|E|R|
-    +-+-+-+-+ => +-+-+-+-+
-    |7|8|9|E|    |A|S|D|F|
-    +-+-+-+-+    +-+-+-+-+
-    |A|0|B|F|    |Y|X|C|V|
-    +-+-+-+-+    +-+-+-+-+
+    --ips n   instructions per second, 700 by default
+    --turbo   start in turbo mode, F3 toggles it
+
+    F1 stats, F2 render path, F3 turbo, F5/F9 quick save/load, F6/F7 slot,
+    hold backspace to rewind
  *********************************/
 
-void handleInput(Chip8 *chip8) {
-  chip8->keypad[0x0] = IsKeyDown(KEY_X);
-  chip8->keypad[0x1] = IsKeyDown(KEY_ONE);
-  chip8->keypad[0x2] = IsKeyDown(KEY_TWO);
-  chip8->keypad[0x3] = IsKeyDown(KEY_THREE);
-  chip8->keypad[0x4] = IsKeyDown(KEY_Q);
-  chip8->keypad[0x5] = IsKeyDown(KEY_W);
-  chip8->keypad[0x6] = IsKeyDown(KEY_E);
-  chip8->keypad[0x7] = IsKeyDown(KEY_A);
-  chip8->keypad[0x8] = IsKeyDown(KEY_S);
-  chip8->keypad[0x9] = IsKeyDown(KEY_D);
-  chip8->keypad[0xA] = IsKeyDown(KEY_Y);
-  chip8->keypad[0xB] = IsKeyDown(KEY_C);
-  chip8->keypad[0xC] = IsKeyDown(KEY_FOUR);
-  chip8->keypad[0xD] = IsKeyDown(KEY_R);
-  chip8->keypad[0xE] = IsKeyDown(KEY_F);
-  chip8->keypad[0xF] = IsKeyDown(KEY_V);
+int usage(const char *name) {
+  printf("usage: %s [--ips n] [--turbo]\n", name);
+  return 1;
 }
+
 int main(int argc, char **argv) {
+  u32 ips = SCHED_DEFAULT_IPS;
+  int turbo = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+      char *end;
+      ips = strtoul(argv[++i], &end, 10);
+      if (ips == 0 || *end != '\0') {
+        return usage(argv[0]);
+      }
+    } else if (strcmp(argv[i], "--turbo") == 0) {
+      turbo = 1;
+    } else {
+      return usage(argv[0]);
+    }
+  }
 
   Chip8 chip8 = {0};
   init_chip8(&chip8);
+  seed_random(&chip8, time(NULL));
+  enable_decode_cache(&chip8);
 
         /* ROMS */
   // load_rom(&chip8, "IBM.ch8");
@@ -735,40 +301,136 @@ int main(int argc, char **argv) {
   // load_rom(&chip8, "5-quirks.ch8");
   // load_rom(&chip8, "6-keypad.ch8");
   // load_rom(&chip8, "Space.ch8");
-  load_rom(&chip8, "binding.ch8");
+  const char *rom = "binding.ch8";
+  load_rom(&chip8, rom);
 
 
-  double last_instruction_time = GetTime();
   InitWindow(SCREEN_WIDTH * CELL_SIZE, SCREEN_HEIGHT * CELL_SIZE, "CHIP8 Emulator");
-  SetTargetFPS(60);
+  SetTargetFPS(FRAME_RATE);
+
+  static Screen screen;
+  loadScreen(&screen);
+  RenderMode render_mode = RENDER_TEXTURE;
+  // milliseconds per frame spent rendering, averaged for each path
+  double render_ms[RENDER_MODE_COUNT] = {0};
+  int show_stats = 0;
+  static QuickSave quick;
+  initQuickSave(&quick, rom);
+
+  // from here on chip8 belongs to the emulation thread
+  static Emu emu;
+  if (emu_start(&emu, &chip8, ips) != 0) {
+    CloseWindow();
+    return 1;
+  }
+  emu_set_turbo(&emu, turbo);
+  EmuFrame latest = {0}; // stats of the newest frame, for the overlay
+  // emulated instructions per second, measured over the last half second
+  EmuFrame rate_start = {0};
+  double emulated_ips = 0;
+  EmuJitter render_jitter = {0};
+  double next_frame = GetTime() + 1.0 / FRAME_RATE;
   while (!WindowShouldClose()) {
 
+    // how late this frame started, vsync and the frame limiter included
+    // more than a frame behind starts a new schedule instead of catching up
     double now = GetTime();
-    handleInput(&chip8);
-
-    // update instructions with 700Hz
-    double instruction_interval = 1.0 / 700;
-    int test = 0;
-    while((now - last_instruction_time) >= instruction_interval){
-      process_instruction(&chip8);
-      last_instruction_time += instruction_interval;
-      test++;
-    }
+    emu_jitter_add(&render_jitter, now > next_frame ? now - next_frame : 0);
+    next_frame = (now > next_frame + 1.0 / FRAME_RATE ? now : next_frame) + 1.0 / FRAME_RATE;
 
-    // update timers with 60Hz
-    if(chip8.delay_timer > 0)chip8.delay_timer --;
-    if(chip8.sound_timer > 0)chip8.sound_timer --;
+    emu_set_keys(&emu, readKeypad());
+    if (IsKeyPressed(KEY_F1)) {
+      show_stats = !show_stats;
+    }
+    if (IsKeyPressed(KEY_F2)) {
+      render_mode = (render_mode + 1) % RENDER_MODE_COUNT;
+    }
+    if (IsKeyPressed(KEY_F3)) {
+      turbo = !turbo;
+      emu_set_turbo(&emu, turbo);
+    }
+    updateQuickSave(&quick, &emu);
+    emu_set_rewind(&emu, IsKeyDown(KEY_BACKSPACE));
+
+    const EmuFrame *frame = emu_take_frame(&emu);
+    if (frame != NULL) {
+      takeFrame(&screen, frame);
+      latest = *frame;
+      if (latest.time - rate_start.time >= 0.5) {
+        emulated_ips = (latest.instructions - rate_start.instructions) / (latest.time - rate_start.time);
+        rate_start = latest;
+      }
+    }
 
+    // EndDrawing waits for the next frame, so it is left out of the timing
+    double render_start = GetTime();
+    int changed = updateScreen(&screen, render_mode);
+#ifdef CHIP8_CUSTOM_FRAME_CONTROL
+    if (!changed && !show_stats && !latest.turbo && !latest.rewinding && !quickMessageShown(&quick)) {
+      endFrame(0, next_frame);
+      continue;
+    }
+#endif
     BeginDrawing();
-    ClearBackground(BLACK);
-    for (int i = 0; i < SCREEN_HEIGHT; i++) {
-      for (int j = 0; j < SCREEN_WIDTH; j++) {
-        if (chip8.video[i][j]) {
-          DrawRectangle(j * CELL_SIZE, i * CELL_SIZE, CELL_SIZE, CELL_SIZE, WHITE);
-        }
-      }
+    drawScreen(&screen, render_mode);
+    if (changed) {
+      // unchanged frames cost next to nothing on either path
+      double elapsed_ms = (GetTime() - render_start) * 1000;
+      render_ms[render_mode] += (elapsed_ms - render_ms[render_mode]) * 0.05;
+    }
+
+    if (latest.rewinding) {
+      const char *text = TextFormat("REWIND %.1f s left", latest.rewind.frames / (double)SCHED_TICK_RATE);
+      int width = MeasureText(text, 20);
+      DrawRectangle(SCREEN_WIDTH * CELL_SIZE - width - 16, 0, width + 16, 28, Fade(DARKBLUE, 0.8f));
+      DrawText(text, SCREEN_WIDTH * CELL_SIZE - width - 8, 4, 20, WHITE);
+    } else if (latest.turbo) {
+      const char *text = TextFormat("TURBO %.1f MIPS, %.0fx (F3)", emulated_ips / 1e6, emulated_ips / ips);
+      int width = MeasureText(text, 20);
+      DrawRectangle(SCREEN_WIDTH * CELL_SIZE - width - 16, 0, width + 16, 28, Fade(MAROON, 0.8f));
+      DrawText(text, SCREEN_WIDTH * CELL_SIZE - width - 8, 4, 20, WHITE);
+    }
+    if (show_stats) {
+      DrawRectangle(0, 0, 330, 160, Fade(DARKGRAY, 0.8f));
+      DrawFPS(8, 6);
+      DrawText(TextFormat("render: %s (F2 to switch), %s expansion", render_mode_names[render_mode],
+                          screen.expand->name), 8, 28, 10, YELLOW);
+      DrawText(TextFormat("texture %.3f ms/frame, rects %.3f ms/frame", render_ms[RENDER_TEXTURE],
+                          render_ms[RENDER_RECTS]),
+               8, 46, 10, YELLOW);
+      DrawText(TextFormat("%u of %u frames unchanged", screen.skipped_frames, screen.frames), 8, 64, 10, YELLOW);
+      DrawText(TextFormat("emu loop late by %.3f ms avg, %.3f ms max", emu_jitter_mean_ms(&latest.jitter),
+                          emu_jitter_max_ms(&latest.jitter)),
+               8, 82, 10, YELLOW);
+      DrawText(TextFormat("render loop late by %.3f ms avg, %.3f ms max", emu_jitter_mean_ms(&render_jitter),
+                          emu_jitter_max_ms(&render_jitter)),
+               8, 100, 10, YELLOW);
+      DrawText(TextFormat("%.0f of %u ips (%.2fx), %u stalls, %llu dropped", emulated_ips, ips,
+                          emulated_ips / ips, latest.stalls, (unsigned long long)latest.dropped),
+               8, 118, 10, YELLOW);
+      const RewindStats *history = &latest.rewind;
+      DrawText(TextFormat("rewind %.1f s in %zu of %zu KB, %.0f ns/frame to capture",
+                          history->frames / (double)SCHED_TICK_RATE, history->bytes_used >> 10,
+                          history->bytes_reserved >> 10,
+                          history->captured > 0 ? history->capture_seconds / history->captured * 1e9 : 0.0),
+               8, 136, 10, YELLOW);
+    }
+    if (quickMessageShown(&quick)) {
+      drawQuickMessage(&quick);
     }
     EndDrawing();
-  }
+#ifdef CHIP8_CUSTOM_FRAME_CONTROL
+    endFrame(1, next_frame);
+#endif
+  }
+  emu_stop(&emu);
+  savestate_unmap(quick.mapped);
+  TraceLog(LOG_INFO, "CHIP8: %u of %u frames unchanged and skipped", screen.skipped_frames, screen.frames);
+  TraceLog(LOG_INFO, "CHIP8: emulation loop late by %.3f ms avg, %.3f ms max", emu_jitter_mean_ms(&latest.jitter),
+           emu_jitter_max_ms(&latest.jitter));
+  TraceLog(LOG_INFO, "CHIP8: render loop late by %.3f ms avg, %.3f ms max", emu_jitter_mean_ms(&render_jitter),
+           emu_jitter_max_ms(&render_jitter));
+  unloadScreen(&screen);
+  CloseWindow();
   return 0;
 }
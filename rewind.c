@@ -0,0 +1,412 @@
+#define _POSIX_C_SOURCE 199309L
+#include "rewind.h"
+#include "savestate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*********************************
+    Encoding
+
+    A frame is encoded over ranges of the 64-bit words of its Chip8State:
+    all of them for a keyframe, the registers plus the runs of screen rows
+    and memory blocks the frame covers for a delta. Every word is XORed
+    with the same word of the base (zero for keyframes, the keyframe for
+    deltas). Each range is cut into chunks of up to 64 words, a chunk of n
+    words becomes a mask of (n + 7) / 8 bytes, bit i set if word i
+    changed, followed by the XOR of each word that did. Building the mask
+    and storing the words takes no branch per word, which matters more
+    than the few bytes tokens for runs of words would save.
+ *********************************/
+
+#define REWIND_WORDS (sizeof(Chip8State) / 8)
+#define REWIND_REGS_WORD (offsetof(Chip8State, V) / 8) // V through random_state
+#define REWIND_VIDEO_WORD (offsetof(Chip8State, video) / 8)
+#define REWIND_REGS_WORDS (REWIND_VIDEO_WORD - REWIND_REGS_WORD)
+#define REWIND_MEMORY_WORD (offsetof(Chip8State, memory) / 8)
+#define REWIND_BLOCK_WORDS ((1u << MEMORY_BLOCK_SHIFT) / 8)
+#define REWIND_CHUNK_WORDS 64
+#define REWIND_ENCODED_MAX (REWIND_WORDS * 9) // a mask byte for every word at worst
+// reading the clock costs about as much as a capture, only every
+// REWIND_TIMING_INTERVAL-th one is timed and stands in for the others. A
+// prime, so keyframes are sampled at their share whatever their interval
+#define REWIND_TIMING_INTERVAL 61
+
+#define REWIND_RANGES_MAX 49 // the registers, 16 runs of rows and 32 runs of blocks
+
+typedef struct RewindRange {
+  u16 word; // first word
+  u16 length;
+} RewindRange;
+
+typedef struct RewindFrame {
+  size_t offset; // into the ring
+  u32 size;
+  u8 keyframe;
+  u32 repeats;     // captures since that found the machine unchanged
+  u32 rows;        // screen rows a delta covers
+  uint64_t blocks; // memory blocks a delta covers
+} RewindFrame;
+
+struct Chip8Rewind {
+  u8 *ring;
+  size_t capacity;
+  size_t head; // where the next frame goes
+
+  // frame s (counted from the first capture) is frames[s % max_frames],
+  // the ones held are first..end-1. The oldest is always a keyframe
+  RewindFrame *frames;
+  u32 max_frames;
+  uint64_t first;
+  uint64_t end;
+
+  u32 interval;
+  uint64_t key;        // frame decoded into key_state, deltas are against it
+  u32 key_rows;        // screen rows drawn to since that frame
+  uint64_t key_blocks; // memory blocks written since that frame
+  uint64_t regs[REWIND_REGS_WORDS]; // of the newest frame, to spot idle ones
+  Chip8 *machine; // the one captured, subscribed to its rows as video_id
+  int video_id;   // -1 if all subscriber ids were taken, every row is then dirty
+  RewindStats stats;
+  // the big ones last, an idle capture only reads the fields above
+  Chip8State key_state;
+  Chip8State state; // the newest frame
+  RewindRange ranges[REWIND_RANGES_MAX];
+  u8 encoded[REWIND_ENCODED_MAX];
+};
+
+static const Chip8State zero_state;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// appends a range for each run of set bits, bit b standing for `unit`
+// words from word + b * unit on
+static u32 collect_runs(uint64_t bits, u32 word, u32 unit, RewindRange *ranges) {
+  u32 count = 0;
+  while (bits != 0) {
+    u32 first = __builtin_ctzll(bits);
+    uint64_t clear = ~(bits >> first);
+    // ctz of 0 is undefined, that is a run up to the last bit
+    u32 length = clear != 0 ? (u32)__builtin_ctzll(clear) : 64 - first;
+    ranges[count++] = (RewindRange){word + first * unit, length * unit};
+    bits = first + length < 64 ? bits & (~0ull << (first + length)) : 0;
+  }
+  return count;
+}
+
+// the runs of words a frame is encoded over: all of them for a keyframe,
+// for a delta the registers and the runs of rows and blocks it covers.
+// Returns how many
+static u32 collect_ranges(int keyframe, u32 rows, uint64_t blocks, RewindRange *ranges) {
+  if (keyframe) {
+    ranges[0] = (RewindRange){0, REWIND_WORDS};
+    return 1;
+  }
+  u32 count = 0;
+  ranges[count++] = (RewindRange){REWIND_REGS_WORD, REWIND_REGS_WORDS};
+  count += collect_runs(rows, REWIND_VIDEO_WORD, 1, ranges + count);
+  count += collect_runs(blocks, REWIND_MEMORY_WORD, REWIND_BLOCK_WORDS, ranges + count);
+  return count;
+}
+
+static u8 *encode_range(const u8 *state, const u8 *base, u32 words, u8 *p) {
+  for (u32 chunk = 0; chunk < words; chunk += REWIND_CHUNK_WORDS) {
+    u32 n = words - chunk < REWIND_CHUNK_WORDS ? words - chunk : REWIND_CHUNK_WORDS;
+    u8 *mask = p;
+    p += (n + 7) / 8;
+    uint64_t changed = 0;
+    for (u32 i = 0; i < n; i++) {
+      uint64_t a;
+      uint64_t b;
+      memcpy(&a, state + (chunk + i) * 8, 8);
+      memcpy(&b, base + (chunk + i) * 8, 8);
+      a ^= b;
+      // stored either way, p only moves past it if it changed
+      memcpy(p, &a, 8);
+      uint64_t bit = a != 0;
+      changed |= bit << i;
+      p += bit * 8;
+    }
+    for (u32 byte = 0; byte < (n + 7) / 8; byte++) {
+      mask[byte] = changed >> (byte * 8);
+    }
+  }
+  return p;
+}
+
+static u32 encode(const Chip8State *state, const Chip8State *base, const RewindRange *ranges, u32 count, u8 *out) {
+  u8 *p = out;
+  for (u32 r = 0; r < count; r++) {
+    u32 offset = ranges[r].word * 8;
+    p = encode_range((const u8 *)state + offset, (const u8 *)base + offset, ranges[r].length, p);
+  }
+  return p - out;
+}
+
+// applies an encoded frame to state, which holds its base
+static void decode(Chip8State *state, const RewindRange *ranges, u32 count, const u8 *in) {
+  for (u32 r = 0; r < count; r++) {
+    u8 *words = (u8 *)state + ranges[r].word * 8;
+    for (u32 chunk = 0; chunk < ranges[r].length; chunk += REWIND_CHUNK_WORDS) {
+      u32 n = ranges[r].length - chunk;
+      n = n < REWIND_CHUNK_WORDS ? n : REWIND_CHUNK_WORDS;
+      uint64_t changed = 0;
+      for (u32 byte = 0; byte < (n + 7) / 8; byte++) {
+        changed |= (uint64_t)*in++ << (byte * 8);
+      }
+      while (changed != 0) {
+        u8 *at = words + (chunk + __builtin_ctzll(changed)) * 8;
+        uint64_t word;
+        uint64_t diff;
+        memcpy(&word, at, 8);
+        memcpy(&diff, in, 8);
+        in += 8;
+        word ^= diff;
+        memcpy(at, &word, 8);
+        changed &= changed - 1;
+      }
+    }
+  }
+}
+
+/*********************************
+    Ring
+ *********************************/
+
+static RewindFrame *frame_at(const Chip8Rewind *rewind, uint64_t frame) {
+  return &rewind->frames[frame % rewind->max_frames];
+}
+
+static void forget(Chip8Rewind *rewind, const RewindFrame *frame) {
+  rewind->stats.frames -= 1 + frame->repeats;
+  rewind->stats.keyframes -= frame->keyframe;
+  rewind->stats.bytes_used -= frame->size;
+}
+
+// drops the oldest keyframe and the deltas that depend on it
+static void drop_oldest(Chip8Rewind *rewind) {
+  do {
+    forget(rewind, frame_at(rewind, rewind->first));
+    rewind->first++;
+  } while (rewind->first < rewind->end && !frame_at(rewind, rewind->first)->keyframe);
+  if (rewind->first == rewind->end) {
+    rewind->head = 0;
+  }
+}
+
+// makes room for a frame of size bytes, returns where it goes
+static size_t reserve(Chip8Rewind *rewind, u32 size) {
+  if (rewind->end - rewind->first == rewind->max_frames) {
+    drop_oldest(rewind);
+  }
+  if (rewind->head + size > rewind->capacity) {
+    // too little left at the end of the ring, the frames there go first
+    while (rewind->first < rewind->end && frame_at(rewind, rewind->first)->offset >= rewind->head) {
+      drop_oldest(rewind);
+    }
+    rewind->head = 0;
+  }
+  while (rewind->first < rewind->end) {
+    const RewindFrame *oldest = frame_at(rewind, rewind->first);
+    if (oldest->offset >= rewind->head + size || oldest->offset + oldest->size <= rewind->head) {
+      break;
+    }
+    drop_oldest(rewind);
+  }
+  size_t offset = rewind->head;
+  rewind->head += size;
+  return offset;
+}
+
+static int key_held(const Chip8Rewind *rewind) {
+  return rewind->key >= rewind->first && rewind->key < rewind->end;
+}
+
+// appends rewind->state as a keyframe or as a delta against key_state
+static void store(Chip8Rewind *rewind, int keyframe) {
+  u32 rows = keyframe ? ~0u : rewind->key_rows;
+  uint64_t blocks = keyframe ? ~0ull : rewind->key_blocks;
+  u32 count = collect_ranges(keyframe, rows, blocks, rewind->ranges);
+  u32 size = encode(&rewind->state, keyframe ? &zero_state : &rewind->key_state, rewind->ranges, count,
+                    rewind->encoded);
+  if (size > rewind->capacity) {
+    rewind_clear(rewind);
+    return;
+  }
+  size_t offset = reserve(rewind, size);
+  if (!keyframe && !key_held(rewind)) {
+    // the keyframe made room for this frame, which has to be one now
+    store(rewind, 1);
+    return;
+  }
+  memcpy(rewind->ring + offset, rewind->encoded, size);
+
+  RewindFrame *frame = frame_at(rewind, rewind->end);
+  frame->offset = offset;
+  frame->size = size;
+  frame->keyframe = keyframe;
+  frame->repeats = 0;
+  frame->rows = rows;
+  frame->blocks = blocks;
+  memcpy(rewind->regs, (u8 *)&rewind->state + REWIND_REGS_WORD * 8, sizeof(rewind->regs));
+  if (keyframe) {
+    rewind->key = rewind->end;
+    rewind->key_state = rewind->state;
+    rewind->key_rows = 0;
+    rewind->key_blocks = 0;
+  }
+  rewind->end++;
+
+  rewind->stats.frames++;
+  rewind->stats.keyframes += keyframe;
+  rewind->stats.bytes_used += size;
+  rewind->stats.captured_bytes += size;
+}
+
+/*********************************
+    API
+ *********************************/
+
+Chip8Rewind *rewind_create(size_t bytes, u32 max_frames, u32 keyframe_interval) {
+  if (bytes < REWIND_ENCODED_MAX || max_frames < 2 || keyframe_interval == 0) {
+    printf("A rewind buffer needs at least %u bytes, 2 frames and a keyframe interval\n",
+           (u32)REWIND_ENCODED_MAX);
+    return NULL;
+  }
+  Chip8Rewind *rewind = calloc(1, sizeof(Chip8Rewind));
+  if (rewind == NULL) {
+    return NULL;
+  }
+  rewind->ring = malloc(bytes);
+  rewind->frames = calloc(max_frames, sizeof(RewindFrame));
+  if (rewind->ring == NULL || rewind->frames == NULL) {
+    printf("Error allocating a rewind buffer of %zu bytes\n", bytes);
+    rewind_destroy(rewind);
+    return NULL;
+  }
+  // fault the ring in now rather than one page at a time while capturing
+  memset(rewind->ring, 0, bytes);
+  rewind->capacity = bytes;
+  rewind->max_frames = max_frames;
+  rewind->interval = keyframe_interval;
+  rewind->stats.bytes_reserved = sizeof(Chip8Rewind) + bytes + max_frames * sizeof(RewindFrame);
+  return rewind;
+}
+
+void rewind_destroy(Chip8Rewind *rewind) {
+  if (rewind == NULL) {
+    return;
+  }
+  rewind_clear(rewind);
+  free(rewind->ring);
+  free(rewind->frames);
+  free(rewind);
+}
+
+void rewind_clear(Chip8Rewind *rewind) {
+  if (rewind->machine != NULL && rewind->video_id >= 0) {
+    video_unsubscribe(rewind->machine, rewind->video_id);
+  }
+  rewind->machine = NULL;
+  rewind->first = rewind->end = rewind->key = 0;
+  rewind->head = 0;
+  rewind->stats.frames = 0;
+  rewind->stats.keyframes = 0;
+  rewind->stats.bytes_used = 0;
+}
+
+void rewind_capture(Chip8Rewind *rewind, Chip8 *chip8) {
+  int timed = rewind->stats.captured % REWIND_TIMING_INTERVAL == 0;
+  double start = timed ? now_seconds() : 0;
+  if (rewind->machine != chip8) {
+    // a new subscriber starts with every row dirty, and the first capture
+    // is a keyframe anyway
+    rewind->machine = chip8;
+    rewind->video_id = video_subscribe(chip8);
+  }
+  u32 rows = rewind->video_id >= 0 ? video_take_dirty(chip8, rewind->video_id) : ~0u;
+  // a delta only looks at the rows and memory written since its keyframe,
+  // and rewind->state still holds the rest from the last capture, so only
+  // what changed since then is copied
+  int keyframe = !key_held(rewind) || rewind->end - rewind->key >= rewind->interval;
+  savestate_snapshot_blocks(chip8, &rewind->state, keyframe ? ~0u : rows,
+                            keyframe ? ~0ull : chip8->memory_dirty);
+  if (!keyframe && rows == 0 && chip8->memory_dirty == 0 &&
+      memcmp((u8 *)&rewind->state + REWIND_REGS_WORD * 8, rewind->regs, sizeof(rewind->regs)) == 0) {
+    // nothing but an idle loop ran, the newest frame stands for this one too
+    frame_at(rewind, rewind->end - 1)->repeats++;
+    rewind->stats.frames++;
+  } else {
+    rewind->key_rows |= rows;
+    rewind->key_blocks |= chip8->memory_dirty;
+    chip8->memory_dirty = 0;
+    store(rewind, keyframe);
+  }
+  rewind->stats.captured++;
+  if (timed) {
+    rewind->stats.capture_seconds += (now_seconds() - start) * REWIND_TIMING_INTERVAL;
+  }
+}
+
+// after restoring rewind->state: the rows and memory it changed are no news
+// to the buffer, the other subscribers still get the rows
+static void forget_dirty(Chip8Rewind *rewind, Chip8 *chip8) {
+  if (rewind->machine == chip8 && rewind->video_id >= 0) {
+    video_take_dirty(chip8, rewind->video_id);
+  }
+  chip8->memory_dirty = 0;
+}
+
+int rewind_step(Chip8Rewind *rewind, Chip8 *chip8) {
+  if (rewind->end > rewind->first && frame_at(rewind, rewind->end - 1)->repeats > 0) {
+    // the frame before is the same one, which rewind->state still holds
+    frame_at(rewind, rewind->end - 1)->repeats--;
+    rewind->stats.frames--;
+    savestate_restore(chip8, &rewind->state);
+    forget_dirty(rewind, chip8);
+    return 0;
+  }
+  if (rewind->end - rewind->first < 2) {
+    return -1;
+  }
+  rewind->end--;
+  const RewindFrame *dropped = frame_at(rewind, rewind->end);
+  forget(rewind, dropped);
+  rewind->head = dropped->offset;
+
+  uint64_t target = rewind->end - 1;
+  uint64_t key = target;
+  while (!frame_at(rewind, key)->keyframe) {
+    key--;
+  }
+  if (key != rewind->key || !key_held(rewind)) {
+    const RewindFrame *frame = frame_at(rewind, key);
+    rewind->key_state = zero_state;
+    u32 count = collect_ranges(1, 0, 0, rewind->ranges);
+    decode(&rewind->key_state, rewind->ranges, count, rewind->ring + frame->offset);
+    rewind->key = key;
+  }
+  const RewindFrame *frame = frame_at(rewind, target);
+  rewind->state = rewind->key_state;
+  if (!frame->keyframe) {
+    u32 count = collect_ranges(0, frame->rows, frame->blocks, rewind->ranges);
+    decode(&rewind->state, rewind->ranges, count, rewind->ring + frame->offset);
+  }
+  memcpy(rewind->regs, (u8 *)&rewind->state + REWIND_REGS_WORD * 8, sizeof(rewind->regs));
+  savestate_restore(chip8, &rewind->state);
+  // the machine is target again, which differs from the keyframe in the
+  // rows and blocks its delta covers
+  forget_dirty(rewind, chip8);
+  rewind->key_rows = frame->keyframe ? 0 : frame->rows;
+  rewind->key_blocks = frame->keyframe ? 0 : frame->blocks;
+  return 0;
+}
+
+const RewindStats *rewind_stats(const Chip8Rewind *rewind) {
+  return &rewind->stats;
+}
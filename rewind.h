@@ -0,0 +1,58 @@
+#ifndef CHIP8_REWIND_H
+#define CHIP8_REWIND_H
+
+#include "chip8.h"
+#include <stddef.h>
+
+/*********************************
+    Rewind buffer
+
+    Keeps the last frames of a machine, one save state (savestate.h) per
+    frame, so a frontend can run the game backwards one frame per tick.
+
+    Every keyframe_interval frames a keyframe is stored whole, the ones
+    in between only as the XOR against their keyframe, a bit per 64-bit
+    word saying whether it changed followed by the words that did. A
+    delta only looks at the registers and the screen rows and memory
+    blocks written since its keyframe, which are usually a few variables
+    and sprites. The buffer subscribes to the machine's dirty rows
+    (video_subscribe) on its first capture and reads Chip8.memory_dirty.
+    Going back one frame decodes at most one keyframe and one delta.
+
+    A capture that finds nothing but the same registers (a game waiting
+    in an idle loop) only counts as another copy of the newest frame. A
+    capture takes around a hundred nanoseconds (chip8-bench), a few
+    millionths of a 60Hz frame, so frontends capture every frame.
+
+    Frames go into a ring of `bytes` bytes, the oldest keyframe and its
+    deltas are dropped once the ring is full or holds max_frames frames.
+ *********************************/
+
+typedef struct RewindStats {
+  u32 frames;            // held right now
+  u32 keyframes;         // of those
+  size_t bytes_used;     // by the frames held
+  size_t bytes_reserved; // ring, frame index and work space
+  uint64_t captured;     // frames captured so far
+  uint64_t captured_bytes; // encoded size of all of them
+  double capture_seconds;  // spent in rewind_capture, sampled
+} RewindStats;
+
+typedef struct Chip8Rewind Chip8Rewind;
+
+// NULL on errors
+Chip8Rewind *rewind_create(size_t bytes, u32 max_frames, u32 keyframe_interval);
+void rewind_destroy(Chip8Rewind *rewind);
+// drops every frame, the next capture is a keyframe. Both unsubscribe from
+// the machine captured so far, which has to outlive the buffer until then
+void rewind_clear(Chip8Rewind *rewind);
+// appends the machine as the newest frame, once per frame. Takes the
+// buffer's dirty rows and clears chip8->memory_dirty, a machine should only
+// be captured by one buffer
+void rewind_capture(Chip8Rewind *rewind, Chip8 *chip8);
+// drops the newest frame and restores the one before it, -1 if there is
+// none left
+int rewind_step(Chip8Rewind *rewind, Chip8 *chip8);
+const RewindStats *rewind_stats(const Chip8Rewind *rewind);
+
+#endif
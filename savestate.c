@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 200112L
+#include "savestate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#define SAVESTATE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SAVESTATE_BLOCK 64 // bytes of memory compared at once by restore
+
+int savestate_check(const Chip8State *state) {
+  if (state->magic != SAVESTATE_MAGIC || state->version != SAVESTATE_VERSION ||
+      state->size != sizeof(Chip8State)) {
+    return -1;
+  }
+  // pc, the stack and sp are masked by savestate_restore instead, a live
+  // machine can run them past memory and the stack. I never leaves memory
+  return state->quirks < QUIRKS_COUNT && state->I <= ADDRESS_MASK ? 0 : -1;
+}
+
+void savestate_snapshot(const Chip8 *chip8, Chip8State *state) {
+  savestate_snapshot_blocks(chip8, state, ~0u, ~0ull);
+}
+
+void savestate_snapshot_blocks(const Chip8 *chip8, Chip8State *state, u32 rows, uint64_t blocks) {
+  state->magic = SAVESTATE_MAGIC;
+  state->version = SAVESTATE_VERSION;
+  state->size = sizeof(Chip8State);
+  memcpy(state->V, chip8->V, sizeof(state->V));
+  state->I = chip8->I;
+  state->pc = chip8->pc;
+  memcpy(state->stack, chip8->stack, sizeof(state->stack));
+  state->sp = chip8->sp;
+  state->delay_timer = chip8->delay_timer;
+  state->sound_timer = chip8->sound_timer;
+  state->quirks = chip8->quirks;
+  memcpy(state->keypad, chip8->keypad, sizeof(state->keypad));
+  state->random_state = chip8->random_state;
+  if (rows == ~0u) {
+    memcpy(state->video, chip8->video, sizeof(state->video));
+  } else {
+    for (; rows != 0; rows &= rows - 1) {
+      u32 y = __builtin_ctz(rows);
+      state->video[y] = chip8->video[y];
+    }
+  }
+  if (blocks == ~0ull) {
+    memcpy(state->memory, chip8->memory, sizeof(state->memory));
+    return;
+  }
+  while (blocks != 0) {
+    u32 offset = __builtin_ctzll(blocks) << MEMORY_BLOCK_SHIFT;
+    memcpy(state->memory + offset, chip8->memory + offset, 1u << MEMORY_BLOCK_SHIFT);
+    blocks &= blocks - 1;
+  }
+}
+
+// copies the blocks of memory that differ, dropping the code decoded from
+// each run of them. A state restored for run-ahead or a search is usually a
+// few frames old and only differs in a handful of variables
+static void restore_memory(Chip8 *chip8, const u8 *memory) {
+  if (memcmp(chip8->memory, memory, sizeof(chip8->memory)) == 0) {
+    return;
+  }
+  u32 run = 0; // start of the current run of changed blocks
+  u32 in_run = 0;
+  for (u32 address = 0; address <= sizeof(chip8->memory); address += SAVESTATE_BLOCK) {
+    int changed = address < sizeof(chip8->memory) &&
+                  memcmp(chip8->memory + address, memory + address, SAVESTATE_BLOCK) != 0;
+    if (changed && !in_run) {
+      run = address;
+      in_run = 1;
+    } else if (!changed && in_run) {
+      memcpy(chip8->memory + run, memory + run, address - run);
+      invalidate_code(chip8, run, address - run);
+      in_run = 0;
+    }
+  }
+}
+
+int savestate_restore(Chip8 *chip8, const Chip8State *state) {
+  if (savestate_check(state) != 0) {
+    printf("Not a save state of version %d\n", SAVESTATE_VERSION);
+    return -1;
+  }
+  // a different profile drops all decoded code anyway
+  set_quirks(chip8, state->quirks);
+  restore_memory(chip8, state->memory);
+
+  u32 rows = 0;
+  for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
+    rows |= (u32)(chip8->video[y] != state->video[y]) << y;
+  }
+  memcpy(chip8->video, state->video, sizeof(chip8->video));
+  chip8->video_dirty |= rows;
+
+  memcpy(chip8->V, state->V, sizeof(chip8->V));
+  chip8->I = state->I;
+  // the machine only ever uses these masked, so masking them here changes
+  // nothing for it but keeps a crafted state from pointing outside of it
+  chip8->pc = state->pc & ADDRESS_MASK;
+  for (u32 i = 0; i < 16; i++) {
+    chip8->stack[i] = state->stack[i] & ADDRESS_MASK;
+  }
+  chip8->sp = state->sp & STACK_MASK;
+  chip8->delay_timer = state->delay_timer;
+  chip8->sound_timer = state->sound_timer;
+  memcpy(chip8->keypad, state->keypad, sizeof(chip8->keypad));
+  chip8->random_state = state->random_state;
+  return 0;
+}
+
+/*********************************
+    files
+ *********************************/
+
+int savestate_write(const Chip8State *state, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    printf("Error opening `%s`\n", path);
+    return -1;
+  }
+  size_t written = fwrite(state, sizeof(Chip8State), 1, file);
+  if (fclose(file) != 0 || written != 1) {
+    printf("Error writing `%s`\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+#ifdef SAVESTATE_MMAP
+
+const Chip8State *savestate_map(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    printf("Error opening `%s`\n", path);
+    return NULL;
+  }
+  struct stat st;
+  void *mapped = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Chip8State)) {
+    mapped = mmap(NULL, sizeof(Chip8State), PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    printf("`%s` is not a save state\n", path);
+    return NULL;
+  }
+  if (savestate_check(mapped) != 0) {
+    printf("`%s` is not a save state of version %d\n", path, SAVESTATE_VERSION);
+    munmap(mapped, sizeof(Chip8State));
+    return NULL;
+  }
+  return mapped;
+}
+
+void savestate_unmap(const Chip8State *state) {
+  if (state != NULL) {
+    munmap((void *)state, sizeof(Chip8State));
+  }
+}
+
+#else
+
+const Chip8State *savestate_map(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    printf("Error opening `%s`\n", path);
+    return NULL;
+  }
+  Chip8State *state = malloc(sizeof(Chip8State));
+  size_t count = state != NULL ? fread(state, sizeof(Chip8State), 1, file) : 0;
+  fclose(file);
+  if (count != 1 || savestate_check(state) != 0) {
+    printf("`%s` is not a save state of version %d\n", path, SAVESTATE_VERSION);
+    free(state);
+    return NULL;
+  }
+  return state;
+}
+
+void savestate_unmap(const Chip8State *state) {
+  free((void *)state);
+}
+
+#endif
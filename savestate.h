@@ -0,0 +1,82 @@
+#ifndef CHIP8_SAVESTATE_H
+#define CHIP8_SAVESTATE_H
+
+#include "chip8.h"
+
+/*********************************
+    Save states
+
+    Everything a running Chip8 needs to continue where it left off:
+    registers, stack, timers, memory, screen, keypad, the Cxkk generator and
+    the quirk profile. Caches, hooks and statistics are not part of it, they
+    belong to the machine a state is restored into.
+
+    Chip8State is also the file format, written as is in the host's byte
+    order (little endian on everything the emulator builds for) and without
+    padding, so a file can be mapped and handed to savestate_restore
+    without parsing. Fields are only ever appended, SAVESTATE_VERSION goes
+    up when they are and restore refuses versions it does not know.
+
+    offset  size  field
+         0     4  magic "C8SS"
+         4     2  version
+         6     2  size, sizeof(Chip8State)
+         8    16  V0-VF
+        24     2  I
+        26     2  pc
+        28    32  stack
+        60     1  sp
+        61     1  delay timer
+        62     1  sound timer
+        63     1  quirk profile (Chip8Quirks)
+        64    16  keypad
+        80     8  random state
+        88   256  screen, the SCREEN_HEIGHT rows of Chip8.video
+       344  4096  memory
+ *********************************/
+
+#define SAVESTATE_MAGIC 0x53533843 // "C8SS" in memory
+#define SAVESTATE_VERSION 1
+
+typedef struct Chip8State {
+  u32 magic;
+  u16 version;
+  u16 size;
+  u8 V[16];
+  u16 I;
+  u16 pc;
+  u16 stack[16];
+  u8 sp;
+  u8 delay_timer;
+  u8 sound_timer;
+  u8 quirks;
+  u8 keypad[KEYPAD_MAX];
+  uint64_t random_state;
+  uint64_t video[SCREEN_HEIGHT];
+  u8 memory[4096];
+} Chip8State;
+
+// copies the machine into state, a handful of memcpys
+void savestate_snapshot(const Chip8 *chip8, Chip8State *state);
+// same, but only copies the screen rows set in `rows` and the memory
+// blocks set in `blocks` (see Chip8.video_dirty and Chip8.memory_dirty),
+// the rest of state->video and state->memory is left as it is
+void savestate_snapshot_blocks(const Chip8 *chip8, Chip8State *state, u32 rows, uint64_t blocks);
+// puts the machine back into state. Only the code that changed is dropped
+// from the predecode cache (and the JIT through on_code_write) and only the
+// rows that changed are marked dirty, so restoring a recent state is about
+// as cheap as taking it. The machine has to be set up with init_chip8.
+// returns -1 and leaves chip8 alone if state is not a valid save state
+int savestate_restore(Chip8 *chip8, const Chip8State *state);
+// 0 if state has the magic, a known version, the right size, a known quirks
+// profile and I inside memory
+int savestate_check(const Chip8State *state);
+
+// writes state to path, -1 on errors
+int savestate_write(const Chip8State *state, const char *path);
+// maps the file at path read only, NULL if it can not be read or is not a
+// valid save state. Hosts without mmap read it into memory instead
+const Chip8State *savestate_map(const char *path);
+void savestate_unmap(const Chip8State *state);
+
+#endif
@@ -0,0 +1,84 @@
+#include "sched.h"
+
+// instructions executed when timer tick `tick` is due, the first
+// instruction boundary at or after tick / SCHED_TICK_RATE seconds
+static uint64_t tick_boundary(const Chip8Sched *sched, uint64_t tick) {
+  return (tick * sched->ips + SCHED_TICK_RATE - 1) / SCHED_TICK_RATE;
+}
+
+static void tick_timers(Chip8 *chip8) {
+  if (chip8->delay_timer > 0) chip8->delay_timer--;
+  if (chip8->sound_timer > 0) chip8->sound_timer--;
+}
+
+void sched_init(Chip8Sched *sched, Chip8RunFunc run, u32 ips, double now) {
+  *sched = (Chip8Sched){0};
+  sched->run = run;
+  sched->ips = ips > 0 ? ips : 1;
+  sched->catch_up = SCHED_DEFAULT_CATCH_UP;
+  sched->origin = now;
+}
+
+void sched_advance(Chip8Sched *sched, Chip8 *chip8, uint64_t n) {
+  for (;;) {
+    uint64_t boundary = tick_boundary(sched, sched->ticks + 1);
+    // below SCHED_TICK_RATE several ticks can share a boundary
+    while (sched->instructions == boundary) {
+      tick_timers(chip8);
+      sched->ticks++;
+      boundary = tick_boundary(sched, sched->ticks + 1);
+    }
+    if (n == 0) {
+      return;
+    }
+    uint64_t chunk = boundary - sched->instructions;
+    if (chunk > n) {
+      chunk = n;
+    }
+    if (chunk > UINT32_MAX) {
+      chunk = UINT32_MAX;
+    }
+    sched->run(chip8, (u32)chunk);
+    sched->instructions += chunk;
+    n -= chunk;
+  }
+}
+
+void sched_run_ticks(Chip8Sched *sched, Chip8 *chip8, uint64_t ticks) {
+  sched_advance(sched, chip8, tick_boundary(sched, sched->ticks + ticks) - sched->instructions);
+}
+
+void sched_run_frame(Chip8Sched *sched, Chip8 *chip8, uint64_t limit) {
+  uint64_t boundary = tick_boundary(sched, sched->ticks + 1);
+  if (boundary > limit) {
+    boundary = limit > sched->instructions ? limit : sched->instructions;
+  }
+  sched_advance(sched, chip8, boundary - sched->instructions);
+}
+
+uint64_t sched_run_until(Chip8Sched *sched, Chip8 *chip8, double now) {
+  double due = (now - sched->origin) * sched->ips;
+  if (due < (double)sched->instructions + 1) {
+    return 0;
+  }
+  uint64_t target = (uint64_t)due;
+  uint64_t limit = (uint64_t)(sched->catch_up * sched->ips);
+  if (target - sched->instructions > limit) {
+    uint64_t dropped = target - sched->instructions - limit;
+    sched->stalls++;
+    sched->dropped += dropped;
+    sched->origin += (double)dropped / sched->ips;
+    target -= dropped;
+  }
+  uint64_t n = target - sched->instructions;
+  sched_advance(sched, chip8, n);
+  return n;
+}
+
+void sched_resync(Chip8Sched *sched, double now) {
+  sched->origin = now - (double)sched->instructions / sched->ips;
+}
+
+double sched_next_tick(const Chip8Sched *sched) {
+  return sched->origin + (double)tick_boundary(sched, sched->ticks + 1) / sched->ips;
+}
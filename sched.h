@@ -0,0 +1,55 @@
+#ifndef CHIP8_SCHED_H
+#define CHIP8_SCHED_H
+
+#include "chip8.h"
+
+/*********************************
+    Instruction and timer scheduling
+
+    Emulated time is counted in instructions. At `ips` instructions per
+    second the delay and sound timers tick after instruction
+    ceil(tick * ips / SCHED_TICK_RATE), so they stay at the same place in the
+    instruction stream no matter how the host slices the work or how fast
+    it renders.
+
+    sched_run_until maps that onto a monotonic host clock: instruction i is
+    due at origin + i / ips. After a stall (debugger, suspend, a slow
+    machine) at most catch_up seconds of backlog are run at once, the rest
+    is dropped by moving origin forward instead of racing to make it up.
+ *********************************/
+
+#define SCHED_TICK_RATE 60           // delay and sound timer frequency
+#define SCHED_DEFAULT_IPS 700
+#define SCHED_DEFAULT_CATCH_UP 0.25 // seconds
+
+typedef void (*Chip8RunFunc)(Chip8 *chip8, u32 instructions);
+
+typedef struct Chip8Sched {
+  Chip8RunFunc run;
+  u32 ips;
+  double catch_up;       // most seconds of backlog run at once
+  double origin;         // host time instruction 0 was due
+  uint64_t instructions; // executed so far
+  uint64_t ticks;        // timer ticks so far
+  u32 stalls;            // times the backlog was cut to catch_up
+  uint64_t dropped;      // instructions skipped because of that
+} Chip8Sched;
+
+// starts counting at host time now (seconds of a monotonic clock)
+void sched_init(Chip8Sched *sched, Chip8RunFunc run, u32 ips, double now);
+// runs exactly n instructions, ticking the timers at their boundaries
+void sched_advance(Chip8Sched *sched, Chip8 *chip8, uint64_t n);
+// runs until `ticks` more timer ticks have happened, so a whole number of
+// 60Hz frames
+void sched_run_ticks(Chip8Sched *sched, Chip8 *chip8, uint64_t ticks);
+// runs up to the next timer tick, but not past instruction `limit`
+void sched_run_frame(Chip8Sched *sched, Chip8 *chip8, uint64_t limit);
+// runs everything due by host time now, returns the instructions run
+uint64_t sched_run_until(Chip8Sched *sched, Chip8 *chip8, double now);
+// host time the next timer tick is due
+double sched_next_tick(const Chip8Sched *sched);
+// continues real time scheduling from now, after running instructions
+// with sched_advance at whatever speed (turbo) or pausing
+void sched_resync(Chip8Sched *sched, double now);
+
+#endif
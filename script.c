@@ -0,0 +1,103 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "script.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SCRIPT_LINE_MAX 256
+
+// parses "frame keys..." into event, 0 for blank and comment lines, -1 if invalid
+static int parse_line(char *line, Chip8InputEvent *event) {
+  char *comment = line;
+  while (*comment != '\0' && *comment != '#') {
+    comment++;
+  }
+  *comment = '\0';
+
+  char *p = line;
+  while (isspace((unsigned char)*p)) {
+    p++;
+  }
+  if (*p == '\0') {
+    return 0;
+  }
+  if (!isdigit((unsigned char)*p)) {
+    return -1;
+  }
+  event->frame = strtoull(p, &p, 10);
+  event->keys = 0;
+  int keys = 0;
+  for (;;) {
+    while (isspace((unsigned char)*p)) {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+    if (*p == '-') {
+      p++;
+    } else if (isxdigit((unsigned char)*p)) {
+      int key = isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10;
+      event->keys |= 1u << key;
+      p++;
+    } else {
+      return -1;
+    }
+    keys++;
+  }
+  return keys > 0 ? 1 : -1;
+}
+
+int script_load(Chip8Script *script, const char *file_name) {
+  script->events = NULL;
+  script->count = 0;
+  FILE *file = fopen(file_name, "r");
+  if (file == NULL) {
+    printf("Error opening the input script `%s`, errno: %d\n", file_name, errno);
+    return -1;
+  }
+
+  u32 capacity = 0;
+  char line[SCRIPT_LINE_MAX];
+  for (u32 number = 1; fgets(line, sizeof(line), file) != NULL; number++) {
+    Chip8InputEvent event;
+    int result = parse_line(line, &event);
+    if (result == 0) {
+      continue;
+    }
+    if (result < 0 || (script->count > 0 && event.frame < script->events[script->count - 1].frame)) {
+      printf("%s:%u: expected `frame keys...` with frames going up\n", file_name, number);
+      fclose(file);
+      script_free(script);
+      return -1;
+    }
+    if (script->count == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 64;
+      Chip8InputEvent *events = realloc(script->events, capacity * sizeof(Chip8InputEvent));
+      if (events == NULL) {
+        printf("Error allocating the input script\n");
+        fclose(file);
+        script_free(script);
+        return -1;
+      }
+      script->events = events;
+    }
+    script->events[script->count++] = event;
+  }
+  fclose(file);
+  return 0;
+}
+
+void script_free(Chip8Script *script) {
+  free(script->events);
+  script->events = NULL;
+  script->count = 0;
+}
+
+u16 script_keys(const Chip8Script *script, u32 *cursor, uint64_t frame) {
+  while (*cursor < script->count && script->events[*cursor].frame <= frame) {
+    (*cursor)++;
+  }
+  return *cursor > 0 ? script->events[*cursor - 1].keys : 0;
+}
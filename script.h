@@ -0,0 +1,38 @@
+#ifndef CHIP8_SCRIPT_H
+#define CHIP8_SCRIPT_H
+
+#include "chip8.h"
+
+/*********************************
+    Input scripts
+
+    Drive the keypad of a headless run. One event per line, the keys held
+    from that timer tick (60Hz frame) on until the next event:
+
+      # frame  keys
+      0        -        nothing pressed
+      60       5        key 5
+      75       4 6      keys 4 and 6
+      90       -
+
+    Keys are hex digits, frames have to go up. # starts a comment.
+ *********************************/
+
+typedef struct Chip8InputEvent {
+  uint64_t frame;
+  u16 keys; // bit k for key k
+} Chip8InputEvent;
+
+typedef struct Chip8Script {
+  Chip8InputEvent *events;
+  u32 count;
+} Chip8Script;
+
+// returns -1 and prints the offending line if the file is not a valid script
+int script_load(Chip8Script *script, const char *file_name);
+void script_free(Chip8Script *script);
+// keys held during frame, *cursor starts at 0 and frames have to be asked
+// for in order, so several runs can share one script
+u16 script_keys(const Chip8Script *script, u32 *cursor, uint64_t frame);
+
+#endif